@@ -0,0 +1,763 @@
+// HTTP load generator built on mnetwork's EventLoop (Linux).
+//
+// Closed loop: every connection keeps --pipeline requests in flight and
+// sends the next one as soon as a response arrives.
+// Open loop (--rate): requests are due at fixed intervals whether or not
+// earlier ones have been answered, and latency is measured from when a
+// request was due, not from when it could be sent, so a stalled server is
+// not hidden by the generator slowing down with it.
+//
+// Slow readers (--read-rate): each connection reads at most that many bytes
+// per second, so large responses stay queued on the server side.
+//
+// Build: g++ -std=c++17 -O2 -pthread -I../lib/includes loadgen.cpp -o loadgen
+// Run:   ./loadgen --serve epoll -c 64 -t 2 -d 10
+//        ./loadgen -h 127.0.0.1 -p 8080 -r "GET /" -r "POST /echo 2" --rate 20000
+//        ./loadgen --serve io_uring --idle-timeout 500 --read-rate 8000000 -c 4 -r "GET /file/67108864"
+
+#include "mnetwork.hpp"
+#include <cmath>
+#include <cstdlib>
+#include <netinet/tcp.h>
+using namespace mnetwork;
+
+#ifdef __linux__
+
+using Clock = std::chrono::steady_clock;
+
+struct RequestSpec {
+    string method = "GET";
+    string path = "/";
+    unsigned weight = 1;
+    string wire;                // Serialized request
+};
+
+struct Options {
+    string host = "127.0.0.1";
+    int port = 8080;
+    int connections = 64;
+    int threads = 2;
+    double duration = 10;       // Seconds
+    int pipeline = 1;           // Requests in flight per connection
+    double rate = 0;            // Requests/s over all connections, 0 for closed loop
+    size_t read_rate = 0;       // Bytes/s read per connection, 0 for as fast as possible
+    string body;                // Sent with POST, PUT and PATCH
+    vector<RequestSpec> mix;
+    string json;                // Also write results as JSON here ("-" for stdout)
+    string serve;               // Start an in-process server: select, epoll or io_uring
+    int server_threads = 2;
+    int handler_threads = 0;
+    int idle_timeout_ms = 0;    // keep_alive_timeout_ms of the in-process server, 0 for its default
+    Resolver::Address address;  // host, resolved once before the run
+};
+
+// Latency histogram: 32 linear buckets per power of two of microseconds,
+// so a reported percentile is within about 3% of the true value
+class LatencyHistogram {
+public:
+    static constexpr int sub_buckets = 32;
+    static constexpr int octaves = 36;
+    
+    void record(uint64_t us) {
+        ++buckets_[index(us)];
+        ++count_;
+        sum_ += us;
+        max_ = std::max(max_, us);
+    }
+    
+    void merge(const LatencyHistogram& other) {
+        for (size_t i = 0; i < buckets_.size(); ++i) buckets_[i] += other.buckets_[i];
+        count_ += other.count_;
+        sum_ += other.sum_;
+        max_ = std::max(max_, other.max_);
+    }
+    
+    // Microseconds below which a fraction q of the samples fell
+    uint64_t percentile(double q) const {
+        if (count_ == 0) return 0;
+        uint64_t rank = static_cast<uint64_t>(std::ceil(q * static_cast<double>(count_)));
+        uint64_t seen = 0;
+        for (size_t i = 0; i < buckets_.size(); ++i) {
+            seen += buckets_[i];
+            if (seen >= rank && seen > 0) return std::min(upper(i), max_);
+        }
+        return max_;
+    }
+    
+    uint64_t count() const { return count_; }
+    uint64_t max() const { return max_; }
+    double mean() const { return count_ ? static_cast<double>(sum_) / count_ : 0; }
+
+private:
+    static size_t index(uint64_t us) {
+        if (us < sub_buckets) return static_cast<size_t>(us);
+        int exponent = 63;
+        while (!(us >> exponent)) --exponent;
+        int shift = exponent - 5;       // log2(sub_buckets)
+        size_t i = static_cast<size_t>(shift + 1) * sub_buckets + ((us >> shift) & (sub_buckets - 1));
+        return std::min(i, static_cast<size_t>(octaves * sub_buckets - 1));
+    }
+    
+    // Largest value that falls in bucket i
+    static uint64_t upper(size_t i) {
+        if (i < sub_buckets) return i;
+        size_t shift = i / sub_buckets - 1;
+        return ((sub_buckets + i % sub_buckets + 1) << shift) - 1;
+    }
+    
+    std::array<uint64_t, octaves * sub_buckets> buckets_{};
+    uint64_t count_ = 0;
+    uint64_t sum_ = 0;
+    uint64_t max_ = 0;
+};
+
+struct Results {
+    LatencyHistogram latency;
+    uint64_t responses = 0;
+    uint64_t status[6] = {};    // By status class, [0] for unparseable
+    uint64_t bytes = 0;         // Response bytes, heads included
+    uint64_t connect_errors = 0;
+    uint64_t read_errors = 0;   // Connections lost with requests outstanding
+    uint64_t reconnects = 0;    // Connections the server closed, reopened
+    uint64_t late = 0;          // Open loop: sent after they were due
+    
+    void merge(const Results& other) {
+        latency.merge(other.latency);
+        responses += other.responses;
+        for (int i = 0; i < 6; ++i) status[i] += other.status[i];
+        bytes += other.bytes;
+        connect_errors += other.connect_errors;
+        read_errors += other.read_errors;
+        reconnects += other.reconnects;
+        late += other.late;
+    }
+};
+
+// Finds where one response ends in a receive buffer
+class ResponseScanner {
+public:
+    enum class Result { Incomplete, Complete, Error };
+    
+    // On Complete, length is the size of the response and status its code
+    Result scan(std::string_view data, size_t& length, int& status, bool& close) {
+        size_t head_end = data.find("\r\n\r\n");
+        if (head_end == std::string_view::npos) return Result::Incomplete;
+        std::string_view head = data.substr(0, head_end + 2);
+        if (head.size() < 12 || head.substr(0, 5) != "HTTP/") return Result::Error;
+        status = std::atoi(string(head.substr(9, 3)).c_str());
+        
+        size_t content_length = 0;
+        bool chunked = false;
+        bool has_length = false;
+        close = head.substr(0, 8) == "HTTP/1.0";
+        size_t pos = head.find("\r\n") + 2;
+        while (pos < head.size()) {
+            size_t eol = head.find("\r\n", pos);
+            std::string_view line = head.substr(pos, eol - pos);
+            pos = eol + 2;
+            size_t colon = line.find(':');
+            if (colon == std::string_view::npos) continue;
+            std::string_view name = line.substr(0, colon);
+            std::string_view value = line.substr(colon + 1);
+            while (!value.empty() && value.front() == ' ') value.remove_prefix(1);
+            if (iequals(name, "Content-Length")) {
+                content_length = std::strtoull(string(value).c_str(), nullptr, 10);
+                has_length = true;
+            } else if (iequals(name, "Transfer-Encoding")) {
+                chunked = header_has_token(value, "chunked");
+            } else if (iequals(name, "Connection")) {
+                if (header_has_token(value, "close")) close = true;
+                if (header_has_token(value, "keep-alive")) close = false;
+            }
+        }
+        
+        size_t body = head_end + 4;
+        if (status == 204 || status == 304 || (status >= 100 && status < 200)) {
+            length = body;
+            return Result::Complete;
+        }
+        if (chunked) {
+            size_t at = body;
+            while (true) {
+                size_t eol = data.find("\r\n", at);
+                if (eol == std::string_view::npos) return Result::Incomplete;
+                size_t size = std::strtoull(string(data.substr(at, eol - at)).c_str(), nullptr, 16);
+                at = eol + 2;
+                if (size == 0) {
+                    // Skip trailers up to the empty line
+                    while (true) {
+                        size_t end = data.find("\r\n", at);
+                        if (end == std::string_view::npos) return Result::Incomplete;
+                        bool empty = end == at;
+                        at = end + 2;
+                        if (empty) break;
+                    }
+                    length = at;
+                    return Result::Complete;
+                }
+                if (data.size() < at + size + 2) return Result::Incomplete;
+                at += size + 2;
+            }
+        }
+        if (!has_length) return Result::Error;     // Close-delimited bodies are not benchmarked
+        if (data.size() < body + content_length) return Result::Incomplete;
+        length = body + content_length;
+        return Result::Complete;
+    }
+};
+
+// One worker thread: its connections share one EventLoop
+class Worker {
+public:
+    Worker(const Options& options, int connections, double rate, unsigned seed)
+        : options_(options), loop_(1024), rate_(rate), seed_(seed) {
+        for (const RequestSpec& spec : options_.mix) {
+            for (unsigned i = 0; i < spec.weight; ++i) order_.push_back(&spec);
+        }
+        conns_.resize(connections);
+    }
+    
+    void run(Clock::time_point start, Clock::time_point end) {
+        end_ = end;
+        auto interval = rate_ > 0
+            ? std::chrono::duration_cast<Clock::duration>(
+                  std::chrono::duration<double>(conns_.size() / rate_))
+            : Clock::duration::zero();
+        for (size_t i = 0; i < conns_.size(); ++i) {
+            Conn& conn = conns_[i];
+            conn.next_request = (seed_ + i) % order_.size();
+            conn.interval = interval;
+            // Spread the connections' schedules over one interval
+            conn.due = start + interval * i / conns_.size();
+            connect(conn);
+        }
+        
+        last_read_ = start;
+        while (Clock::now() < end_) {
+            int timeout = options_.read_rate > 0 ? 10 : 100;
+            if (rate_ > 0) {
+                schedule();
+                auto next = next_due();
+                auto wait = std::chrono::duration_cast<std::chrono::milliseconds>(next - Clock::now()).count();
+                timeout = std::min(timeout, static_cast<int>(std::clamp<long long>(wait, 0, 100)));
+            }
+            loop_.run_once(timeout);
+            if (options_.read_rate > 0) read_throttled();
+        }
+        for (Conn& conn : conns_) {
+            if (conn.fd >= 0) {
+                loop_.remove(conn.fd);
+                close(conn.fd);
+                conn.fd = -1;
+            }
+        }
+        loop_.run_once(0);
+    }
+    
+    const Results& results() const { return results_; }
+
+private:
+    struct Conn {
+        int fd = -1;
+        bool connected = false;
+        string in;
+        string out;
+        size_t out_offset = 0;
+        std::deque<Clock::time_point> inflight;     // When each outstanding request was due
+        vector<Clock::time_point> resend;   // Unanswered when the connection was lost
+        size_t next_request = 0;
+        size_t read_budget = 0;             // Bytes it may still read under --read-rate
+        Clock::time_point due;              // Open loop: when the next request is due
+        Clock::duration interval{};
+    };
+    
+    void connect(Conn& conn) {
+        const Resolver::Address& address = options_.address;
+        int fd = socket(address.family(), SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+        if (fd < 0) {
+            ++results_.connect_errors;
+            return;
+        }
+        int one = 1;
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+        if (options_.read_rate > 0) {
+            // Keep the kernel from soaking up the response a slow reader is meant to hold back
+            int buffer = 65536;
+            setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &buffer, sizeof(buffer));
+        }
+        if (::connect(fd, address.get(), address.length) < 0 && errno != EINPROGRESS) {
+            ++results_.connect_errors;
+            close(fd);
+            return;
+        }
+        conn.fd = fd;
+        conn.connected = false;
+        conn.in.clear();
+        conn.out.clear();
+        conn.out_offset = 0;
+        loop_.add(fd, EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET, [this, &conn](uint32_t events) {
+            on_event(conn, events);
+        });
+    }
+    
+    void on_event(Conn& conn, uint32_t events) {
+        // Each step may drop the connection and open a new one in its place
+        int fd = conn.fd;
+        if (!conn.connected && (events & EPOLLOUT)) {
+            int error = 0;
+            socklen_t size = sizeof(error);
+            getsockopt(conn.fd, SOL_SOCKET, SO_ERROR, &error, &size);
+            if (error != 0) {
+                ++results_.connect_errors;
+                drop(conn, false);
+                return;
+            }
+            conn.connected = true;
+            // Requests left over from a lost connection go first, still timed
+            // from when they were due
+            for (Clock::time_point due : conn.resend) {
+                enqueue(conn, due);
+            }
+            conn.resend.clear();
+            if (rate_ <= 0) {
+                while (static_cast<int>(conn.inflight.size()) < options_.pipeline) {
+                    enqueue(conn, Clock::now());
+                }
+            } else {
+                send_due(conn, Clock::now());
+            }
+        }
+        if ((events & EPOLLIN) && !receive(conn)) return;
+        if (conn.connected) {
+            flush(conn);
+        }
+        if (conn.fd == fd && (events & (EPOLLERR | EPOLLHUP | EPOLLRDHUP))) {
+            drop(conn, true);
+        }
+    }
+    
+    void enqueue(Conn& conn, Clock::time_point due) {
+        const RequestSpec& spec = *order_[conn.next_request];
+        conn.next_request = (conn.next_request + 1) % order_.size();
+        conn.out.append(spec.wire);
+        conn.inflight.push_back(due);
+    }
+    
+    // Open loop: send every request that is due and fits in the pipeline
+    void send_due(Conn& conn, Clock::time_point now) {
+        bool queued = false;
+        while (conn.due <= now && static_cast<int>(conn.inflight.size()) < options_.pipeline) {
+            if (now - conn.due > std::chrono::milliseconds(1)) ++results_.late;
+            enqueue(conn, conn.due);
+            conn.due += conn.interval;
+            queued = true;
+        }
+        if (queued) flush(conn);
+    }
+    
+    void schedule() {
+        auto now = Clock::now();
+        for (Conn& conn : conns_) {
+            if (conn.fd >= 0 && conn.connected) send_due(conn, now);
+        }
+    }
+    
+    Clock::time_point next_due() const {
+        auto next = end_;
+        for (const Conn& conn : conns_) {
+            if (conn.fd >= 0 && static_cast<int>(conn.inflight.size()) < options_.pipeline) {
+                next = std::min(next, conn.due);
+            }
+        }
+        return next;
+    }
+    
+    void flush(Conn& conn) {
+        while (conn.out_offset < conn.out.size()) {
+            ssize_t n = send(conn.fd, conn.out.data() + conn.out_offset,
+                             conn.out.size() - conn.out_offset, MSG_NOSIGNAL);
+            if (n <= 0) {
+                if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) return;
+                drop(conn, true);
+                return;
+            }
+            conn.out_offset += static_cast<size_t>(n);
+        }
+        conn.out.clear();
+        conn.out_offset = 0;
+    }
+    
+    // Slow readers: grant every connection its share of --read-rate since the
+    // last call and read that much. Edge-triggered events do not repeat for
+    // data left unread, so this runs after every loop iteration.
+    void read_throttled() {
+        auto now = Clock::now();
+        auto grant = static_cast<size_t>(options_.read_rate * std::chrono::duration<double>(now - last_read_).count());
+        last_read_ = now;
+        for (Conn& conn : conns_) {
+            if (conn.fd < 0 || !conn.connected) continue;
+            conn.read_budget = std::min(conn.read_budget + grant, options_.read_rate);
+            if (receive(conn)) flush(conn);
+        }
+    }
+    
+    // Read and account every complete response; false if the connection was dropped
+    bool receive(Conn& conn) {
+        char buffer[65536];
+        bool closed = false;
+        while (true) {
+            size_t want = sizeof(buffer);
+            if (options_.read_rate > 0) {
+                want = std::min(want, conn.read_budget);
+                if (want == 0) break;
+            }
+            ssize_t n = recv(conn.fd, buffer, want, 0);
+            if (n > 0) {
+                conn.in.append(buffer, static_cast<size_t>(n));
+                if (options_.read_rate > 0) conn.read_budget -= static_cast<size_t>(n);
+                continue;
+            }
+            if (n == 0) closed = true;
+            else if (errno != EAGAIN && errno != EWOULDBLOCK) closed = true;
+            break;
+        }
+        
+        size_t offset = 0;
+        bool server_closes = false;
+        auto now = Clock::now();
+        while (!conn.inflight.empty()) {
+            size_t length = 0;
+            int status = 0;
+            auto result = scanner_.scan(std::string_view(conn.in).substr(offset), length, status, server_closes);
+            if (result == ResponseScanner::Result::Incomplete) break;
+            if (result == ResponseScanner::Result::Error) {
+                closed = true;
+                break;
+            }
+            offset += length;
+            if (now <= end_) {
+                auto latency = std::chrono::duration_cast<std::chrono::microseconds>(now - conn.inflight.front());
+                results_.latency.record(static_cast<uint64_t>(std::max<int64_t>(latency.count(), 0)));
+                ++results_.responses;
+                ++results_.status[status >= 100 && status < 600 ? status / 100 : 0];
+                results_.bytes += length;
+            }
+            conn.inflight.pop_front();
+            if (server_closes) break;
+            if (rate_ <= 0 && now < end_) {
+                enqueue(conn, now);
+            }
+        }
+        conn.in.erase(0, offset);
+        
+        if (closed || server_closes) {
+            // Requests pipelined behind a Connection: close are resent
+            drop(conn, !server_closes);
+            return false;
+        }
+        if (rate_ > 0) send_due(conn, now);
+        return true;
+    }
+    
+    // Close the connection and open a new one; unanswered requests are resent
+    void drop(Conn& conn, bool error) {
+        if (conn.fd < 0) return;
+        if (error && !conn.inflight.empty()) ++results_.read_errors;
+        if (!error) ++results_.reconnects;
+        for (Clock::time_point due : conn.inflight) {
+            conn.resend.push_back(due);
+        }
+        conn.inflight.clear();
+        loop_.remove(conn.fd);
+        close(conn.fd);
+        conn.fd = -1;
+        if (Clock::now() < end_) connect(conn);
+    }
+    
+    const Options& options_;
+    EventLoop loop_;
+    double rate_;
+    size_t seed_;
+    vector<const RequestSpec*> order_;      // Request mix expanded by weight
+    std::deque<Conn> conns_;                // Stable addresses for the callbacks
+    ResponseScanner scanner_;
+    Results results_;
+    Clock::time_point end_;
+    Clock::time_point last_read_;           // When read_throttled() last granted bytes
+};
+
+static void usage() {
+    cout << "Usage: loadgen [options]\n"
+            "  -h, --host HOST          Server address (default 127.0.0.1)\n"
+            "  -p, --port PORT          Server port (default 8080)\n"
+            "  -c, --connections N      Open connections (default 64)\n"
+            "  -t, --threads N          Generator threads (default 2)\n"
+            "  -d, --duration SECONDS   Test length (default 10)\n"
+            "  -P, --pipeline N         Requests in flight per connection (default 1)\n"
+            "  -R, --rate N             Open loop at N requests/s in total (default: closed loop)\n"
+            "  -r, --request \"METHOD PATH [WEIGHT]\"  Add to the request mix (default \"GET /\")\n"
+            "  -b, --body TEXT          Body for POST, PUT and PATCH requests\n"
+            "  -j, --json FILE          Also write the results as JSON (- for stdout)\n"
+            "  --read-rate BYTES        Read at most BYTES/s per connection (default: unlimited)\n"
+            "  --serve MODEL            Benchmark an in-process server: select, epoll or io_uring\n"
+            "  --server-threads N       Worker threads of the in-process server (default 2)\n"
+            "  --handler-threads N      Handler threads of the in-process server (default 0)\n"
+            "  --idle-timeout MS        Keep-alive timeout of the in-process server (default 5000)\n";
+}
+
+static bool parse_options(int argc, char** argv, Options& options) {
+    for (int i = 1; i < argc; ++i) {
+        string arg = argv[i];
+        auto value = [&]() -> string {
+            if (i + 1 >= argc) throw std::invalid_argument("Missing value for " + arg);
+            return argv[++i];
+        };
+        if (arg == "-h" || arg == "--host") options.host = value();
+        else if (arg == "-p" || arg == "--port") options.port = std::stoi(value());
+        else if (arg == "-c" || arg == "--connections") options.connections = std::stoi(value());
+        else if (arg == "-t" || arg == "--threads") options.threads = std::stoi(value());
+        else if (arg == "-d" || arg == "--duration") options.duration = std::stod(value());
+        else if (arg == "-P" || arg == "--pipeline") options.pipeline = std::stoi(value());
+        else if (arg == "-R" || arg == "--rate") options.rate = std::stod(value());
+        else if (arg == "-b" || arg == "--body") options.body = value();
+        else if (arg == "-j" || arg == "--json") options.json = value();
+        else if (arg == "--read-rate") options.read_rate = std::stoull(value());
+        else if (arg == "--serve") options.serve = value();
+        else if (arg == "--server-threads") options.server_threads = std::stoi(value());
+        else if (arg == "--handler-threads") options.handler_threads = std::stoi(value());
+        else if (arg == "--idle-timeout") options.idle_timeout_ms = std::stoi(value());
+        else if (arg == "-r" || arg == "--request") {
+            std::istringstream spec(value());
+            RequestSpec request;
+            if (!(spec >> request.method >> request.path)) {
+                throw std::invalid_argument("Expected \"METHOD PATH [WEIGHT]\" after " + arg);
+            }
+            spec >> request.weight;
+            request.weight = std::max(request.weight, 1u);
+            options.mix.push_back(request);
+        } else if (arg == "--help") {
+            usage();
+            return false;
+        } else {
+            throw std::invalid_argument("Unknown option " + arg);
+        }
+    }
+    if (options.connections < 1 || options.threads < 1 || options.pipeline < 1 || options.duration <= 0) {
+        throw std::invalid_argument("connections, threads, pipeline and duration must be positive");
+    }
+    options.threads = std::min(options.threads, options.connections);
+    if (options.mix.empty()) {
+        options.mix.push_back(RequestSpec());
+    }
+    for (RequestSpec& spec : options.mix) {
+        spec.wire = spec.method + " " + spec.path + " HTTP/1.1\r\nHost: " + host_header(options.host) + "\r\n";
+        if (spec.method == "POST" || spec.method == "PUT" || spec.method == "PATCH") {
+            spec.wire += "Content-Length: " + std::to_string(options.body.size()) + "\r\n\r\n" + options.body;
+        } else {
+            spec.wire += "\r\n";
+        }
+    }
+    return true;
+}
+
+// Routes of the in-process server
+static void add_bench_routes(HttpServer& server) {
+    server.route("/", [](const HttpRequest&, HttpResponse& res) {
+        res.headers["Content-Type"] = "text/plain";
+        res.body = "Hello, World!";
+    });
+    server.route("/bytes/:n", [](const HttpRequest& req, HttpResponse& res) {
+        res.headers["Content-Type"] = "application/octet-stream";
+        res.body.assign(std::strtoull(string(req.param("n")).c_str(), nullptr, 10), 'x');
+    });
+    server.route("/file/:n", [](const HttpRequest& req, HttpResponse& res) {
+        // A sparse file, unlinked once open, so the body goes out through the file path
+        char path[] = "/tmp/loadgen-XXXXXX";
+        int fd = mkstemp(path);
+        if (fd < 0) {
+            res.status_code = 500;
+            res.status_text = "Internal Server Error";
+            return;
+        }
+        off_t size = static_cast<off_t>(std::strtoull(string(req.param("n")).c_str(), nullptr, 10));
+        bool sized = ftruncate(fd, size) == 0;
+        close(fd);
+        if (!sized || !res.send_file(path)) {
+            res.status_code = 500;
+            res.status_text = "Internal Server Error";
+        }
+        unlink(path);
+    });
+    server.route("/stream/:n", [](const HttpRequest& req, HttpResponse& res) {
+        size_t left = std::strtoull(string(req.param("n")).c_str(), nullptr, 10);
+        res.stream([left](ResponseWriter& writer) mutable {
+            size_t piece = std::min<size_t>(left, ResponseWriter::chunk_size);
+            writer.write(string(piece, 'x'));
+            left -= piece;
+            return left > 0;
+        });
+    });
+    server.route("/work/:us", [](const HttpRequest& req, HttpResponse& res) {
+        auto until = Clock::now() + std::chrono::microseconds(std::atoi(string(req.param("us")).c_str()));
+        uint64_t spins = 0;
+        while (Clock::now() < until) ++spins;
+        res.body = std::to_string(spins);
+    });
+    server.route("POST", "/echo", [](const HttpRequest& req, HttpResponse& res) {
+        res.body = req.body;
+    });
+}
+
+static string format_us(double us) {
+    char text[32];
+    if (us < 1000) std::snprintf(text, sizeof(text), "%.0fus", us);
+    else if (us < 1000000) std::snprintf(text, sizeof(text), "%.2fms", us / 1000);
+    else std::snprintf(text, sizeof(text), "%.2fs", us / 1000000);
+    return text;
+}
+
+static void announce(const Options& options) {
+    cout << "Running " << options.duration << "s test @ " << options.host << ":" << options.port << "\n";
+    cout << "  " << options.threads << " threads, " << options.connections << " connections, pipeline "
+         << options.pipeline << ", ";
+    if (options.rate > 0) cout << "open loop at " << options.rate << " req/s\n";
+    else cout << "closed loop\n";
+    cout.flush();
+}
+
+static void report(const Options& options, const Results& results, double seconds) {
+    const LatencyHistogram& latency = results.latency;
+    double rps = results.responses / seconds;
+    double bps = results.bytes / seconds;
+    
+    cout << "  Latency   p50 " << format_us(latency.percentile(0.50))
+         << "  p90 " << format_us(latency.percentile(0.90))
+         << "  p99 " << format_us(latency.percentile(0.99))
+         << "  p99.9 " << format_us(latency.percentile(0.999))
+         << "  max " << format_us(latency.max())
+         << "  mean " << format_us(latency.mean()) << "\n";
+    cout << "  " << results.responses << " responses in " << std::fixed << std::setprecision(2) << seconds
+         << "s (2xx " << results.status[2] << ", 3xx " << results.status[3] << ", 4xx " << results.status[4]
+         << ", 5xx " << results.status[5] << ")\n";
+    if (results.connect_errors || results.read_errors) {
+        cout << "  Errors: connect " << results.connect_errors << ", lost " << results.read_errors << "\n";
+    }
+    if (results.reconnects || results.late) {
+        cout << "  Reconnects " << results.reconnects << ", requests sent more than 1ms late "
+             << results.late << "\n";
+    }
+    cout << "Requests/sec: " << rps << "\n";
+    cout << "Transfer/sec: " << bps / (1 << 20) << " MB\n";
+    cout.unsetf(std::ios::floatfield);
+    
+    if (options.json.empty()) return;
+    std::ostringstream json;
+    json << std::fixed << std::setprecision(3)
+         << "{\"host\":\"" << options.host << "\",\"port\":" << options.port
+         << ",\"connections\":" << options.connections << ",\"threads\":" << options.threads
+         << ",\"pipeline\":" << options.pipeline << ",\"rate\":" << options.rate
+         << ",\"duration\":" << seconds
+         << ",\"requests\":" << results.responses << ",\"bytes\":" << results.bytes
+         << ",\"requests_per_sec\":" << rps << ",\"bytes_per_sec\":" << bps
+         << ",\"status\":{\"2xx\":" << results.status[2] << ",\"3xx\":" << results.status[3]
+         << ",\"4xx\":" << results.status[4] << ",\"5xx\":" << results.status[5] << "}"
+         << ",\"errors\":{\"connect\":" << results.connect_errors << ",\"lost\":" << results.read_errors
+         << "},\"reconnects\":" << results.reconnects << ",\"late\":" << results.late
+         << ",\"latency_us\":{\"p50\":" << latency.percentile(0.50) << ",\"p90\":" << latency.percentile(0.90)
+         << ",\"p99\":" << latency.percentile(0.99) << ",\"p999\":" << latency.percentile(0.999)
+         << ",\"max\":" << latency.max() << ",\"mean\":" << latency.mean() << "}}\n";
+    if (options.json == "-") {
+        cout << json.str();
+    } else {
+        ofstream file(options.json);
+        file << json.str();
+        if (!file) std::cerr << "Failed to write " << options.json << "\n";
+    }
+}
+
+int main(int argc, char** argv) {
+    Options options;
+    try {
+        if (!parse_options(argc, argv, options)) return 0;
+    } catch (const std::exception& e) {
+        std::cerr << e.what() << "\n";
+        usage();
+        return 2;
+    }
+    
+    std::unique_ptr<HttpServer> server;
+    if (!options.serve.empty()) {
+        ServerConfig config;
+        config.host = options.host;
+        config.port = options.port;
+        config.thread_pool_size = options.server_threads;
+        config.handler_threads = options.handler_threads;
+        config.max_connections = std::max(config.max_connections, options.connections);   // Listen backlog
+        config.max_keep_alive_requests = 1 << 30;
+        config.max_pipeline_depth = std::max(16, options.pipeline);
+        if (options.idle_timeout_ms > 0) config.keep_alive_timeout_ms = options.idle_timeout_ms;
+        if (options.serve == "epoll") config.io_model = IoModel::Epoll;
+        else if (options.serve == "io_uring") config.io_model = IoModel::IoUring;
+        else if (options.serve != "select") {
+            std::cerr << "Unknown I/O model " << options.serve << "\n";
+            return 2;
+        }
+        if (config.io_model == IoModel::Select) {
+            // A select worker serves one connection at a time
+            config.thread_pool_size = std::max(config.thread_pool_size, options.connections);
+            config.select_keep_alive = true;
+        }
+        server = std::make_unique<HttpServer>(config);
+        add_bench_routes(*server);
+        if (!server->start()) {
+            std::cerr << "Failed to start the server\n";
+            return 1;
+        }
+    }
+    
+    // Every connection goes to the first address, so the lookup stays out of the measurement
+    try {
+        options.address = Resolver::shared()->resolve(options.host, options.port).front();
+    } catch (const std::exception& e) {
+        std::cerr << e.what() << "\n";
+        return 1;
+    }
+    
+    // Connections and rate are split as evenly as possible across threads
+    vector<std::unique_ptr<Worker>> workers;
+    for (int i = 0; i < options.threads; ++i) {
+        int connections = options.connections / options.threads + (i < options.connections % options.threads);
+        double rate = options.rate * connections / options.connections;
+        workers.push_back(std::make_unique<Worker>(options, connections, rate, static_cast<unsigned>(i)));
+    }
+    
+    announce(options);
+    auto start = Clock::now();
+    auto end = start + std::chrono::duration_cast<Clock::duration>(std::chrono::duration<double>(options.duration));
+    vector<std::thread> threads;
+    for (auto& worker : workers) {
+        threads.emplace_back([&worker, start, end] { worker->run(start, end); });
+    }
+    for (auto& thread : threads) {
+        thread.join();
+    }
+    double seconds = std::chrono::duration<double>(Clock::now() - start).count();
+    
+    Results total;
+    for (const auto& worker : workers) {
+        total.merge(worker->results());
+    }
+    report(options, total, std::min(seconds, options.duration));
+    
+    if (server) server->stop();
+    return 0;
+}
+
+#else
+
+int main() {
+    std::cerr << "loadgen needs Linux (epoll)\n";
+    return 1;
+}
+
+#endif
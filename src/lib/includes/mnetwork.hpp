@@ -17,31 +17,88 @@
 #include <fstream>
 #include <sstream>
 #include <string>
+#include <string_view>
 #include <cstring>
+#include <cstdio>
 #include <vector>
+#include <array>
+#include <deque>
+#include <list>
 #include <map>
+#include <unordered_map>
 #include <thread>
 #include <atomic>
 #include <memory>
+#include <memory_resource>
 #include <functional>
 #include <regex>
 #include <chrono>
 #include <mutex>
+#include <condition_variable>
+#include <future>
+#include <utility>
 #include <iomanip>
 #include <ctime>
+#include <algorithm>
+#include <cerrno>
+#include <charconv>
+#include <stdexcept>
+#include <limits>
 
 #ifdef _WIN32
     #include <winsock2.h>
     #include <ws2tcpip.h>
+    #include <io.h>
+    #include <fcntl.h>
+    #include <sys/stat.h>
     #pragma comment(lib, "ws2_32.lib")
     #define close closesocket
     #define SHUT_RDWR SD_BOTH
 #else
     #include <unistd.h>
     #include <arpa/inet.h>
+    #include <netdb.h>
     #include <sys/socket.h>
     #include <netinet/in.h>
     #include <sys/select.h>
+    #include <sys/stat.h>
+    #include <fcntl.h>
+    #include <sys/uio.h>
+    #include <poll.h>
+    #include <signal.h>
+#endif
+
+#ifdef __linux__
+    #include <sched.h>
+    #include <sys/epoll.h>
+    #include <sys/ioctl.h>
+    #include <netinet/tcp.h>
+    #include <linux/sockios.h>
+    #include <sys/eventfd.h>
+    #include <sys/sendfile.h>
+    #if __has_include(<linux/io_uring.h>)
+        #include <linux/io_uring.h>
+        #include <sys/mman.h>
+        #include <sys/syscall.h>
+        // Multishot recv is the newest feature used; older headers lack it
+        #ifdef IORING_RECV_MULTISHOT
+            #define MNETWORK_HAS_IO_URING 1
+        #endif
+    #endif
+#endif
+
+// Coroutine handlers need C++20 and the epoll EventLoop
+#if defined(__linux__) && defined(__cpp_impl_coroutine) && __has_include(<coroutine>)
+    #include <coroutine>
+    #include <optional>
+    #include <utility>
+    #define MNETWORK_HAS_COROUTINES 1
+#endif
+
+// Response compression needs zlib: define MNETWORK_USE_ZLIB and link with -lz
+#if defined(MNETWORK_USE_ZLIB) && __has_include(<zlib.h>)
+    #include <zlib.h>
+    #define MNETWORK_HAS_ZLIB 1
 #endif
 
 using std::string;
@@ -59,6 +116,13 @@ using std::lock_guard;
 
 namespace mnetwork {
 
+// I/O model used by the worker threads
+enum class IoModel {
+    Select,     // Each worker polls the listener and serves one connection at a time
+    Epoll,      // Each worker runs an edge-triggered epoll reactor (Linux only)
+    IoUring     // Each worker drives an io_uring; falls back to Epoll if unsupported
+};
+
 // Configuration structure
 struct ServerConfig {
     int port = 8080;
@@ -67,6 +131,272 @@ struct ServerConfig {
     int thread_pool_size = 4;
     string host = "0.0.0.0";
     bool verbose = false;
+    IoModel io_model = IoModel::Select;
+    int max_events = 256;               // epoll_wait batch size per worker
+    size_t max_request_size = 1 << 20;  // Upper bound on request head + body bytes
+    size_t max_header_size = 8192;      // Upper bound on request line + headers
+    int keep_alive_timeout_ms = 5000;   // Idle time before a persistent connection is closed
+    int max_keep_alive_requests = 100;  // Requests served per connection (0 disables keep-alive)
+    bool select_keep_alive = false;     // Keep-alive under IoModel::Select, where an idle connection holds a worker
+    int max_pipeline_depth = 16;        // Pipelined responses batched into one write
+    bool reuse_port = false;            // Give each worker its own SO_REUSEPORT listener
+    bool pin_workers = false;           // Pin each worker thread to one CPU core (Linux)
+    vector<int> worker_cpus;            // Cores used when pinning; empty means worker i -> core i
+    unsigned io_uring_entries = 1024;   // Submission queue size per worker (IoUring)
+    unsigned io_uring_buffers = 1024;   // Provided receive buffers per worker, power of two (IoUring)
+    size_t static_cache_size = 16 << 20;        // Bytes of static file contents kept in memory
+    size_t static_cache_max_file_size = 256 << 10;  // Larger files are streamed with sendfile()
+    int static_cache_revalidate_ms = 1000;      // How long a cached file is trusted before stat()
+    size_t request_arena_size = 8192;   // Per-worker req.arena scratch bytes served before the heap
+    size_t buffer_pool_size = 1024;     // Idle receive buffers kept for new connections
+    size_t max_body_size = 64 << 20;    // Larger request bodies get 413 before they are read
+    size_t stream_buffer_size = 64 << 10;   // Streamed response bytes produced ahead of the socket
+    int handler_threads = 0;            // Run handlers on a separate work-stealing pool (0: on the I/O workers)
+    string access_log;                  // File that gets one line per request (empty: none)
+    size_t log_buffer_size = 256 << 10; // Log bytes buffered per thread; records beyond it are dropped
+    int log_flush_interval_ms = 100;    // How often buffered log records are written out
+};
+
+// Case-insensitive ASCII comparison for header names and tokens
+inline bool iequals(std::string_view a, std::string_view b) {
+    if (a.size() != b.size()) return false;
+    for (size_t i = 0; i < a.size(); ++i) {
+        if (std::tolower(static_cast<unsigned char>(a[i])) !=
+            std::tolower(static_cast<unsigned char>(b[i]))) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// True if the comma-separated header value contains token (case-insensitive)
+inline bool header_has_token(std::string_view value, std::string_view token) {
+    size_t pos = 0;
+    while (pos < value.size()) {
+        size_t comma = value.find(',', pos);
+        if (comma == std::string_view::npos) comma = value.size();
+        size_t first = pos;
+        size_t last = comma;
+        while (first < last && (value[first] == ' ' || value[first] == '\t')) ++first;
+        while (last > first && (value[last - 1] == ' ' || value[last - 1] == '\t')) --last;
+        if (iequals(value.substr(first, last - first), token)) return true;
+        pos = comma + 1;
+    }
+    return false;
+}
+
+// Quality an Accept-Encoding value gives coding, from 0 to 1: its own q
+// parameter, else that of "*", else 0 (RFC 9110 12.5.3)
+inline double accept_quality(std::string_view accept, std::string_view coding) {
+    double wildcard = 0;
+    bool has_wildcard = false;
+    size_t pos = 0;
+    while (pos < accept.size()) {
+        size_t comma = accept.find(',', pos);
+        if (comma == std::string_view::npos) comma = accept.size();
+        std::string_view item = accept.substr(pos, comma - pos);
+        pos = comma + 1;
+        
+        size_t semicolon = item.find(';');
+        std::string_view name = item.substr(0, semicolon);
+        while (!name.empty() && (name.front() == ' ' || name.front() == '\t')) name.remove_prefix(1);
+        while (!name.empty() && (name.back() == ' ' || name.back() == '\t')) name.remove_suffix(1);
+        double quality = 1;
+        if (semicolon != std::string_view::npos) {
+            std::string_view params = item.substr(semicolon + 1);
+            size_t q = params.find("q=");
+            if (q == std::string_view::npos) q = params.find("Q=");
+            if (q != std::string_view::npos) {
+                quality = std::strtod(string(params.substr(q + 2)).c_str(), nullptr);
+            }
+        }
+        if (iequals(name, coding)) return quality;
+        if (name == "*") {
+            wildcard = quality;
+            has_wildcard = true;
+        }
+    }
+    return has_wildcard ? wildcard : 0;
+}
+
+// Header fields in arrival order with case-insensitive lookup. Typical
+// header counts fit in the inline array, clear() keeps every string's
+// capacity for the next message, and the headers the server consults on
+// every request are indexed so finding them needs no scan.
+class HeaderMap {
+public:
+    using value_type = std::pair<string, string>;
+    using iterator = value_type*;
+    using const_iterator = const value_type*;
+    
+    static constexpr size_t inline_capacity = 12;
+    
+    HeaderMap() = default;
+    HeaderMap(std::initializer_list<value_type> fields) {
+        for (const auto& field : fields) set(field.first, field.second);
+    }
+    HeaderMap(const HeaderMap&) = default;
+    HeaderMap& operator=(const HeaderMap&) = default;
+    HeaderMap(HeaderMap&& other) noexcept { *this = std::move(other); }
+    HeaderMap& operator=(HeaderMap&& other) noexcept {
+        if (this != &other) {
+            std::move(std::begin(other.inline_), std::end(other.inline_), std::begin(inline_));
+            heap_ = std::move(other.heap_);
+            size_ = other.size_;
+            std::copy(std::begin(other.known_), std::end(other.known_), std::begin(known_));
+            other.heap_.clear();
+            other.clear();
+        }
+        return *this;
+    }
+    
+    iterator begin() { return data(); }
+    iterator end() { return data() + size_; }
+    const_iterator begin() const { return data(); }
+    const_iterator end() const { return data() + size_; }
+    size_t size() const { return size_; }
+    bool empty() const { return size_ == 0; }
+    
+    // Forget every field but keep the storage
+    void clear() {
+        size_ = 0;
+        std::fill(std::begin(known_), std::end(known_), none);
+    }
+    
+    iterator find(std::string_view name) {
+        return data() + index_of(name);
+    }
+    
+    const_iterator find(std::string_view name) const {
+        return data() + index_of(name);
+    }
+    
+    size_t count(std::string_view name) const { return find(name) != end() ? 1 : 0; }
+    
+    // Value of name, or default_val if absent
+    std::string_view get(std::string_view name, std::string_view default_val = {}) const {
+        auto it = find(name);
+        return it != end() ? std::string_view(it->second) : default_val;
+    }
+    
+    // Value for name, inserting an empty one if absent
+    string& operator[](std::string_view name) {
+        auto it = find(name);
+        return it != end() ? it->second : append(name, {}).second;
+    }
+    
+    void set(std::string_view name, std::string_view value) {
+        (*this)[name].assign(value.data(), value.size());
+    }
+    
+    // Add a field without looking for an existing one
+    value_type& append(std::string_view name, std::string_view value) {
+        if (size_ == capacity()) grow();
+        value_type& field = data()[size_];
+        field.first.assign(name.data(), name.size());
+        field.second.assign(value.data(), value.size());
+        int known = known_slot(name);
+        if (known >= 0 && known_[known] == none) known_[known] = static_cast<uint32_t>(size_);
+        ++size_;
+        return field;
+    }
+    
+    size_t erase(std::string_view name) {
+        auto it = find(name);
+        if (it == end()) return 0;
+        erase(it);
+        return 1;
+    }
+    
+    iterator erase(const_iterator position) {
+        size_t index = static_cast<size_t>(position - data());
+        std::rotate(data() + index, data() + index + 1, data() + size_);
+        --size_;
+        reindex();
+        return data() + index;
+    }
+    
+private:
+    static constexpr uint32_t none = 0xffffffff;
+    enum Known { Host, ContentLength, ContentType, Connection, KnownCount };
+    
+    value_type inline_[inline_capacity];
+    vector<value_type> heap_;       // All fields once the inline array overflows
+    size_t size_ = 0;
+    uint32_t known_[KnownCount] = {none, none, none, none};
+    
+    value_type* data() { return heap_.empty() ? inline_ : heap_.data(); }
+    const value_type* data() const { return heap_.empty() ? inline_ : heap_.data(); }
+    size_t capacity() const { return heap_.empty() ? inline_capacity : heap_.size(); }
+    
+    void grow() {
+        vector<value_type> bigger(capacity() * 2);
+        std::move(data(), data() + size_, bigger.begin());
+        heap_.swap(bigger);
+    }
+    
+    // Slot of a well-known header, or -1; one length switch and one compare
+    static int known_slot(std::string_view name) {
+        switch (name.size()) {
+            case 4: return iequals(name, "Host") ? Host : -1;
+            case 10: return iequals(name, "Connection") ? Connection : -1;
+            case 12: return iequals(name, "Content-Type") ? ContentType : -1;
+            case 14: return iequals(name, "Content-Length") ? ContentLength : -1;
+            default: return -1;
+        }
+    }
+    
+    size_t index_of(std::string_view name) const {
+        int known = known_slot(name);
+        if (known >= 0) {
+            return known_[known] == none ? size_ : known_[known];
+        }
+        const value_type* fields = data();
+        for (size_t i = 0; i < size_; ++i) {
+            if (iequals(fields[i].first, name)) return i;
+        }
+        return size_;
+    }
+    
+    void reindex() {
+        std::fill(std::begin(known_), std::end(known_), none);
+        const value_type* fields = data();
+        for (size_t i = size_; i-- > 0;) {
+            int known = known_slot(fields[i].first);
+            if (known >= 0) known_[known] = static_cast<uint32_t>(i);
+        }
+    }
+};
+
+class BodySink;
+class ResponseWriter;
+class Deflater;
+
+// Generates a streamed response body: called whenever the connection can
+// take more, it writes the next part and returns false once the body ends
+using BodyProducer = std::function<bool(ResponseWriter&)>;
+
+// Path parameters captured by the router. Names point into the router and
+// values into HttpRequest::path, so nothing is allocated per request.
+struct RouteParams {
+    static constexpr size_t capacity = 8;
+    
+    struct Param {
+        std::string_view name;
+        std::string_view value;
+    };
+    
+    Param items[capacity];
+    size_t count = 0;
+    
+    std::string_view get(std::string_view name, std::string_view default_val = {}) const {
+        for (size_t i = 0; i < count; ++i) {
+            if (items[i].name == name) return items[i].value;
+        }
+        return default_val;
+    }
+    
+    void clear() { count = 0; }
 };
 
 // HTTP Request structure
@@ -74,249 +404,5682 @@ struct HttpRequest {
     string method;
     string path;
     string version;
-    map<string, string> headers;
+    HeaderMap headers;
     string body;
     map<string, string> query_params;
+    RouteParams params;                 // ":name" segments and "*" of the matched route
+    std::string_view route_pattern;     // Pattern of the matched route, empty if none
+    // Handler scratch memory released after the response; not valid once the
+    // handler returns. The request and response fields are not allocated from it.
+    std::pmr::memory_resource* arena = std::pmr::get_default_resource();
+    BodySink* body_sink = nullptr;      // Sink that received the body on stream_route()s
+    std::chrono::steady_clock::time_point received;     // When the request was parsed
+    
+    // Case-insensitive header lookup
+    string get_header(const string& key, const string& default_val = "") const {
+        auto it = headers.find(key);
+        return it != headers.end() ? it->second : default_val;
+    }
+    
+    // Path parameter by name; views into path, valid while this request is
+    std::string_view param(std::string_view name) const {
+        return params.get(name);
+    }
+};
+
+// Reason phrase for common status codes
+inline const char* status_reason(int code) {
+    switch (code) {
+        case 100: return "Continue";
+        case 200: return "OK";
+        case 201: return "Created";
+        case 202: return "Accepted";
+        case 204: return "No Content";
+        case 206: return "Partial Content";
+        case 301: return "Moved Permanently";
+        case 302: return "Found";
+        case 303: return "See Other";
+        case 304: return "Not Modified";
+        case 307: return "Temporary Redirect";
+        case 308: return "Permanent Redirect";
+        case 400: return "Bad Request";
+        case 401: return "Unauthorized";
+        case 403: return "Forbidden";
+        case 404: return "Not Found";
+        case 405: return "Method Not Allowed";
+        case 408: return "Request Timeout";
+        case 411: return "Length Required";
+        case 413: return "Payload Too Large";
+        case 414: return "URI Too Long";
+        case 415: return "Unsupported Media Type";
+        case 416: return "Range Not Satisfiable";
+        case 429: return "Too Many Requests";
+        case 431: return "Request Header Fields Too Large";
+        case 500: return "Internal Server Error";
+        case 501: return "Not Implemented";
+        case 502: return "Bad Gateway";
+        case 503: return "Service Unavailable";
+        case 504: return "Gateway Timeout";
+        case 505: return "HTTP Version Not Supported";
+        default: return "Unknown";
+    }
+}
+
+// Status line for a code, precomputed for every code with a known reason
+inline std::string_view status_line(int code) {
+    static const vector<string> lines = [] {
+        vector<string> table(500);
+        for (int c = 100; c < 600; ++c) {
+            const char* reason = status_reason(c);
+            if (std::strcmp(reason, "Unknown") != 0) {
+                table[c - 100] = "HTTP/1.1 " + std::to_string(c) + " " + reason + "\r\n";
+            }
+        }
+        return table;
+    }();
+    return code >= 100 && code < 600 ? std::string_view(lines[code - 100]) : std::string_view();
+}
+
+// IMF-fixdate used by Date and Last-Modified, e.g. "Sun, 06 Nov 1994 08:49:37 GMT"
+inline string format_http_date(std::time_t time) {
+    std::tm tm{};
+#ifdef _WIN32
+    gmtime_s(&tm, &time);
+#else
+    gmtime_r(&time, &tm);
+#endif
+    char buffer[32];
+    std::strftime(buffer, sizeof(buffer), "%a, %d %b %Y %H:%M:%S GMT", &tm);
+    return buffer;
+}
+
+// Inverse of format_http_date; -1 if the value is not an IMF-fixdate
+inline std::time_t parse_http_date(std::string_view value) {
+    static const char* const months[] = {
+        "Jan", "Feb", "Mar", "Apr", "May", "Jun",
+        "Jul", "Aug", "Sep", "Oct", "Nov", "Dec"
+    };
+    
+    string text(value);
+    char weekday[4] = {};
+    char month[4] = {};
+    std::tm tm{};
+    if (std::sscanf(text.c_str(), "%3s, %d %3s %d %d:%d:%d GMT", weekday, &tm.tm_mday, month,
+                    &tm.tm_year, &tm.tm_hour, &tm.tm_min, &tm.tm_sec) != 7) {
+        return -1;
+    }
+    
+    tm.tm_mon = -1;
+    for (int i = 0; i < 12; ++i) {
+        if (std::strcmp(month, months[i]) == 0) tm.tm_mon = i;
+    }
+    if (tm.tm_mon < 0) {
+        return -1;
+    }
+    tm.tm_year -= 1900;
+#ifdef _WIN32
+    return _mkgmtime(&tm);
+#else
+    return timegm(&tm);
+#endif
+}
+
+// Current time as an IMF-fixdate, reformatted at most once per second per thread
+inline std::string_view http_date_now() {
+    thread_local std::time_t cached_time = -1;
+    thread_local char cached[32];
+    std::time_t now = std::time(nullptr);
+    if (now != cached_time) {
+        string date = format_http_date(now);
+        std::memcpy(cached, date.c_str(), date.size() + 1);
+        cached_time = now;
+    }
+    return cached;
+}
+
+// Content type for a file name's extension, or nullptr if unknown
+inline const char* mime_type(std::string_view path) {
+    static const map<string, string, std::less<>> mime_types = {
+        {".html", "text/html"},
+        {".htm", "text/html"},
+        {".css", "text/css"},
+        {".js", "application/javascript"},
+        {".json", "application/json"},
+        {".png", "image/png"},
+        {".jpg", "image/jpeg"},
+        {".jpeg", "image/jpeg"},
+        {".gif", "image/gif"},
+        {".txt", "text/plain"}
+    };
+    
+    size_t dot = path.find_last_of('.');
+    if (dot == std::string_view::npos) {
+        return nullptr;
+    }
+    auto it = mime_types.find(path.substr(dot));
+    return it != mime_types.end() ? it->second.c_str() : nullptr;
+}
+
+// File sent as a response body straight from its descriptor.
+// Shared between copies of a response; the fd is closed with the last one.
+struct FileBody {
+    int fd = -1;
+    size_t length = 0;
+    
+    FileBody() = default;
+    FileBody(const FileBody&) = delete;
+    FileBody& operator=(const FileBody&) = delete;
+    
+    ~FileBody() {
+        if (fd >= 0) {
+#ifdef _WIN32
+            _close(fd);
+#else
+            ::close(fd);
+#endif
+        }
+    }
+    
+    // Open a regular file for reading; nullptr if it is missing or not a file
+    static std::shared_ptr<FileBody> open(const string& path) {
+#ifdef _WIN32
+        int fd = _open(path.c_str(), _O_RDONLY | _O_BINARY);
+#else
+        int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+#endif
+        if (fd < 0) {
+            return nullptr;
+        }
+        
+        auto file = std::make_shared<FileBody>();
+        file->fd = fd;
+        
+        struct stat st;
+        if (fstat(fd, &st) != 0 || (st.st_mode & S_IFMT) != S_IFREG) {
+            return nullptr;
+        }
+        file->length = static_cast<size_t>(st.st_size);
+        return file;
+    }
+};
+
+// HTTP Response structure
+struct HttpResponse {
+    int status_code = 200;
+    string status_text = "OK";
+    HeaderMap headers;
+    string body;
+    bool keep_alive = false;    // Set by the server; controls the Connection header
+    std::shared_ptr<FileBody> file;     // When set, sent with sendfile() instead of body
+    std::shared_ptr<const string> shared_body;  // When set, sent instead of body without a copy
+    BodyProducer producer;      // When set, the body is generated as it is sent
+    bool chunked = false;       // Set by the server for a streamed body of unknown length
+    bool compressible = true;   // False keeps HttpServer::compress() from encoding the body
+    std::shared_ptr<Deflater> deflater;     // Set by the server to compress a streamed body
+    
+    void set_header(const string& key, const string& value) {
+        headers[key] = value;
+    }
+    
+    // Add a request header the response depends on to Vary
+    void add_vary(std::string_view name) {
+        auto it = headers.find("Vary");
+        if (it == headers.end()) {
+            headers.set("Vary", name);
+        } else if (it->second != "*" && !header_has_token(it->second, name)) {
+            it->second.append(", ").append(name);
+        }
+    }
+    
+    // Send the body as producer writes it instead of all at once. Without a
+    // Content-Length header it goes out with Transfer-Encoding: chunked.
+    void stream(BodyProducer body_producer) {
+        producer = std::move(body_producer);
+        file.reset();
+        shared_body.reset();
+        body.clear();
+    }
+    
+    // Stream a file as the body without reading it into memory
+    bool send_file(const string& path) {
+        file = FileBody::open(path);
+        if (!file) {
+            return false;
+        }
+        body.clear();
+        shared_body.reset();
+        headers["Content-Length"] = std::to_string(file->length);
+        return true;
+    }
+    
+    // Append the status line and headers to out, without copying the header
+    // map. Content-Type, Content-Length, Connection and Date are filled in
+    // unless the handler set them; a 304 carries no body.
+    void write_head(string& out) const {
+        std::string_view line = status_line(status_code);
+        if (!line.empty() && status_text == status_reason(status_code)) {
+            out.append(line);
+        } else {
+            out.append("HTTP/1.1 ").append(std::to_string(status_code)).append(" ");
+            out.append(status_text).append("\r\n");
+        }
+        
+        for (const auto& [key, value] : headers) {
+            out.append(key).append(": ").append(value).append("\r\n");
+        }
+        
+        bool has_body = status_code != 304;
+        if (has_body && headers.find("Content-Type") == headers.end()) {
+            out.append("Content-Type: text/html\r\n");
+        }
+        if (has_body && producer) {
+            if (chunked) out.append("Transfer-Encoding: chunked\r\n");
+        } else if (has_body && headers.find("Content-Length") == headers.end()) {
+            char digits[24];
+            auto result = std::to_chars(digits, digits + sizeof(digits), body_size());
+            out.append("Content-Length: ").append(digits, result.ptr).append("\r\n");
+        }
+        if (headers.find("Connection") == headers.end()) {
+            out.append(keep_alive ? "Connection: keep-alive\r\n" : "Connection: close\r\n");
+        }
+        if (headers.find("Date") == headers.end()) {
+            out.append("Date: ").append(http_date_now()).append("\r\n");
+        }
+        out.append("\r\n");
+    }
+    
+    // Length of a body held in memory or in a file
+    size_t body_size() const {
+        return file ? file->length : shared_body ? shared_body->size() : body.size();
+    }
+    
+    // Serialized response. With a file or streamed body only the head is
+    // returned; the server sends the contents after it.
+    string to_string() const {
+        string out;
+        out.reserve(256 + (file ? 0 : body_size()));
+        write_head(out);
+        if (!file && !producer) {
+            out.append(shared_body ? *shared_body : body);
+        }
+        return out;
+    }
+};
+
+// Content types HttpServer::compress() compresses, matched by prefix; the
+// first rule that matches a response's Content-Type applies
+struct CompressionRule {
+    string type;                // "text/" matches every text type
+    int level = 6;              // zlib level 1 (fastest) to 9 (smallest); 0 never compresses
+    size_t min_size = 1024;     // Smaller bodies gain less than the framing costs
+};
+
+struct CompressionConfig {
+    // Images, audio, video and archives are compressed already and match no rule
+    vector<CompressionRule> rules = {
+        {"text/", 6, 1024},
+        {"application/json", 6, 1024},
+        {"application/javascript", 6, 1024},
+        {"application/xml", 6, 1024},
+        {"application/wasm", 6, 1024},
+        {"image/svg+xml", 6, 1024},
+    };
+    
+    // First rule covering content_type, or nullptr
+    const CompressionRule* find(std::string_view content_type) const {
+        for (const CompressionRule& rule : rules) {
+            if (content_type.size() >= rule.type.size() &&
+                iequals(content_type.substr(0, rule.type.size()), rule.type)) {
+                return &rule;
+            }
+        }
+        return nullptr;
+    }
+};
+
+#ifdef MNETWORK_HAS_ZLIB
+// zlib deflate stream writing gzip or zlib-wrapped ("deflate" in HTTP) output
+class Deflater {
+public:
+    enum class Format { Gzip, Deflate };
+    
+    Deflater(Format format, int level) {
+        // windowBits 15 plus 16 selects the gzip wrapper
+        if (deflateInit2(&stream_, level, Z_DEFLATED, format == Format::Gzip ? 31 : 15, 8,
+                         Z_DEFAULT_STRATEGY) != Z_OK) {
+            throw std::runtime_error("Failed to initialize zlib");
+        }
+    }
+    
+    ~Deflater() { deflateEnd(&stream_); }
+    
+    Deflater(const Deflater&) = delete;
+    Deflater& operator=(const Deflater&) = delete;
+    
+    // Compress input and append what zlib emits to out. flush is
+    // Z_NO_FLUSH, Z_SYNC_FLUSH to emit everything so far, or Z_FINISH.
+    void compress(std::string_view input, int flush, string& out) {
+        do {
+            size_t piece = std::min<size_t>(input.size(), 1u << 30);
+            stream_.next_in = reinterpret_cast<Bytef*>(const_cast<char*>(input.data()));
+            stream_.avail_in = static_cast<uInt>(piece);
+            input.remove_prefix(piece);
+            int mode = input.empty() ? flush : Z_NO_FLUSH;
+            do {
+                size_t size = out.size();
+                size_t room = std::max<size_t>(4096, deflateBound(&stream_, stream_.avail_in));
+                out.resize(size + room);
+                stream_.next_out = reinterpret_cast<Bytef*>(&out[size]);
+                stream_.avail_out = static_cast<uInt>(room);
+                deflate(&stream_, mode);
+                out.resize(size + room - stream_.avail_out);
+            } while (stream_.avail_out == 0);
+        } while (!input.empty());
+    }
+    
+    // Start a new stream with the same settings
+    void reset() { deflateReset(&stream_); }
+    
+    // Coding to answer accept_encoding with: gzip unless deflate is
+    // preferred. False if the client accepts neither.
+    static bool negotiate(std::string_view accept_encoding, Format& format) {
+        double gzip = accept_quality(accept_encoding, "gzip");
+        double deflate = accept_quality(accept_encoding, "deflate");
+        if (gzip <= 0 && deflate <= 0) return false;
+        format = gzip >= deflate ? Format::Gzip : Format::Deflate;
+        return true;
+    }
+    
+    // input compressed as one complete stream, with a deflater kept per
+    // thread and setting
+    static string compress_all(Format format, int level, std::string_view input) {
+        thread_local map<std::pair<int, int>, std::unique_ptr<Deflater>> deflaters;
+        std::unique_ptr<Deflater>& deflater = deflaters[{static_cast<int>(format), level}];
+        if (!deflater) {
+            deflater = std::make_unique<Deflater>(format, level);
+        }
+        string out;
+        deflater->compress(input, Z_FINISH, out);
+        deflater->reset();
+        return out;
+    }
+    
+private:
+    z_stream stream_{};
+};
+#endif
+
+// Bounded LRU cache for static files, keyed by resolved path. Every file
+// served keeps its precomputed headers and validators; files up to
+// max_file_size also keep their contents, and the compressed copies a
+// background thread makes of them. An entry is trusted without touching
+// the filesystem for revalidate_interval, then stat()ed again along with
+// its .gz sibling.
+class StaticCache {
+public:
+    struct Stats {
+        uint64_t hits = 0;
+        uint64_t misses = 0;
+        uint64_t not_modified = 0;  // Requests answered with 304
+        size_t entries = 0;
+        size_t bytes = 0;
+    };
+    
+    StaticCache(size_t capacity, size_t max_file_size, std::chrono::milliseconds revalidate_interval)
+        : capacity_(capacity), max_file_size_(max_file_size),
+          revalidate_interval_(revalidate_interval) {}
+    
+#ifdef MNETWORK_HAS_ZLIB
+    ~StaticCache() {
+        {
+            lock_guard<std::mutex> lock(mutex_);
+            stopping_ = true;
+        }
+        queued_.notify_all();
+        if (compressor_.joinable()) {
+            compressor_.join();
+        }
+    }
+    
+    StaticCache(const StaticCache&) = delete;
+    StaticCache& operator=(const StaticCache&) = delete;
+#endif
+    
+    // Fill response with the file at path, or 304 if the request's
+    // validators match. Returns false if the file cannot be served. A
+    // client that accepts gzip gets path.gz instead when that exists. With
+    // compression, other cached files are compressed once per coding and
+    // level on the cache's own thread and go out as they are until that is
+    // done; nothing is compressed on the request path.
+    bool serve(const string& path, const HttpRequest& request, HttpResponse& response,
+               const CompressionConfig* compression = nullptr) {
+        std::shared_ptr<const Entry> entry = find(path);
+        if (!entry) {
+            return false;
+        }
+        
+        // Whatever the coding, it is settled here
+        response.compressible = false;
+        if (!entry->content_type.empty()) {
+            response.set_header("Content-Type", entry->content_type);
+        }
+        auto accept = request.headers.find("Accept-Encoding");
+        std::string_view accept_encoding = accept != request.headers.end()
+            ? std::string_view(accept->second) : std::string_view();
+        std::shared_ptr<const string> body = entry->body;
+        
+        if (entry->gzip_sibling) {
+            response.add_vary("Accept-Encoding");
+            if (accept_quality(accept_encoding, "gzip") > 0) {
+                if (std::shared_ptr<const Entry> gzip = find(path + ".gz")) {
+                    response.set_header("Content-Encoding", "gzip");
+                    entry = gzip;
+                    body = entry->body;
+                }
+            }
+        }
+        
+        string etag = entry->etag;
+#ifdef MNETWORK_HAS_ZLIB
+        const CompressionRule* rule = nullptr;
+        if (compression && body && response.headers.find("Content-Encoding") == response.headers.end()) {
+            rule = compression->find(entry->content_type);
+        }
+        if (rule && rule->level > 0 && body->size() >= rule->min_size) {
+            response.add_vary("Accept-Encoding");
+            Deflater::Format format;
+            if (Deflater::negotiate(accept_encoding, format)) {
+                if (std::shared_ptr<const string> encoded = encoding(entry, format, rule->level)) {
+                    response.set_header("Content-Encoding", format == Deflater::Format::Gzip ? "gzip" : "deflate");
+                    etag.insert(0, "W/");
+                    body = std::move(encoded);
+                }
+            }
+        }
+#else
+        (void)compression;
+#endif
+        
+        response.set_header("ETag", etag);
+        response.set_header("Last-Modified", entry->last_modified);
+        
+        if (not_modified(request, *entry)) {
+            response.status_code = 304;
+            response.status_text = status_reason(304);
+            response.headers.erase("Content-Encoding");
+            response.body.clear();
+            lock_guard<std::mutex> lock(mutex_);
+            ++stats_.not_modified;
+            return true;
+        }
+        
+        if (body) {
+            response.body.clear();
+            response.shared_body = std::move(body);
+        } else if (!response.send_file(entry->path)) {
+            invalidate(entry->path);
+            return false;
+        }
+        return true;
+    }
+    
+    Stats stats() const {
+        lock_guard<std::mutex> lock(mutex_);
+        return stats_;
+    }
+    
+    void clear() {
+        lock_guard<std::mutex> lock(mutex_);
+        lru_.clear();
+        index_.clear();
+        stats_.entries = 0;
+        stats_.bytes = 0;
+    }
+    
+private:
+    struct Entry {
+        string path;
+        string content_type;
+        string etag;
+        string last_modified;
+        std::time_t mtime = 0;
+        size_t size = 0;
+        std::shared_ptr<const string> body;     // Null for files streamed from disk
+        bool gzip_sibling = false;              // path.gz existed when last checked
+        std::chrono::steady_clock::time_point checked;
+        // Compressed copies of body by coding and level, null while one is
+        // being made; guarded by mutex_
+        mutable map<std::pair<int, int>, std::shared_ptr<const string>> encodings;
+        
+        size_t footprint() const {
+            size_t total = sizeof(Entry) + path.size() + content_type.size() + etag.size() +
+                           last_modified.size() + (body ? body->size() : 0);
+            for (const auto& encoding : encodings) {
+                if (encoding.second) total += encoding.second->size();
+            }
+            return total;
+        }
+    };
+    
+    using EntryList = std::list<std::shared_ptr<const Entry>>;
+    
+    size_t capacity_;
+    size_t max_file_size_;
+    std::chrono::milliseconds revalidate_interval_;
+    mutable std::mutex mutex_;
+    EntryList lru_;     // Most recently used first
+    std::unordered_map<string, EntryList::iterator> index_;
+    Stats stats_;
+#ifdef MNETWORK_HAS_ZLIB
+    struct Job {
+        std::shared_ptr<const Entry> entry;
+        Deflater::Format format;
+        int level;
+    };
+    
+    std::deque<Job> jobs_;
+    std::thread compressor_;            // Started with the first job
+    std::condition_variable queued_;
+    bool stopping_ = false;
+#endif
+    
+    static bool stat_file(const string& path, struct stat& st) {
+        return ::stat(path.c_str(), &st) == 0 && (st.st_mode & S_IFMT) == S_IFREG;
+    }
+    
+    // Whether a precompressed copy sits next to path
+    static bool has_gzip_sibling(const string& path) {
+        if (path.size() >= 3 && path.compare(path.size() - 3, 3, ".gz") == 0) {
+            return false;
+        }
+        struct stat st;
+        return stat_file(path + ".gz", st);
+    }
+    
+    std::shared_ptr<const Entry> find(const string& path) {
+        std::shared_ptr<const Entry> entry = lookup(path);
+        return entry ? entry : load(path);
+    }
+    
+    // Cached entry for path, revalidated against the file if it is stale
+    std::shared_ptr<const Entry> lookup(const string& path) {
+        auto now = std::chrono::steady_clock::now();
+        std::unique_lock<std::mutex> lock(mutex_);
+        auto it = index_.find(path);
+        if (it == index_.end()) {
+            return nullptr;
+        }
+        lru_.splice(lru_.begin(), lru_, it->second);
+        std::shared_ptr<const Entry> entry = *it->second;
+        if (now - entry->checked < revalidate_interval_) {
+            ++stats_.hits;
+            return entry;
+        }
+        lock.unlock();
+        
+        struct stat st;
+        if (!stat_file(path, st) || st.st_mtime != entry->mtime ||
+            static_cast<size_t>(st.st_size) != entry->size) {
+            return nullptr;
+        }
+        
+        // Unchanged: trust it for another interval. The copy is taken under
+        // the lock, which guards the compressed copies it carries over.
+        bool gzip_sibling = has_gzip_sibling(path);
+        lock.lock();
+        auto refreshed = std::make_shared<Entry>(*entry);
+        refreshed->checked = now;
+        refreshed->gzip_sibling = gzip_sibling;
+        ++stats_.hits;
+        store(refreshed);
+        return refreshed;
+    }
+    
+    // Read the file and its validators, caching the result if it fits
+    std::shared_ptr<const Entry> load(const string& path) {
+        struct stat st;
+        if (!stat_file(path, st)) {
+            invalidate(path);
+            return nullptr;
+        }
+        
+        auto entry = std::make_shared<Entry>();
+        entry->path = path;
+        entry->mtime = st.st_mtime;
+        entry->size = static_cast<size_t>(st.st_size);
+        entry->gzip_sibling = has_gzip_sibling(path);
+        entry->checked = std::chrono::steady_clock::now();
+        if (const char* type = mime_type(path)) {
+            entry->content_type = type;
+        }
+        
+        ostringstream etag;
+        etag << '"' << std::hex << entry->size << '-' << static_cast<long long>(entry->mtime) << '"';
+        entry->etag = etag.str();
+        entry->last_modified = format_http_date(entry->mtime);
+        
+        if (entry->size <= max_file_size_ && entry->size <= capacity_) {
+            ifstream file(path, ios::binary);
+            string contents(entry->size, '\0');
+            if (!file.read(&contents[0], static_cast<std::streamsize>(contents.size()))) {
+                return nullptr;
+            }
+            entry->body = std::make_shared<const string>(std::move(contents));
+        }
+        
+        lock_guard<std::mutex> lock(mutex_);
+        ++stats_.misses;
+        store(entry);
+        return entry;
+    }
+    
+    // Insert or replace an entry at the front, evicting from the back.
+    // Caller holds mutex_.
+    void store(const std::shared_ptr<const Entry>& entry) {
+        erase(entry->path);
+        if (entry->footprint() > capacity_) {
+            return;
+        }
+        lru_.push_front(entry);
+        index_[entry->path] = lru_.begin();
+        stats_.bytes += entry->footprint();
+        ++stats_.entries;
+        trim();
+    }
+    
+    // Evict from the back until the cache fits. Caller holds mutex_.
+    void trim() {
+        while (stats_.bytes > capacity_) {
+            erase(lru_.back()->path);
+        }
+    }
+    
+#ifdef MNETWORK_HAS_ZLIB
+    // entry's body in format at level, or null if it has not been made yet,
+    // in which case it is queued for the compressor thread
+    std::shared_ptr<const string> encoding(const std::shared_ptr<const Entry>& entry,
+                                           Deflater::Format format, int level) {
+        lock_guard<std::mutex> lock(mutex_);
+        auto [it, added] = entry->encodings.emplace(std::make_pair(static_cast<int>(format), level), nullptr);
+        if (!added || stopping_) {
+            return it->second;
+        }
+        jobs_.push_back({entry, format, level});
+        if (!compressor_.joinable()) {
+            compressor_ = std::thread([this] { compress_queued(); });
+        }
+        queued_.notify_one();
+        return nullptr;
+    }
+    
+    void compress_queued() {
+        std::unique_lock<std::mutex> lock(mutex_);
+        while (true) {
+            queued_.wait(lock, [this] { return stopping_ || !jobs_.empty(); });
+            if (stopping_) return;
+            Job job = std::move(jobs_.front());
+            jobs_.pop_front();
+            
+            lock.unlock();
+            auto body = std::make_shared<const string>(
+                Deflater::compress_all(job.format, job.level, *job.entry->body));
+            lock.lock();
+            
+            // The cached entry may be a revalidated copy of the same file by
+            // now; one that is gone or holds a newer file does not get it
+            auto current = index_.find(job.entry->path);
+            if (current == index_.end()) continue;
+            const Entry& cached = **current->second;
+            if (cached.mtime != job.entry->mtime || cached.size != job.entry->size) continue;
+            std::shared_ptr<const string>& slot =
+                cached.encodings[std::make_pair(static_cast<int>(job.format), job.level)];
+            if (!slot) {
+                slot = std::move(body);
+                stats_.bytes += slot->size();
+                trim();
+            }
+        }
+    }
+#endif
+    
+    // Caller holds mutex_
+    void erase(const string& path) {
+        auto it = index_.find(path);
+        if (it == index_.end()) {
+            return;
+        }
+        stats_.bytes -= (*it->second)->footprint();
+        --stats_.entries;
+        lru_.erase(it->second);
+        index_.erase(it);
+    }
+    
+    void invalidate(const string& path) {
+        lock_guard<std::mutex> lock(mutex_);
+        erase(path);
+    }
+    
+    // If-None-Match takes precedence over If-Modified-Since (RFC 9110 13.2.2)
+    static bool not_modified(const HttpRequest& request, const Entry& entry) {
+        auto it = request.headers.find("If-None-Match");
+        if (it != request.headers.end()) {
+            return it->second == "*" || etag_listed(it->second, entry.etag);
+        }
+        it = request.headers.find("If-Modified-Since");
+        if (it != request.headers.end()) {
+            std::time_t since = parse_http_date(it->second);
+            return since != -1 && entry.mtime <= since;
+        }
+        return false;
+    }
+    
+    // Weak comparison against a comma-separated list of entity tags
+    static bool etag_listed(std::string_view list, std::string_view etag) {
+        size_t pos = 0;
+        while (pos < list.size()) {
+            size_t comma = list.find(',', pos);
+            if (comma == std::string_view::npos) comma = list.size();
+            std::string_view tag = list.substr(pos, comma - pos);
+            while (!tag.empty() && (tag.front() == ' ' || tag.front() == '\t')) tag.remove_prefix(1);
+            while (!tag.empty() && (tag.back() == ' ' || tag.back() == '\t')) tag.remove_suffix(1);
+            if (tag.substr(0, 2) == "W/") tag.remove_prefix(2);
+            if (tag == etag) return true;
+            pos = comma + 1;
+        }
+        return false;
+    }
+};
+
+// Incremental decoder for a message body framed by Content-Length or by the
+// chunked transfer coding. It consumes raw bytes as they arrive and hands
+// decoded pieces to a callback, so the caller can drop input once it has
+// been fed and keep memory bounded regardless of the body size.
+class BodyDecoder {
+public:
+    enum class Status { Incomplete, Complete, Error };
+    
+    static constexpr size_t max_line = 1024;        // Chunk size line, extensions included
+    static constexpr size_t max_trailers = 8192;
+    
+    static BodyDecoder length(size_t content_length, size_t max_body_size) {
+        BodyDecoder decoder;
+        decoder.max_body_size_ = max_body_size;
+        decoder.remaining_ = content_length;
+        decoder.state_ = content_length > 0 ? State::Data : State::Done;
+        return decoder;
+    }
+    
+    static BodyDecoder chunked(size_t max_body_size) {
+        BodyDecoder decoder;
+        decoder.max_body_size_ = max_body_size;
+        decoder.chunked_ = true;
+        decoder.state_ = State::Size;
+        return decoder;
+    }
+    
+    // Decode input, passing each decoded piece to on_data(std::string_view),
+    // which returns false to abort. consumed receives the input bytes used;
+    // unconsumed bytes must be passed again with whatever follows them.
+    template <typename OnData>
+    Status feed(const char* data, size_t size, size_t& consumed, OnData&& on_data) {
+        consumed = 0;
+        while (true) {
+            switch (state_) {
+                case State::Done:
+                    return Status::Complete;
+                case State::Failed:
+                    return Status::Error;
+                    
+                case State::Data: {
+                    size_t n = std::min(remaining_, size - consumed);
+                    if (n > 0) {
+                        if (!on_data(std::string_view(data + consumed, n))) return fail(500);
+                        consumed += n;
+                        remaining_ -= n;
+                        decoded_ += n;
+                    }
+                    if (remaining_ > 0) return Status::Incomplete;
+                    state_ = chunked_ ? State::DataEnd : State::Done;
+                    break;
+                }
+                
+                case State::DataEnd: {
+                    // CRLF (or a bare LF) after the chunk data
+                    if (consumed < size && data[consumed] == '\r') {
+                        if (consumed + 1 >= size) return Status::Incomplete;
+                        if (data[consumed + 1] != '\n') return fail(400);
+                        consumed += 2;
+                    } else if (consumed < size && data[consumed] == '\n') {
+                        consumed += 1;
+                    } else if (consumed < size) {
+                        return fail(400);
+                    } else {
+                        return Status::Incomplete;
+                    }
+                    state_ = State::Size;
+                    break;
+                }
+                
+                case State::Size:
+                case State::Trailers: {
+                    std::string_view line;
+                    if (!next_line(data, size, consumed, line)) {
+                        if (size - consumed > max_line) return fail(400);
+                        return Status::Incomplete;
+                    }
+                    if (state_ == State::Trailers) {
+                        // Trailer fields are read and discarded
+                        trailer_bytes_ += line.size();
+                        if (trailer_bytes_ > max_trailers) return fail(431);
+                        if (line.empty()) state_ = State::Done;
+                        break;
+                    }
+                    if (!parse_chunk_size(line)) return Status::Error;
+                    state_ = remaining_ > 0 ? State::Data : State::Trailers;
+                    break;
+                }
+            }
+        }
+    }
+    
+    bool chunked() const { return chunked_; }
+    
+    // Decoded body bytes delivered so far
+    size_t decoded() const { return decoded_; }
+    
+    int error_status() const { return error_status_; }
+    
+private:
+    enum class State { Data, DataEnd, Size, Trailers, Done, Failed };
+    
+    State state_ = State::Done;
+    bool chunked_ = false;
+    size_t remaining_ = 0;          // Bytes left in the body or current chunk
+    size_t decoded_ = 0;
+    size_t max_body_size_ = 0;
+    size_t trailer_bytes_ = 0;
+    int error_status_ = 0;
+    
+    Status fail(int status) {
+        state_ = State::Failed;
+        error_status_ = status;
+        return Status::Error;
+    }
+    
+    bool reject(int status) {
+        fail(status);
+        return false;
+    }
+    
+    // Next line without its CRLF/LF; false if the terminator has not arrived
+    static bool next_line(const char* data, size_t size, size_t& consumed, std::string_view& line) {
+        const char* newline = static_cast<const char*>(std::memchr(data + consumed, '\n', size - consumed));
+        if (!newline) return false;
+        size_t end = newline - data;
+        size_t line_end = end;
+        if (line_end > consumed && data[line_end - 1] == '\r') --line_end;
+        line = std::string_view(data + consumed, line_end - consumed);
+        consumed = end + 1;
+        return true;
+    }
+    
+    // Hex size, optionally followed by ";extensions" which are ignored
+    bool parse_chunk_size(std::string_view line) {
+        size_t value = 0;
+        size_t digits = 0;
+        for (char c : line) {
+            int digit;
+            if (c >= '0' && c <= '9') digit = c - '0';
+            else if (c >= 'a' && c <= 'f') digit = c - 'a' + 10;
+            else if (c >= 'A' && c <= 'F') digit = c - 'A' + 10;
+            else break;
+            if (++digits > 15) return reject(413);
+            value = value * 16 + digit;
+        }
+        if (digits == 0) return reject(400);
+        
+        std::string_view rest = line.substr(digits);
+        while (!rest.empty() && (rest.front() == ' ' || rest.front() == '\t')) rest.remove_prefix(1);
+        if (!rest.empty() && rest.front() != ';') return reject(400);
+        
+        if (decoded_ + value > max_body_size_) return reject(413);
+        remaining_ = value;
+        return true;
+    }
+};
+
+// Resumable HTTP/1.x request parser. It works in place on the caller's
+// receive buffer and only records offsets, so parsing the head performs no
+// allocations and can pick up where it stopped when more bytes arrive.
+// Views are relative to the buffer passed to the last parse() call.
+class RequestParser {
+public:
+    enum class Status { Incomplete, Complete, Error };
+    
+    struct Header {
+        std::string_view name;
+        std::string_view value;
+    };
+    
+    static constexpr size_t max_headers = 64;
+    
+    // max_message_size bounds a buffered message (head + body as received);
+    // max_body_size bounds the decoded body, streamed or not
+    explicit RequestParser(size_t max_head_size = 8192, size_t max_message_size = 1 << 20,
+                           size_t max_body_size = 64 << 20)
+        : max_head_size_(max_head_size), max_message_size_(max_message_size),
+          max_body_size_(max_body_size) {}
+    
+    void set_limits(size_t max_head_size, size_t max_message_size, size_t max_body_size = 64 << 20) {
+        max_head_size_ = max_head_size;
+        max_message_size_ = max_message_size;
+        max_body_size_ = max_body_size;
+    }
+    
+    // Consulted once the head of a request with a body is complete. If it
+    // returns true the parser stops after the head (parse() reports Complete
+    // and body_streamed() is set) and the caller reads the body itself with
+    // body_decoder(); otherwise the body is buffered as usual.
+    void set_stream_filter(std::function<bool(const RequestParser&)> filter) {
+        stream_filter_ = std::move(filter);
+    }
+    
+    // Forget the current message; limits are kept
+    void reset() {
+        state_ = State::RequestLine;
+        base_ = nullptr;
+        line_start_ = 0;
+        scan_ = 0;
+        head_length_ = 0;
+        content_length_ = 0;
+        has_content_length_ = false;
+        has_transfer_encoding_ = false;
+        streamed_ = false;
+        body_consumed_ = 0;
+        decoder_ = BodyDecoder();
+        decoded_body_.clear();
+        header_count_ = 0;
+        error_status_ = 0;
+        method_ = target_ = version_ = Span{};
+    }
+    
+    // data must hold the message from its first byte; earlier bytes are not rescanned
+    Status parse(const char* data, size_t size) {
+        base_ = data;
+        
+        while (state_ == State::RequestLine || state_ == State::Headers) {
+            const char* newline = static_cast<const char*>(
+                scan_ < size ? std::memchr(data + scan_, '\n', size - scan_) : nullptr);
+            if (!newline) {
+                scan_ = size;
+                if (size > max_head_size_) return fail(431);
+                return Status::Incomplete;
+            }
+            
+            size_t end = newline - data;
+            if (end + 1 > max_head_size_) return fail(431);
+            
+            size_t line_end = end;
+            if (line_end > line_start_ && data[line_end - 1] == '\r') --line_end;
+            
+            bool ok = state_ == State::RequestLine
+                ? parse_request_line(line_start_, line_end)
+                : parse_header_line(line_start_, line_end);
+            if (!ok) return Status::Error;
+            
+            line_start_ = scan_ = end + 1;
+            if (state_ == State::Body) {
+                head_length_ = end + 1;
+                if (!begin_body()) return Status::Error;
+            }
+        }
+        
+        if (state_ == State::Body) {
+            if (has_transfer_encoding_) {
+                // Chunked bodies are decoded into a side buffer as they arrive
+                size_t offset = head_length_ + body_consumed_;
+                size_t used = 0;
+                BodyDecoder::Status status = decoder_.feed(data + offset, size - offset, used,
+                    [this](std::string_view piece) {
+                        decoded_body_.append(piece);
+                        return true;
+                    });
+                body_consumed_ += used;
+                if (status == BodyDecoder::Status::Error) return fail(decoder_.error_status());
+                if (head_length_ + body_consumed_ > max_message_size_) return fail(413);
+                if (status == BodyDecoder::Status::Complete) state_ = State::Done;
+            } else if (size - head_length_ >= content_length_) {
+                state_ = State::Done;
+            }
+        }
+        
+        if (state_ == State::Done) return Status::Complete;
+        if (state_ == State::Failed) return Status::Error;
+        return Status::Incomplete;
+    }
+    
+    bool complete() const { return state_ == State::Done; }
+    bool headers_complete() const { return state_ == State::Body || state_ == State::Done; }
+    
+    // Suggested response status when parse() returned Error
+    int error_status() const { return error_status_; }
+    
+    std::string_view method() const { return view(method_); }
+    std::string_view target() const { return view(target_); }
+    std::string_view version() const { return view(version_); }
+    
+    std::string_view path() const {
+        std::string_view t = target();
+        return t.substr(0, t.find('?'));
+    }
+    
+    std::string_view query() const {
+        std::string_view t = target();
+        size_t qmark = t.find('?');
+        return qmark == std::string_view::npos ? std::string_view() : t.substr(qmark + 1);
+    }
+    
+    size_t header_count() const { return header_count_; }
+    
+    Header header(size_t index) const {
+        return {view(headers_[index].name), view(headers_[index].value)};
+    }
+    
+    // Case-insensitive lookup of the first header with this name
+    std::string_view header(std::string_view name) const {
+        for (size_t i = 0; i < header_count_; ++i) {
+            if (iequals(view(headers_[i].name), name)) {
+                return view(headers_[i].value);
+            }
+        }
+        return {};
+    }
+    
+    size_t content_length() const { return content_length_; }
+    size_t head_length() const { return head_length_; }
+    
+    // Bytes of input the message occupies; just the head when the body is streamed
+    size_t message_length() const {
+        if (streamed_) return head_length_;
+        return head_length_ + (has_transfer_encoding_ ? body_consumed_ : content_length_);
+    }
+    
+    bool chunked() const { return has_transfer_encoding_; }
+    bool body_streamed() const { return streamed_; }
+    
+    // Decoder positioned at the start of the body, for streamed bodies
+    const BodyDecoder& body_decoder() const { return decoder_; }
+    
+    // Buffered body; decoded if it was chunked
+    std::string_view body() const {
+        if (streamed_) return {};
+        if (has_transfer_encoding_) return decoded_body_;
+        return std::string_view(base_ + head_length_, content_length_);
+    }
+    
+private:
+    enum class State { RequestLine, Headers, Body, Done, Failed };
+    
+    struct Span {
+        uint32_t offset = 0;
+        uint32_t length = 0;
+    };
+    
+    struct HeaderSpan {
+        Span name;
+        Span value;
+    };
+    
+    std::string_view view(Span span) const {
+        return base_ ? std::string_view(base_ + span.offset, span.length) : std::string_view();
+    }
+    
+    static Span span(size_t begin, size_t end) {
+        return Span{static_cast<uint32_t>(begin), static_cast<uint32_t>(end - begin)};
+    }
+    
+    Status fail(int status) {
+        state_ = State::Failed;
+        error_status_ = status;
+        return Status::Error;
+    }
+    
+    bool reject(int status) {
+        fail(status);
+        return false;
+    }
+    
+    // Choose the body framing once the head is complete
+    bool begin_body() {
+        if (has_transfer_encoding_) {
+            // Both framings at once is a request smuggling vector (RFC 9112 6.3)
+            if (has_content_length_) return reject(400);
+            decoder_ = BodyDecoder::chunked(max_body_size_);
+        } else {
+            if (content_length_ > max_body_size_) return reject(413);
+            decoder_ = BodyDecoder::length(content_length_, max_body_size_);
+        }
+        
+        bool has_body = has_transfer_encoding_ || content_length_ > 0;
+        if (has_body && stream_filter_ && stream_filter_(*this)) {
+            streamed_ = true;
+            state_ = State::Done;
+            return true;
+        }
+        if (!has_transfer_encoding_ && head_length_ + content_length_ > max_message_size_) {
+            return reject(413);
+        }
+        return true;
+    }
+    
+    static bool is_token_char(char c) {
+        return std::isalnum(static_cast<unsigned char>(c)) ||
+            (c != '\0' && std::strchr("!#$%&'*+-.^_`|~", c));
+    }
+    
+    bool parse_request_line(size_t begin, size_t end) {
+        // Tolerate empty lines before the request line (RFC 9112 2.2)
+        if (begin == end) return true;
+        
+        const char* line = base_ + begin;
+        size_t length = end - begin;
+        
+        const char* sp1 = static_cast<const char*>(std::memchr(line, ' ', length));
+        if (!sp1) return reject(400);
+        const char* sp2 = static_cast<const char*>(std::memchr(sp1 + 1, ' ', line + length - sp1 - 1));
+        if (!sp2) return reject(400);
+        
+        size_t method_end = sp1 - base_;
+        size_t target_end = sp2 - base_;
+        if (method_end == begin || target_end == method_end + 1) return reject(400);
+        for (size_t i = begin; i < method_end; ++i) {
+            if (!is_token_char(base_[i])) return reject(400);
+        }
+        
+        std::string_view version(sp2 + 1, end - target_end - 1);
+        if (version.size() != 8 || version.substr(0, 5) != "HTTP/") return reject(400);
+        if (version[5] != '1' || version[6] != '.') return reject(505);
+        
+        method_ = span(begin, method_end);
+        target_ = span(method_end + 1, target_end);
+        version_ = span(target_end + 1, end);
+        state_ = State::Headers;
+        return true;
+    }
+    
+    bool parse_header_line(size_t begin, size_t end) {
+        if (begin == end) {
+            state_ = State::Body;
+            return true;
+        }
+        
+        // Obsolete line folding is rejected rather than unfolded
+        if (base_[begin] == ' ' || base_[begin] == '\t') return reject(400);
+        
+        const char* colon = static_cast<const char*>(std::memchr(base_ + begin, ':', end - begin));
+        if (!colon || colon == base_ + begin) return reject(400);
+        
+        size_t name_end = colon - base_;
+        for (size_t i = begin; i < name_end; ++i) {
+            if (!is_token_char(base_[i])) return reject(400);
+        }
+        
+        size_t value_begin = name_end + 1;
+        size_t value_end = end;
+        while (value_begin < value_end && (base_[value_begin] == ' ' || base_[value_begin] == '\t')) ++value_begin;
+        while (value_end > value_begin && (base_[value_end - 1] == ' ' || base_[value_end - 1] == '\t')) --value_end;
+        
+        if (header_count_ == max_headers) return reject(431);
+        headers_[header_count_++] = HeaderSpan{span(begin, name_end), span(value_begin, value_end)};
+        
+        std::string_view name(base_ + begin, name_end - begin);
+        if (iequals(name, "Content-Length")) {
+            if (value_begin == value_end) return reject(400);
+            size_t value = 0;
+            for (size_t i = value_begin; i < value_end; ++i) {
+                char c = base_[i];
+                if (c < '0' || c > '9') return reject(400);
+                if (value > (max_body_size_ - (c - '0')) / 10) return reject(413);
+                value = value * 10 + (c - '0');
+            }
+            if (has_content_length_ && value != content_length_) return reject(400);
+            has_content_length_ = true;
+            content_length_ = value;
+        } else if (iequals(name, "Transfer-Encoding")) {
+            // Only chunked is decoded; it must be the final coding
+            std::string_view value(base_ + value_begin, value_end - value_begin);
+            size_t comma = value.rfind(',');
+            std::string_view last = comma == std::string_view::npos ? value : value.substr(comma + 1);
+            while (!last.empty() && (last.front() == ' ' || last.front() == '\t')) last.remove_prefix(1);
+            if (!iequals(last, "chunked")) return reject(400);
+            if (comma != std::string_view::npos || has_transfer_encoding_) return reject(501);
+            has_transfer_encoding_ = true;
+        }
+        return true;
+    }
+    
+    State state_ = State::RequestLine;
+    const char* base_ = nullptr;
+    size_t max_head_size_;
+    size_t max_message_size_;
+    size_t line_start_ = 0;
+    size_t scan_ = 0;
+    size_t head_length_ = 0;
+    size_t max_body_size_;
+    size_t content_length_ = 0;
+    bool has_content_length_ = false;
+    bool has_transfer_encoding_ = false;
+    bool streamed_ = false;
+    size_t body_consumed_ = 0;      // Raw chunked bytes decoded so far
+    BodyDecoder decoder_;
+    string decoded_body_;
+    std::function<bool(const RequestParser&)> stream_filter_;
+    int error_status_ = 0;
+    Span method_;
+    Span target_;
+    Span version_;
+    size_t header_count_ = 0;
+    HeaderSpan headers_[max_headers];
+};
+
+// Incremental parser for one HTTP/1.x response, fed bytes as they arrive.
+// The head fills response(); the body is handed to a callback piece by
+// piece, framed by Content-Length, chunked coding or the end of the
+// connection. Interim 1xx responses are skipped.
+class ResponseParser {
+public:
+    enum class Status { Incomplete, Complete, Error };
+    
+    explicit ResponseParser(size_t max_head_size = 64 << 10) : max_head_size_(max_head_size) {}
+    
+    // Forget the current message. The response to a HEAD request has no
+    // body, whatever its head says.
+    void reset(bool head_request = false) {
+        state_ = State::Head;
+        head_request_ = head_request;
+        head_.clear();
+        response_ = HttpResponse();
+        version_.clear();
+        decoder_ = BodyDecoder();
+    }
+    
+    // Parse input, passing each decoded piece of the body to
+    // on_data(std::string_view), which returns false to abort. consumed
+    // receives the input bytes used; bytes after a complete response are
+    // left unconsumed.
+    template <typename OnData>
+    Status feed(const char* data, size_t size, size_t& consumed, OnData&& on_data) {
+        consumed = 0;
+        while (state_ == State::Head) {
+            // The head is gathered in head_, rescanning only the last few
+            // bytes for the blank line that ends it
+            size_t scan = head_.size() > 3 ? head_.size() - 3 : 0;
+            size_t take = std::min(size - consumed, max_head_size_ + 1 - head_.size());
+            head_.append(data + consumed, take);
+            size_t end = head_.find("\r\n\r\n", scan);
+            if (end == string::npos) {
+                consumed += take;
+                if (head_.size() > max_head_size_) return fail();
+                return Status::Incomplete;
+            }
+            size_t head_length = end + 4;
+            consumed += take - (head_.size() - head_length);
+            head_.resize(head_length);
+            if (!parse_head()) return fail();
+        }
+        
+        if (state_ == State::Body) {
+            size_t used = 0;
+            BodyDecoder::Status status = decoder_.feed(data + consumed, size - consumed, used, on_data);
+            consumed += used;
+            if (status == BodyDecoder::Status::Error) return fail();
+            if (status == BodyDecoder::Status::Complete) state_ = State::Done;
+        } else if (state_ == State::UntilClose && consumed < size) {
+            if (!on_data(std::string_view(data + consumed, size - consumed))) return fail();
+            consumed = size;
+        }
+        
+        if (state_ == State::Done) return Status::Complete;
+        if (state_ == State::Failed) return Status::Error;
+        return Status::Incomplete;
+    }
+    
+    // The connection was closed: completes a body that runs until then
+    Status finish() {
+        if (state_ == State::UntilClose) state_ = State::Done;
+        if (state_ == State::Done) return Status::Complete;
+        return fail();
+    }
+    
+    bool headers_complete() const { return state_ != State::Head && state_ != State::Failed; }
+    bool complete() const { return state_ == State::Done; }
+    
+    // Status line and headers; the body is left to the callback
+    const HttpResponse& response() const { return response_; }
+    HttpResponse& response() { return response_; }
+    
+    const string& version() const { return version_; }
+    
+    // Whether the connection can carry another request once this response is complete
+    bool keep_alive() const {
+        if (!headers_complete() || until_close_) return false;
+        auto connection = response_.headers.find("Connection");
+        bool has_connection = connection != response_.headers.end();
+        if (version_ == "HTTP/1.1") {
+            return !has_connection || !header_has_token(connection->second, "close");
+        }
+        return has_connection && header_has_token(connection->second, "keep-alive");
+    }
+    
+private:
+    enum class State { Head, Body, UntilClose, Done, Failed };
+    
+    Status fail() {
+        state_ = State::Failed;
+        return Status::Error;
+    }
+    
+    // Parse the head in head_ and choose the body framing; an interim
+    // response is dropped and the next head awaited
+    bool parse_head() {
+        std::string_view head(head_);
+        size_t line_end = head.find("\r\n");
+        std::string_view status_line = head.substr(0, line_end);
+        size_t space = status_line.find(' ');
+        if (space == std::string_view::npos || status_line.substr(0, 5) != "HTTP/") return false;
+        version_.assign(status_line.substr(0, space));
+        std::string_view rest = status_line.substr(space + 1);
+        int status_code = 0;
+        auto result = std::from_chars(rest.data(), rest.data() + rest.size(), status_code);
+        if (result.ec != std::errc() || result.ptr != rest.data() + 3) return false;
+        rest.remove_prefix(3);
+        if (!rest.empty() && rest.front() == ' ') rest.remove_prefix(1);
+        
+        response_ = HttpResponse();
+        response_.status_code = status_code;
+        response_.status_text.assign(rest);
+        
+        size_t pos = line_end + 2;
+        while (pos < head.size() - 2) {
+            size_t end = head.find("\r\n", pos);
+            std::string_view line = head.substr(pos, end - pos);
+            pos = end + 2;
+            size_t colon = line.find(':');
+            if (colon == std::string_view::npos || colon == 0) return false;
+            std::string_view value = line.substr(colon + 1);
+            while (!value.empty() && (value.front() == ' ' || value.front() == '\t')) value.remove_prefix(1);
+            while (!value.empty() && (value.back() == ' ' || value.back() == '\t')) value.remove_suffix(1);
+            response_.headers.set(line.substr(0, colon), value);
+        }
+        head_.clear();
+        
+        if (status_code >= 100 && status_code < 200 && status_code != 101) {
+            return true;
+        }
+        
+        until_close_ = false;
+        auto encoding = response_.headers.find("Transfer-Encoding");
+        auto length = response_.headers.find("Content-Length");
+        if (head_request_ || status_code == 204 || status_code == 304 || status_code == 101) {
+            state_ = State::Done;
+        } else if (encoding != response_.headers.end() && header_has_token(encoding->second, "chunked")) {
+            decoder_ = BodyDecoder::chunked(std::numeric_limits<size_t>::max());
+            state_ = State::Body;
+        } else if (length != response_.headers.end()) {
+            size_t content_length = 0;
+            const string& value = length->second;
+            auto parsed = std::from_chars(value.data(), value.data() + value.size(), content_length);
+            if (parsed.ec != std::errc() || parsed.ptr != value.data() + value.size()) return false;
+            decoder_ = BodyDecoder::length(content_length, std::numeric_limits<size_t>::max());
+            state_ = State::Body;
+        } else {
+            until_close_ = true;
+            state_ = State::UntilClose;
+        }
+        return true;
+    }
+    
+    State state_ = State::Head;
+    size_t max_head_size_;
+    bool head_request_ = false;
+    bool until_close_ = false;
+    string head_;
+    string version_;
+    HttpResponse response_;
+    BodyDecoder decoder_;
+};
+
+// Bytes waiting to be written to one connection: serialized responses and
+// file ranges, in order. Response heads are written into a buffer that is
+// recycled once sent, bodies are moved in or shared rather than copied, and
+// consecutive in-memory segments go out together with one sendmsg().
+// File ranges go out with sendfile() where available.
+class OutputQueue {
+public:
+    enum class Status { Done, Blocked, Failed };
+    
+    // Bodies up to this size are copied next to their head so pipelined
+    // small responses stay in one buffer
+    static constexpr size_t inline_body_limit = 1024;
+    static constexpr size_t max_iov = 16;
+    
+    bool empty() const { return head_ == segments_.size(); }
+    
+    // Bytes written since construction, so callers can tell a slow reader
+    // that is still draining from one that has stopped
+    size_t written() const { return written_; }
+    
+    void clear() {
+        segments_.clear();
+        head_ = 0;
+    }
+    
+    void append(std::string_view data) {
+        if (data.empty()) return;
+        open_buffer().append(data);
+    }
+    
+    // Queue a string as its own segment without copying it
+    void append_body(string&& data) {
+        if (data.empty()) return;
+        if (data.size() <= inline_body_limit) {
+            append(data);
+            return;
+        }
+        Segment segment;
+        segment.data = std::move(data);
+        segment.sealed = true;
+        segments_.push_back(std::move(segment));
+    }
+    
+    // Queue a shared, immutable string (a cached file) without copying it
+    void append_shared(std::shared_ptr<const string> data) {
+        if (!data || data->empty()) return;
+        if (data->size() <= inline_body_limit) {
+            append(*data);
+            return;
+        }
+        Segment segment;
+        segment.shared = std::move(data);
+        segment.sealed = true;
+        segments_.push_back(std::move(segment));
+    }
+    
+    void append_file(std::shared_ptr<FileBody> file) {
+        if (!file || file->length == 0) return;
+        Segment segment;
+        segment.remaining = file->length;
+        segment.file = std::move(file);
+        segments_.push_back(std::move(segment));
+    }
+    
+    // Queue a response head and its body. A streamed body is left to the
+    // server, which writes it through a ResponseWriter.
+    void append(const HttpResponse& response) {
+        response.write_head(open_buffer());
+        if (response.file) {
+            append_file(response.file);
+        } else if (response.shared_body) {
+            append_shared(response.shared_body);
+        } else if (!response.producer) {
+            append(response.body);
+        }
+    }
+    
+    // Same, taking over the body instead of copying it
+    void append(HttpResponse&& response) {
+        response.write_head(open_buffer());
+        if (response.file) {
+            append_file(std::move(response.file));
+        } else if (response.shared_body) {
+            append_shared(std::move(response.shared_body));
+        } else if (!response.producer) {
+            append_body(std::move(response.body));
+        }
+    }
+    
+    // Unsent in-memory bytes at the front; empty when a file range is next
+    std::string_view front_data() const {
+        if (empty() || segments_[head_].file) return {};
+        const Segment& segment = segments_[head_];
+        return segment.bytes().substr(segment.offset);
+    }
+    
+    // File range at the front, if any
+    const FileBody* front_file(size_t& offset, size_t& remaining) const {
+        if (empty() || !segments_[head_].file) return nullptr;
+        offset = segments_[head_].offset;
+        remaining = segments_[head_].remaining;
+        return segments_[head_].file.get();
+    }
+    
+#ifndef _WIN32
+    // Describe the leading in-memory segments for writev/sendmsg; returns
+    // the number of iovecs filled (0 when a file range is next)
+    size_t gather(iovec* iov, size_t max) const {
+        size_t count = 0;
+        for (size_t i = head_; i < segments_.size() && count < max && !segments_[i].file; ++i) {
+            std::string_view bytes = segments_[i].bytes();
+            iov[count].iov_base = const_cast<char*>(bytes.data()) + segments_[i].offset;
+            iov[count].iov_len = bytes.size() - segments_[i].offset;
+            ++count;
+        }
+        return count;
+    }
+#endif
+    
+    // Mark n bytes as written, spanning segments if needed
+    void consume(size_t n) {
+        written_ += n;
+        while (n > 0 && !empty()) {
+            Segment& segment = segments_[head_];
+            if (segment.file) {
+                size_t done = std::min(n, segment.remaining);
+                segment.offset += done;
+                segment.remaining -= done;
+                n -= done;
+                if (segment.remaining == 0) pop_front();
+            } else {
+                size_t size = segment.bytes().size();
+                size_t done = std::min(n, size - segment.offset);
+                segment.offset += done;
+                n -= done;
+                if (segment.offset >= size) pop_front();
+            }
+        }
+    }
+    
+    // Write until the queue is empty or the socket would block
+    Status write_to(int fd) {
+#ifdef MSG_NOSIGNAL
+        const int flags = MSG_NOSIGNAL;
+#else
+        const int flags = 0;
+#endif
+        while (!empty()) {
+            ssize_t n;
+            size_t offset = 0;
+            size_t remaining = 0;
+            if (const FileBody* file = front_file(offset, remaining)) {
+                n = send_file_range(fd, *file, offset, remaining);
+                if (n == 0) return Status::Failed;      // File shrank underneath us
+            } else {
+#ifdef _WIN32
+                std::string_view data = front_data();
+                n = send(fd, data.data(), static_cast<int>(data.size()), flags);
+#else
+                iovec iov[max_iov];
+                msghdr message{};
+                message.msg_iov = iov;
+                message.msg_iovlen = gather(iov, max_iov);
+                n = sendmsg(fd, &message, flags);
+#endif
+            }
+            
+            if (n > 0) {
+                consume(static_cast<size_t>(n));
+                continue;
+            }
+            if (n < 0 && errno == EINTR) continue;
+            if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) return Status::Blocked;
+            return Status::Failed;
+        }
+        return Status::Done;
+    }
+    
+private:
+    struct Segment {
+        string data;
+        std::shared_ptr<const string> shared;   // Sent instead of data when set
+        std::shared_ptr<FileBody> file;
+        size_t offset = 0;          // Bytes of data written, or file offset
+        size_t remaining = 0;       // File bytes left
+        bool sealed = false;        // Moved-in or shared body; never appended to
+        
+        std::string_view bytes() const { return shared ? std::string_view(*shared) : std::string_view(data); }
+    };
+    
+    // Head buffer open for appending, reusing the last sent one's capacity
+    string& open_buffer() {
+        if (empty() || segments_.back().file || segments_.back().sealed) {
+            segments_.emplace_back();
+            segments_.back().data.swap(spare_);
+        }
+        return segments_.back().data;
+    }
+    
+    // Retire the sent front segment. Its body and file are let go at once
+    // rather than at the next compaction, so a connection does not pin
+    // cached bodies or open files it has finished with.
+    void pop_front() {
+        Segment& segment = segments_[head_];
+        if (!segment.file && !segment.sealed && segment.data.capacity() > spare_.capacity()) {
+            segment.data.clear();
+            spare_.swap(segment.data);
+        } else if (segment.sealed) {
+            string().swap(segment.data);
+        }
+        segment.shared.reset();
+        segment.file.reset();
+        if (++head_ == segments_.size()) {
+            clear();
+        } else if (head_ >= 64 && head_ * 2 >= segments_.size()) {
+            segments_.erase(segments_.begin(), segments_.begin() + head_);
+            head_ = 0;
+        }
+    }
+    
+    static ssize_t send_file_range(int socket_fd, const FileBody& file, size_t offset, size_t remaining) {
+#ifdef __linux__
+        off_t file_offset = static_cast<off_t>(offset);
+        return sendfile(socket_fd, file.fd, &file_offset, std::min<size_t>(remaining, 1 << 30));
+#else
+        // No portable sendfile; copy through a bounded stack buffer
+        char buffer[16384];
+#ifdef _WIN32
+        if (_lseeki64(file.fd, static_cast<__int64>(offset), SEEK_SET) < 0) return -1;
+        int got = _read(file.fd, buffer, static_cast<unsigned>(std::min(remaining, sizeof(buffer))));
+#else
+        ssize_t got = pread(file.fd, buffer, std::min(remaining, sizeof(buffer)), static_cast<off_t>(offset));
+#endif
+        if (got <= 0) return got;
+        return send(socket_fd, buffer, got, 0);
+#endif
+    }
+    
+    vector<Segment> segments_;
+    size_t head_ = 0;           // First unsent segment
+    size_t written_ = 0;        // Total consumed
+    string spare_;              // Recycled head buffer
+};
+
+// Destination of a streamed response body, handed to its BodyProducer.
+// Small writes are collected into chunks of up to chunk_size bytes before
+// they are queued; larger strings passed by value are queued without a copy.
+// A compressed response passes each chunk through its Deflater instead.
+class ResponseWriter {
+public:
+    static constexpr size_t chunk_size = 16384;
+    
+    ResponseWriter(OutputQueue& out, bool chunked) : out_(out), chunked_(chunked) {}
+    
+    void write(std::string_view data) {
+        if (data.empty()) return;
+        pending_.append(data);
+        produced_ += data.size();
+        if (pending_.size() >= chunk_size) {
+            queue_pending(false);
+        }
+    }
+    
+    void write(const char* data) {
+        write(std::string_view(data));
+    }
+    
+    void write(string&& data) {
+        if (data.size() < chunk_size || deflater_) {
+            write(std::string_view(data));
+            return;
+        }
+        flush();
+        produced_ += data.size();
+        begin_chunk(data.size());
+        out_.append_body(std::move(data));
+        end_chunk();
+    }
+    
+    // Queue what has been written so far
+    void flush() {
+        queue_pending(true);
+    }
+    
+    // Whether the body is framed as chunks; false for HTTP/1.0 clients and
+    // responses that set Content-Length
+    bool chunked() const { return chunked_; }
+    
+private:
+    friend class HttpServer;
+    
+    void begin_chunk(size_t size) {
+        if (!chunked_) return;
+        char digits[24];
+        auto result = std::to_chars(digits, digits + sizeof(digits) - 2, size, 16);
+        *result.ptr++ = '\r';
+        *result.ptr++ = '\n';
+        out_.append(std::string_view(digits, result.ptr - digits));
+    }
+    
+    void end_chunk() {
+        if (chunked_) out_.append("\r\n");
+    }
+    
+    // Queue the rest and the last chunk
+    void finish() {
+#ifdef MNETWORK_HAS_ZLIB
+        if (deflater_) {
+            compress(Z_FINISH);
+        }
+#endif
+        flush();
+        if (chunked_) out_.append("0\r\n\r\n");
+    }
+    
+    // Queue pending_ as a chunk. A compressed body only emits what zlib has
+    // ready, unless everything written so far must go out (sync).
+    void queue_pending(bool sync) {
+#ifdef MNETWORK_HAS_ZLIB
+        if (deflater_) {
+            compress(sync ? Z_SYNC_FLUSH : Z_NO_FLUSH);
+        }
+#else
+        (void)sync;
+#endif
+        if (pending_.empty()) return;
+        begin_chunk(pending_.size());
+        out_.append(pending_);
+        end_chunk();
+        pending_.clear();
+    }
+    
+#ifdef MNETWORK_HAS_ZLIB
+    // Replace pending_ with its compressed form
+    void compress(int flush) {
+        if (pending_.empty() && flush == Z_NO_FLUSH) return;
+        compressed_.clear();
+        deflater_->compress(pending_, flush, compressed_);
+        pending_.swap(compressed_);
+        if (flush == Z_FINISH) deflater_.reset();
+    }
+    
+    string compressed_;
+#endif
+    
+    OutputQueue& out_;
+    bool chunked_;
+    string pending_;
+    size_t produced_ = 0;       // Bytes written since the server last reset it
+    std::shared_ptr<Deflater> deflater_;
+};
+
+// Allocation counters for the server's receive buffers and request arenas
+struct AllocationStats {
+    uint64_t buffers_allocated = 0;     // Receive buffers created because the pool was empty
+    uint64_t buffers_reused = 0;        // Receive buffers taken from the pool
+    uint64_t arena_blocks = 0;          // Heap blocks taken by arenas that outgrew their first block
+    uint64_t arena_bytes = 0;
+};
+
+// Heap resource that counts what it hands out, used upstream of the arenas
+class CountingResource : public std::pmr::memory_resource {
+public:
+    uint64_t blocks() const { return blocks_.load(std::memory_order_relaxed); }
+    uint64_t bytes() const { return bytes_.load(std::memory_order_relaxed); }
+    
+private:
+    std::atomic<uint64_t> blocks_{0};
+    std::atomic<uint64_t> bytes_{0};
+    
+    void* do_allocate(size_t bytes, size_t alignment) override {
+        blocks_.fetch_add(1, std::memory_order_relaxed);
+        bytes_.fetch_add(bytes, std::memory_order_relaxed);
+        return std::pmr::new_delete_resource()->allocate(bytes, alignment);
+    }
+    
+    void do_deallocate(void* p, size_t bytes, size_t alignment) override {
+        std::pmr::new_delete_resource()->deallocate(p, bytes, alignment);
+    }
+    
+    bool do_is_equal(const std::pmr::memory_resource& other) const noexcept override {
+        return this == &other;
+    }
+};
+
+// Monotonic arena rewound in one shot after each response. The first block
+// is kept across requests; only requests that outgrow it reach upstream.
+class RequestArena {
+public:
+    RequestArena(size_t size, std::pmr::memory_resource* upstream)
+        : block_(new char[std::max<size_t>(size, 64)]),
+          resource_(block_.get(), std::max<size_t>(size, 64), upstream) {}
+    
+    std::pmr::memory_resource* resource() { return &resource_; }
+    
+    void reset() { resource_.release(); }
+    
+private:
+    std::unique_ptr<char[]> block_;
+    std::pmr::monotonic_buffer_resource resource_;
+};
+
+// Free list of receive buffers shared by all connections of a server
+class BufferPool {
+public:
+    BufferPool(size_t buffer_size, size_t max_pooled)
+        : buffer_size_(buffer_size), max_pooled_(max_pooled) {}
+    
+    // Empty buffer with room for at least one read
+    string acquire() {
+        {
+            lock_guard<std::mutex> lock(mutex_);
+            if (!free_.empty()) {
+                string buffer = std::move(free_.back());
+                free_.pop_back();
+                ++reused_;
+                return buffer;
+            }
+            ++allocated_;
+        }
+        string buffer;
+        buffer.reserve(buffer_size_);
+        return buffer;
+    }
+    
+    // Return a buffer; ones that grew for a large request are dropped
+    void release(string&& buffer) {
+        if (buffer.capacity() < buffer_size_ || buffer.capacity() > 16 * buffer_size_) {
+            return;
+        }
+        buffer.clear();
+        lock_guard<std::mutex> lock(mutex_);
+        if (free_.size() < max_pooled_) {
+            free_.push_back(std::move(buffer));
+        }
+    }
+    
+    void stats(AllocationStats& stats) const {
+        lock_guard<std::mutex> lock(mutex_);
+        stats.buffers_allocated = allocated_;
+        stats.buffers_reused = reused_;
+    }
+    
+private:
+    size_t buffer_size_;
+    size_t max_pooled_;
+    mutable std::mutex mutex_;
+    vector<string> free_;
+    uint64_t allocated_ = 0;
+    uint64_t reused_ = 0;
+};
+
+// Work-stealing thread pool. Each thread owns a deque: it takes its newest
+// job from the back and, once that is empty, steals the oldest job from the
+// front of another thread's deque. Jobs submitted from outside the pool are
+// spread over the deques round-robin; a job submitted from a pool thread
+// stays on that thread's deque.
+class HandlerPool {
+public:
+    using Job = std::function<void()>;
+    
+    explicit HandlerPool(int threads) {
+        int count = std::max(threads, 1);
+        for (int i = 0; i < count; ++i) {
+            queues_.push_back(std::make_unique<Queue>());
+        }
+        for (int i = 0; i < count; ++i) {
+            threads_.emplace_back(&HandlerPool::run, this, static_cast<size_t>(i));
+        }
+    }
+    
+    ~HandlerPool() { stop(); }
+    
+    HandlerPool(const HandlerPool&) = delete;
+    HandlerPool& operator=(const HandlerPool&) = delete;
+    
+    void submit(Job job) {
+        size_t index = current_ == this ? current_index_
+                                        : next_queue_.fetch_add(1, std::memory_order_relaxed) % queues_.size();
+        pending_.fetch_add(1);
+        {
+            lock_guard<std::mutex> lock(queues_[index]->mutex);
+            queues_[index]->jobs.push_back(std::move(job));
+        }
+        if (sleepers_.load() > 0) {
+            lock_guard<std::mutex> lock(sleep_mutex_);
+            wake_.notify_one();
+        }
+    }
+    
+    // Run every queued job, then join the threads
+    void stop() {
+        {
+            lock_guard<std::mutex> lock(sleep_mutex_);
+            stopping_ = true;
+        }
+        wake_.notify_all();
+        for (auto& thread : threads_) {
+            if (thread.joinable()) {
+                thread.join();
+            }
+        }
+        threads_.clear();
+    }
+    
+    size_t size() const { return queues_.size(); }
+    
+    // Jobs taken from another thread's deque
+    uint64_t steals() const { return steals_.load(std::memory_order_relaxed); }
+    
+private:
+    struct Queue {
+        std::mutex mutex;
+        std::deque<Job> jobs;
+    };
+    
+    bool pop(size_t index, Job& job) {
+        Queue& queue = *queues_[index];
+        lock_guard<std::mutex> lock(queue.mutex);
+        if (queue.jobs.empty()) return false;
+        job = std::move(queue.jobs.back());
+        queue.jobs.pop_back();
+        return true;
+    }
+    
+    bool steal(size_t index, Job& job) {
+        for (size_t i = 1; i < queues_.size(); ++i) {
+            Queue& queue = *queues_[(index + i) % queues_.size()];
+            lock_guard<std::mutex> lock(queue.mutex);
+            if (!queue.jobs.empty()) {
+                job = std::move(queue.jobs.front());
+                queue.jobs.pop_front();
+                steals_.fetch_add(1, std::memory_order_relaxed);
+                return true;
+            }
+        }
+        return false;
+    }
+    
+    void run(size_t index) {
+        current_ = this;
+        current_index_ = index;
+        Job job;
+        while (true) {
+            if (pop(index, job) || steal(index, job)) {
+                pending_.fetch_sub(1);
+                job();
+                job = nullptr;
+                continue;
+            }
+            
+            // Sleep until a job is submitted; sleepers_ is raised before
+            // pending_ is checked, so submit() either sees it or the job
+            std::unique_lock<std::mutex> lock(sleep_mutex_);
+            sleepers_.fetch_add(1);
+            wake_.wait(lock, [this] { return stopping_ || pending_.load() > 0; });
+            sleepers_.fetch_sub(1);
+            if (stopping_ && pending_.load() == 0) {
+                return;
+            }
+        }
+    }
+    
+    vector<std::unique_ptr<Queue>> queues_;
+    vector<std::thread> threads_;
+    std::atomic<size_t> next_queue_{0};
+    std::atomic<size_t> pending_{0};        // Jobs submitted and not yet taken
+    std::atomic<int> sleepers_{0};
+    std::atomic<uint64_t> steals_{0};
+    std::mutex sleep_mutex_;
+    std::condition_variable wake_;
+    bool stopping_ = false;
+    static inline thread_local HandlerPool* current_ = nullptr;
+    static inline thread_local size_t current_index_ = 0;
+};
+
+// Log records are copied into a ring owned by the writing thread, so the
+// request path neither takes a lock nor touches a stream. A background
+// thread drains the rings every flush interval, or sooner once one is half
+// full, and formats each timestamp only when the second changes. A record
+// that does not fit in its ring is dropped and counted instead of waited for.
+// A ring whose thread has exited is drained one last time and released.
+class AsyncLogger {
+public:
+    enum class Stream : uint32_t { Console, Access };
+    
+    AsyncLogger() : id_(next_id_.fetch_add(1) + 1) {}
+    ~AsyncLogger() { stop(); }
+    
+    AsyncLogger(const AsyncLogger&) = delete;
+    AsyncLogger& operator=(const AsyncLogger&) = delete;
+    
+    // Start the flusher. Access records go to access_path, appended; false
+    // if it cannot be opened. Until start() and after stop(), records are
+    // written as they come.
+    bool start(const string& access_path, size_t ring_size, int flush_interval_ms) {
+        if (running_) return true;
+        if (!access_path.empty()) {
+            access_.open(access_path, std::ios::app | std::ios::binary);
+            if (!access_) return false;
+        }
+        if (ring_size_ == 0) {
+            // Rings are kept across restarts, so their size is fixed once
+            ring_size_ = 4096;
+            while (ring_size_ < ring_size) ring_size_ <<= 1;
+        }
+        stopping_ = false;
+        running_ = true;
+        flusher_ = std::thread(&AsyncLogger::run, this,
+                               std::chrono::milliseconds(std::max(flush_interval_ms, 1)));
+        return true;
+    }
+    
+    // Write out everything buffered and stop the flusher. Call once the
+    // writing threads are done; a record racing with stop() may be lost.
+    void stop() {
+        if (!running_) return;
+        {
+            lock_guard<std::mutex> lock(wake_mutex_);
+            stopping_ = true;
+        }
+        wake_.notify_all();
+        flusher_.join();
+        running_ = false;
+        drain();
+        if (access_.is_open()) access_.close();
+    }
+    
+    void write(Stream stream, std::string_view text) {
+        int64_t time = std::chrono::duration_cast<std::chrono::microseconds>(
+            std::chrono::system_clock::now().time_since_epoch()).count();
+        if (!running_.load(std::memory_order_acquire)) {
+            lock_guard<std::mutex> lock(out_mutex_);
+            string out;
+            format(stream, time, text, out);
+            emit(stream, out);
+            return;
+        }
+        
+        Ring& ring = local_ring();
+        size_t capacity = ring.data.size();
+        text = text.substr(0, std::min(text.size(), capacity / 4));
+        size_t need = (sizeof(Record) + text.size() + sizeof(Record) - 1) & ~(sizeof(Record) - 1);
+        size_t tail = ring.tail.load(std::memory_order_relaxed);
+        size_t offset = tail & (capacity - 1);
+        size_t room = capacity - offset;
+        size_t total = need > room ? room + need : need;   // Skip the end of the ring
+        size_t used = tail - ring.head.load(std::memory_order_acquire);
+        if (used + total > capacity) {
+            ring.drops.fetch_add(1, std::memory_order_relaxed);
+            return;
+        }
+        if (need > room) {
+            Record pad{0, pad_stream, 0};
+            std::memcpy(&ring.data[offset], &pad, sizeof(pad));
+            offset = 0;
+        }
+        Record record{static_cast<uint32_t>(text.size()), static_cast<uint32_t>(stream), time};
+        std::memcpy(&ring.data[offset], &record, sizeof(record));
+        std::memcpy(&ring.data[offset + sizeof(record)], text.data(), text.size());
+        ring.tail.store(tail + total, std::memory_order_release);
+        
+        // Wake the flusher early once the ring is half full. Without the
+        // mutex the wakeup can be missed; the flush interval bounds that.
+        if (used < capacity / 2 && used + total >= capacity / 2) {
+            nudged_.store(true, std::memory_order_relaxed);
+            wake_.notify_one();
+        }
+    }
+    
+    // Records dropped because their thread's ring was full
+    uint64_t drops() const {
+        lock_guard<std::mutex> lock(rings_mutex_);
+        uint64_t total = retired_drops_;
+        for (const auto& ring : rings_) {
+            total += ring->drops.load(std::memory_order_relaxed);
+        }
+        return total;
+    }
+    
+private:
+    // Ring entries: a record header, then the text, padded to the header size
+    struct Record {
+        uint32_t length;
+        uint32_t stream;
+        int64_t time;           // Microseconds since the epoch
+    };
+    static constexpr uint32_t pad_stream = ~0u;     // Rest of the ring is unused
+    
+    // Single producer (its thread), single consumer (the flusher)
+    struct Ring {
+        explicit Ring(size_t size) : data(size) {}
+        vector<char> data;
+        alignas(64) std::atomic<size_t> head{0};    // Advanced by the flusher
+        alignas(64) std::atomic<size_t> tail{0};    // Advanced by the writer
+        std::atomic<uint64_t> drops{0};
+        std::atomic<bool> retired{false};           // Its thread has exited
+    };
+    
+    // A thread's rings, one per logger it wrote to; the logger may outlive
+    // the thread or the other way round, so both hold them
+    struct OwnedRings {
+        vector<std::pair<uint64_t, std::shared_ptr<Ring>>> rings;
+        
+        ~OwnedRings() {
+            for (auto& entry : rings) {
+                entry.second->retired.store(true, std::memory_order_release);
+            }
+        }
+    };
+    
+    // Text of the last second seen, redone when the second changes
+    struct TimeText {
+        const char* pattern;
+        std::time_t second = -1;
+        char text[48] = {};
+        size_t length = 0;
+        
+        explicit TimeText(const char* format) : pattern(format) {}
+        
+        std::string_view get(int64_t time_us) {
+            std::time_t now = static_cast<std::time_t>(time_us / 1000000);
+            if (now != second) {
+                std::tm local{};
+#ifdef _WIN32
+                localtime_s(&local, &now);
+#else
+                localtime_r(&now, &local);
+#endif
+                length = std::strftime(text, sizeof(text), pattern, &local);
+                second = now;
+            }
+            return std::string_view(text, length);
+        }
+    };
+    
+    Ring& local_ring() {
+        thread_local OwnedRings owned;
+        for (const auto& [id, ring] : owned.rings) {
+            if (id == id_) return *ring;
+        }
+        lock_guard<std::mutex> lock(rings_mutex_);
+        rings_.push_back(std::make_shared<Ring>(ring_size_));
+        owned.rings.emplace_back(id_, rings_.back());
+        return *rings_.back();
+    }
+    
+    void format(Stream stream, int64_t time, std::string_view text, string& out) {
+        if (stream == Stream::Access) {
+            out.append("[").append(access_time_.get(time)).append("] ");
+        } else {
+            out.append("[").append(console_time_.get(time)).append("] ");
+        }
+        out.append(text).append("\n");
+    }
+    
+    // Called with out_mutex_ held, which also guards the time texts
+    void emit(Stream stream, const string& text) {
+        if (text.empty()) return;
+        if (stream == Stream::Console) {
+            cout.write(text.data(), static_cast<std::streamsize>(text.size()));
+            cout.flush();
+        } else if (access_.is_open()) {
+            access_.write(text.data(), static_cast<std::streamsize>(text.size()));
+            access_.flush();
+        }
+    }
+    
+    // Move every buffered record to the outputs
+    void drain() {
+        lock_guard<std::mutex> out_lock(out_mutex_);
+        string console;
+        string access;
+        {
+            lock_guard<std::mutex> lock(rings_mutex_);
+            uint64_t dropped = retired_drops_;
+            for (auto it = rings_.begin(); it != rings_.end();) {
+                Ring* ring = it->get();
+                // Read before tail, so a retired ring is seen with all its records
+                bool retired = ring->retired.load(std::memory_order_acquire);
+                dropped += ring->drops.load(std::memory_order_relaxed);
+                size_t capacity = ring->data.size();
+                size_t head = ring->head.load(std::memory_order_relaxed);
+                size_t tail = ring->tail.load(std::memory_order_acquire);
+                while (head != tail) {
+                    size_t offset = head & (capacity - 1);
+                    Record record;
+                    std::memcpy(&record, &ring->data[offset], sizeof(record));
+                    if (record.stream == pad_stream) {
+                        head += capacity - offset;
+                        continue;
+                    }
+                    std::string_view text(&ring->data[offset + sizeof(record)], record.length);
+                    Stream stream = static_cast<Stream>(record.stream);
+                    format(stream, record.time, text, stream == Stream::Access ? access : console);
+                    head += (sizeof(Record) + record.length + sizeof(Record) - 1) & ~(sizeof(Record) - 1);
+                }
+                ring->head.store(head, std::memory_order_release);
+                if (retired) {
+                    retired_drops_ += ring->drops.load(std::memory_order_relaxed);
+                    it = rings_.erase(it);
+                } else {
+                    ++it;
+                }
+            }
+            if (dropped != reported_drops_) {
+                int64_t time = std::chrono::duration_cast<std::chrono::microseconds>(
+                    std::chrono::system_clock::now().time_since_epoch()).count();
+                format(Stream::Console, time,
+                       std::to_string(dropped - reported_drops_) + " log records dropped", console);
+                reported_drops_ = dropped;
+            }
+        }
+        emit(Stream::Console, console);
+        emit(Stream::Access, access);
+    }
+    
+    void run(std::chrono::milliseconds interval) {
+        std::unique_lock<std::mutex> lock(wake_mutex_);
+        while (!stopping_) {
+            wake_.wait_for(lock, interval, [this] {
+                return stopping_ || nudged_.exchange(false, std::memory_order_relaxed);
+            });
+            lock.unlock();
+            drain();
+            lock.lock();
+        }
+    }
+    
+    uint64_t id_;                       // Tells this logger's rings apart in a thread's list
+    size_t ring_size_ = 0;
+    std::atomic<bool> running_{false};
+    mutable std::mutex rings_mutex_;    // Held by the flusher and when a thread first writes
+    vector<std::shared_ptr<Ring>> rings_;
+    uint64_t retired_drops_ = 0;        // Drops of rings already released
+    uint64_t reported_drops_ = 0;
+    TimeText console_time_{"%H:%M:%S"};
+    TimeText access_time_{"%d/%b/%Y:%H:%M:%S %z"};
+    std::mutex out_mutex_;
+    std::ofstream access_;
+    std::thread flusher_;
+    std::mutex wake_mutex_;
+    std::condition_variable wake_;
+    std::atomic<bool> nudged_{false};   // A ring passed half full
+    bool stopping_ = false;
+    static inline std::atomic<uint64_t> next_id_{0};
+};
+
+// Request counts, latency histograms and connection counts. Each thread
+// records into its own shard with plain loads and stores, so recording
+// takes no lock and no cache line is shared between workers; readers add
+// the shards up. The shards of exited threads are folded into one retired
+// total. Latencies go into log-linear buckets: four per power of two of
+// microseconds, so a bucket is within 25% of any value in it.
+class Metrics {
+public:
+    static constexpr size_t bucket_count = 128;     // Up to 2^32 us, about 71 minutes
+    
+    // One route pattern and status class, summed over every thread
+    struct Series {
+        string route;                   // Route pattern, empty for unmatched requests
+        int status_class = 0;           // 2 for 2xx, 4 for 4xx, ...
+        uint64_t count = 0;
+        uint64_t sum_us = 0;
+        std::array<uint64_t, bucket_count> buckets{};
+        
+        // Latency in seconds below which a fraction q of the requests fell
+        double quantile(double q) const {
+            uint64_t rank = static_cast<uint64_t>(q * static_cast<double>(count));
+            uint64_t seen = 0;
+            for (size_t i = 0; i < bucket_count; ++i) {
+                seen += buckets[i];
+                if (seen > rank || seen == count) {
+                    return static_cast<double>(bucket_upper(i)) / 1e6;
+                }
+            }
+            return 0;
+        }
+    };
+    
+    struct Snapshot {
+        vector<Series> series;          // Sorted by route, then status class
+        uint64_t connections_accepted = 0;
+        uint64_t connections_open = 0;
+    };
+    
+    Metrics() : id_(next_id_.fetch_add(1) + 1) {}
+    
+    Metrics(const Metrics&) = delete;
+    Metrics& operator=(const Metrics&) = delete;
+    
+    void record(std::string_view route, int status_code,
+                std::chrono::steady_clock::duration elapsed) {
+        Shard& shard = local_shard();
+        int status_class = status_code / 100;
+        Counters* counters = shard.last;
+        if (!counters || route.data() != shard.last_route.data() ||
+            route.size() != shard.last_route.size() || status_class != shard.last_class) {
+            auto key = std::make_pair(route, status_class);
+            auto it = shard.series.find(key);
+            if (it == shard.series.end()) {
+                lock_guard<std::mutex> lock(shard.mutex);
+                it = shard.series.emplace(Key(string(route), status_class),
+                                          std::make_unique<Counters>()).first;
+            }
+            counters = it->second.get();
+            shard.last = counters;
+            shard.last_route = route;
+            shard.last_class = status_class;
+        }
+        
+        auto us = std::chrono::duration_cast<std::chrono::microseconds>(elapsed).count();
+        uint64_t value = us > 0 ? static_cast<uint64_t>(us) : 0;
+        bump(counters->count, 1);
+        bump(counters->sum_us, value);
+        bump(counters->buckets[bucket_index(value)], 1);
+    }
+    
+    void connection_opened() { bump(local_shard().opened, 1); }
+    void connection_closed() { bump(local_shard().closed, 1); }
+    
+    Snapshot snapshot() const {
+        Snapshot result;
+        std::map<Key, Series, KeyLess> merged;
+        uint64_t closed = 0;
+        auto add = [&](const Shard& shard) {
+            result.connections_accepted += shard.opened.load(std::memory_order_relaxed);
+            closed += shard.closed.load(std::memory_order_relaxed);
+            lock_guard<std::mutex> lock(shard.mutex);
+            for (const auto& [key, counters] : shard.series) {
+                Series& series = merged[key];
+                series.count += counters->count.load(std::memory_order_relaxed);
+                series.sum_us += counters->sum_us.load(std::memory_order_relaxed);
+                for (size_t i = 0; i < bucket_count; ++i) {
+                    series.buckets[i] += counters->buckets[i].load(std::memory_order_relaxed);
+                }
+            }
+        };
+        lock_guard<std::mutex> shards_lock(shards_mutex_);
+        add(retired_);
+        for (const auto& shard : shards_) {
+            add(*shard);
+        }
+        // A connection may close on another thread than the one that opened it
+        result.connections_open = result.connections_accepted > closed
+            ? result.connections_accepted - closed : 0;
+        for (auto& [key, series] : merged) {
+            series.route = key.first;
+            series.status_class = key.second;
+            result.series.push_back(std::move(series));
+        }
+        return result;
+    }
+    
+    // Prometheus text exposition format
+    string prometheus() const {
+        Snapshot data = snapshot();
+        string out;
+        out.append("# HELP mnetwork_request_duration_seconds Time from parsing a request to queueing its response.\n");
+        out.append("# TYPE mnetwork_request_duration_seconds histogram\n");
+        char number[32];
+        for (const Series& series : data.series) {
+            string labels = "route=\"";
+            for (char c : series.route) {
+                if (c == '\\' || c == '"') labels.push_back('\\');
+                if (c == '\n') {
+                    labels.append("\\n");
+                } else {
+                    labels.push_back(c);
+                }
+            }
+            labels.append("\",code=\"").append(std::to_string(series.status_class)).append("xx\"");
+            
+            // Cumulative counts at each power of two from 16us to about 67s
+            uint64_t cumulative = 0;
+            size_t next = 0;
+            for (int exponent = 4; exponent <= 26; ++exponent) {
+                uint64_t bound = uint64_t(1) << exponent;
+                while (next < bucket_count && bucket_upper(next) <= bound) {
+                    cumulative += series.buckets[next++];
+                }
+                std::snprintf(number, sizeof(number), "%g", static_cast<double>(bound) / 1e6);
+                out.append("mnetwork_request_duration_seconds_bucket{").append(labels);
+                out.append(",le=\"").append(number).append("\"} ");
+                out.append(std::to_string(cumulative)).append("\n");
+            }
+            out.append("mnetwork_request_duration_seconds_bucket{").append(labels);
+            out.append(",le=\"+Inf\"} ").append(std::to_string(series.count)).append("\n");
+            std::snprintf(number, sizeof(number), "%.6f", static_cast<double>(series.sum_us) / 1e6);
+            out.append("mnetwork_request_duration_seconds_sum{").append(labels).append("} ");
+            out.append(number).append("\n");
+            out.append("mnetwork_request_duration_seconds_count{").append(labels).append("} ");
+            out.append(std::to_string(series.count)).append("\n");
+        }
+        out.append("# HELP mnetwork_connections_accepted_total Connections accepted.\n");
+        out.append("# TYPE mnetwork_connections_accepted_total counter\n");
+        out.append("mnetwork_connections_accepted_total ");
+        out.append(std::to_string(data.connections_accepted)).append("\n");
+        out.append("# HELP mnetwork_connections_open Connections currently open.\n");
+        out.append("# TYPE mnetwork_connections_open gauge\n");
+        out.append("mnetwork_connections_open ").append(std::to_string(data.connections_open)).append("\n");
+        return out;
+    }
+    
+    // Bucket holding a latency of value microseconds
+    static size_t bucket_index(uint64_t value) {
+        if (value < 4) return static_cast<size_t>(value);
+        int exponent = 63;
+        while (!(value >> exponent)) --exponent;
+        size_t index = 4 * static_cast<size_t>(exponent - 1) + ((value >> (exponent - 2)) & 3);
+        return std::min(index, bucket_count - 1);
+    }
+    
+    // First value past bucket index, in microseconds
+    static uint64_t bucket_upper(size_t index) {
+        if (index < 4) return index + 1;
+        size_t exponent = index / 4 + 1;
+        return (4 + index % 4 + 1) << (exponent - 2);
+    }
+    
+private:
+    using Key = std::pair<string, int>;
+    
+    // Lets the recording thread look a series up without building a string
+    struct KeyLess {
+        using is_transparent = void;
+        template <typename A, typename B>
+        bool operator()(const A& a, const B& b) const {
+            int order = std::string_view(a.first).compare(std::string_view(b.first));
+            return order < 0 || (order == 0 && a.second < b.second);
+        }
+    };
+    
+    struct Counters {
+        std::atomic<uint64_t> count{0};
+        std::atomic<uint64_t> sum_us{0};
+        std::atomic<uint64_t> buckets[bucket_count] = {};
+    };
+    
+    // Written only by its thread; the mutex is taken by that thread to add
+    // a series and by readers to walk them
+    struct alignas(64) Shard {
+        mutable std::mutex mutex;
+        std::map<Key, std::unique_ptr<Counters>, KeyLess> series;
+        std::atomic<uint64_t> opened{0};
+        std::atomic<uint64_t> closed{0};
+        std::atomic<bool> retired{false};   // Its thread has exited
+        Counters* last = nullptr;       // Series of the previous request
+        std::string_view last_route;
+        int last_class = 0;
+    };
+    
+    // Shards of the calling thread, one per registry it recorded into. Held
+    // here as well, so a registry destroyed first leaves nothing dangling.
+    struct OwnedShards {
+        vector<std::pair<uint64_t, std::shared_ptr<Shard>>> shards;
+        
+        ~OwnedShards() {
+            for (auto& entry : shards) {
+                entry.second->retired.store(true, std::memory_order_release);
+            }
+        }
+    };
+    
+    // Single writer, so no read-modify-write instruction is needed
+    static void bump(std::atomic<uint64_t>& counter, uint64_t amount) {
+        counter.store(counter.load(std::memory_order_relaxed) + amount, std::memory_order_relaxed);
+    }
+    
+    Shard& local_shard() {
+        thread_local OwnedShards owned;
+        for (const auto& [id, shard] : owned.shards) {
+            if (id == id_) return *shard;
+        }
+        lock_guard<std::mutex> lock(shards_mutex_);
+        retire_exited();
+        shards_.push_back(std::make_shared<Shard>());
+        owned.shards.emplace_back(id_, shards_.back());
+        return *shards_.back();
+    }
+    
+    // Add the counts of shards whose threads have exited to retired_ and
+    // drop them, so the list stays as long as the set of live threads.
+    // Caller holds shards_mutex_.
+    void retire_exited() {
+        for (auto it = shards_.begin(); it != shards_.end();) {
+            const Shard& shard = **it;
+            if (!shard.retired.load(std::memory_order_acquire)) {
+                ++it;
+                continue;
+            }
+            bump(retired_.opened, shard.opened.load(std::memory_order_relaxed));
+            bump(retired_.closed, shard.closed.load(std::memory_order_relaxed));
+            lock_guard<std::mutex> lock(retired_.mutex);
+            for (const auto& [key, counters] : shard.series) {
+                std::unique_ptr<Counters>& total = retired_.series[key];
+                if (!total) {
+                    total = std::make_unique<Counters>();
+                }
+                bump(total->count, counters->count.load(std::memory_order_relaxed));
+                bump(total->sum_us, counters->sum_us.load(std::memory_order_relaxed));
+                for (size_t i = 0; i < bucket_count; ++i) {
+                    bump(total->buckets[i], counters->buckets[i].load(std::memory_order_relaxed));
+                }
+            }
+            it = shards_.erase(it);
+        }
+    }
+    
+    uint64_t id_;                       // Tells this registry's shards apart in a thread's list
+    mutable std::mutex shards_mutex_;
+    vector<std::shared_ptr<Shard>> shards_;
+    Shard retired_;                     // Totals of exited threads; written under shards_mutex_
+    static inline std::atomic<uint64_t> next_id_{0};
+};
+
+// Request and response storage reused for every request a worker serves.
+// The fields are plain strings and maps that are reused, not arena-backed:
+// strings keep their capacity, header fields stay in place and query map
+// nodes are recycled instead of freed, so a steady stream of similar
+// requests does not touch the heap. The arena only serves req.arena.
+class RequestContext {
+public:
+    HttpRequest request;
+    HttpResponse response;
+    
+    RequestContext(size_t arena_size, std::pmr::memory_resource* upstream)
+        : arena_(arena_size, upstream) {
+        request.arena = arena_.resource();
+    }
+    
+    // Clear the request and response for the next message
+    void reset() {
+        request.headers.clear();
+        recycle(request.query_params);
+        response.headers.clear();
+        
+        request.method.clear();
+        request.path.clear();
+        request.version.clear();
+        request.params.clear();
+        request.route_pattern = {};
+        request.body_sink = nullptr;
+        if (request.body.capacity() > max_retained_body) {
+            string().swap(request.body);
+        }
+        request.body.clear();
+        
+        response.status_code = 200;
+        response.status_text.assign("OK");
+        response.body.clear();
+        response.file.reset();
+        response.shared_body.reset();
+        response.producer = nullptr;
+        response.deflater.reset();
+        response.chunked = false;
+        response.compressible = true;
+        response.keep_alive = false;
+        
+        arena_.reset();
+    }
+    
+    // m[key] = value, reusing a recycled node when one is available
+    void assign(map<string, string>& m, std::string_view key, std::string_view value) {
+        if (spare_nodes_.empty()) {
+            m[string(key)].assign(value);
+            return;
+        }
+        auto node = std::move(spare_nodes_.back());
+        spare_nodes_.pop_back();
+        node.key().assign(key);
+        node.mapped().assign(value);
+        auto result = m.insert(std::move(node));
+        if (!result.inserted) {
+            result.position->second.assign(value);
+            spare_nodes_.push_back(std::move(result.node));
+        }
+    }
+    
+private:
+    static constexpr size_t max_spare_nodes = 128;
+    static constexpr size_t max_retained_body = 64 * 1024;
+    
+    RequestArena arena_;
+    vector<map<string, string>::node_type> spare_nodes_;
+    
+    void recycle(map<string, string>& m) {
+        while (!m.empty() && spare_nodes_.size() < max_spare_nodes) {
+            spare_nodes_.push_back(m.extract(m.begin()));
+        }
+        m.clear();
+    }
+};
+
+// Consumer of a body delivered piece by piece as it arrives: request bodies
+// of routes registered with HttpServer::stream_route(), and response bodies
+// read by HttpClient::get()
+class BodySink {
+public:
+    virtual ~BodySink() = default;
+    
+    // Next piece of the decoded body; return false to fail the request
+    virtual bool write(std::string_view data) = 0;
+    
+    // Whole body received; return false to fail the request
+    virtual bool finish() { return true; }
+};
+
+// Creates the sink for one request, from its head; nullptr fails the request
+using BodySinkFactory = std::function<std::unique_ptr<BodySink>(const HttpRequest&)>;
+
+// Passes each piece of the body to a function
+class CallbackBodySink : public BodySink {
+public:
+    explicit CallbackBodySink(std::function<bool(std::string_view)> on_data)
+        : on_data_(std::move(on_data)) {}
+    
+    bool write(std::string_view data) override { return on_data_(data); }
+    
+private:
+    std::function<bool(std::string_view)> on_data_;
+};
+
+// Writes the body to a file. A body that does not arrive completely leaves
+// no file behind.
+class FileBodySink : public BodySink {
+public:
+    // nullptr if the file cannot be created
+    static std::unique_ptr<FileBodySink> create(const string& path) {
+#ifdef _WIN32
+        int fd = _open(path.c_str(), _O_WRONLY | _O_CREAT | _O_TRUNC | _O_BINARY, _S_IREAD | _S_IWRITE);
+#else
+        int fd = ::open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+#endif
+        if (fd < 0) {
+            return nullptr;
+        }
+        return std::unique_ptr<FileBodySink>(new FileBodySink(path, fd));
+    }
+    
+    ~FileBodySink() override {
+        close_file();
+        if (!finished_) {
+            std::remove(path_.c_str());
+        }
+    }
+    
+    bool write(std::string_view data) override {
+        while (!data.empty()) {
+#ifdef _WIN32
+            int n = _write(fd_, data.data(), static_cast<unsigned>(std::min<size_t>(data.size(), 1 << 30)));
+#else
+            ssize_t n = ::write(fd_, data.data(), data.size());
+            if (n < 0 && errno == EINTR) continue;
+#endif
+            if (n <= 0) return false;
+            data.remove_prefix(static_cast<size_t>(n));
+            size_ += static_cast<size_t>(n);
+        }
+        return true;
+    }
+    
+    bool finish() override {
+        finished_ = close_file();
+        return finished_;
+    }
+    
+    const string& path() const { return path_; }
+    size_t size() const { return size_; }
+    
+private:
+    string path_;
+    int fd_;
+    size_t size_ = 0;
+    bool finished_ = false;
+    
+    FileBodySink(const string& path, int fd) : path_(path), fd_(fd) {}
+    
+    bool close_file() {
+        if (fd_ < 0) return true;
+#ifdef _WIN32
+        bool ok = _close(fd_) == 0;
+#else
+        bool ok = ::close(fd_) == 0;
+#endif
+        fd_ = -1;
+        return ok;
+    }
+};
+
+// Sink factory that stores each body in the file named by path_for(request)
+inline BodySinkFactory body_to_file(std::function<string(const HttpRequest&)> path_for) {
+    return [path_for = std::move(path_for)](const HttpRequest& request) -> std::unique_ptr<BodySink> {
+        return FileBodySink::create(path_for(request));
+    };
+}
+
+#ifdef MNETWORK_HAS_COROUTINES
+// Where a Task keeps its result until the awaiter takes it
+template <typename T>
+struct TaskResult {
+    std::optional<T> value;
+    
+    void return_value(T result) { value.emplace(std::move(result)); }
+    T take() { return std::move(*value); }
+};
+
+template <>
+struct TaskResult<void> {
+    void return_void() noexcept {}
+    void take() {}
+};
+
+// Coroutine producing a T. It starts when awaited and resumes its awaiter
+// directly when it finishes; an exception it throws is rethrown there.
+template <typename T = void>
+class [[nodiscard]] Task {
+public:
+    struct promise_type : TaskResult<T> {
+        std::coroutine_handle<> continuation;
+        std::exception_ptr error;
+        
+        Task get_return_object() {
+            return Task(std::coroutine_handle<promise_type>::from_promise(*this));
+        }
+        std::suspend_always initial_suspend() noexcept { return {}; }
+        
+        struct FinalAwaiter {
+            bool await_ready() noexcept { return false; }
+            std::coroutine_handle<> await_suspend(std::coroutine_handle<promise_type> handle) noexcept {
+                std::coroutine_handle<> next = handle.promise().continuation;
+                return next ? next : std::noop_coroutine();
+            }
+            void await_resume() noexcept {}
+        };
+        FinalAwaiter final_suspend() noexcept { return {}; }
+        
+        void unhandled_exception() { error = std::current_exception(); }
+    };
+    
+    Task() = default;
+    Task(Task&& other) noexcept : handle_(std::exchange(other.handle_, nullptr)) {}
+    Task& operator=(Task&& other) noexcept {
+        if (this != &other) {
+            if (handle_) handle_.destroy();
+            handle_ = std::exchange(other.handle_, nullptr);
+        }
+        return *this;
+    }
+    ~Task() {
+        if (handle_) handle_.destroy();
+    }
+    
+    bool await_ready() const noexcept { return !handle_ || handle_.done(); }
+    
+    std::coroutine_handle<> await_suspend(std::coroutine_handle<> awaiter) noexcept {
+        handle_.promise().continuation = awaiter;
+        return handle_;
+    }
+    
+    T await_resume() {
+        if (!handle_) throw std::logic_error("Awaiting an empty Task");
+        if (handle_.promise().error) std::rethrow_exception(handle_.promise().error);
+        return handle_.promise().take();
+    }
+    
+private:
+    explicit Task(std::coroutine_handle<promise_type> handle) : handle_(handle) {}
+    
+    std::coroutine_handle<promise_type> handle_;
+};
+
+// Coroutine that runs eagerly and frees itself when it finishes
+struct Detached {
+    struct promise_type {
+        Detached get_return_object() noexcept { return {}; }
+        std::suspend_never initial_suspend() noexcept { return {}; }
+        std::suspend_never final_suspend() noexcept { return {}; }
+        void return_void() noexcept {}
+        void unhandled_exception() noexcept { std::terminate(); }
+    };
+};
+
+// Start task without awaiting it. done runs when it finishes, with the
+// exception it threw if any; it may run before spawn() returns.
+inline Detached spawn(Task<void> task, std::function<void(std::exception_ptr)> done = nullptr) {
+    std::exception_ptr error;
+    try {
+        co_await task;
+    } catch (...) {
+        error = std::current_exception();
+    }
+    if (done) done(error);
+}
+#endif
+
+// Middleware type
+using Middleware = std::function<bool(const HttpRequest&, HttpResponse&)>;
+using RouteHandler = std::function<void(const HttpRequest&, HttpResponse&)>;
+#ifdef MNETWORK_HAS_COROUTINES
+using AsyncHandler = std::function<Task<void>(const HttpRequest&, HttpResponse&)>;
+#endif
+
+// Compressed radix tree of routes. Patterns are literal text with optional
+// ":name" segments matching one path segment and a trailing "*" matching the
+// rest of the path. Static text beats a parameter, which beats a wildcard;
+// lookup walks the path once and only backtracks where those branch.
+class Router {
+public:
+    struct Route {
+        string method;      // Empty matches any method
+        string pattern;
+        vector<string> param_names;
+        RouteHandler handler;
+        BodySinkFactory sink;   // Set for routes whose body is streamed
+#ifdef MNETWORK_HAS_COROUTINES
+        AsyncHandler async_handler;     // Used instead of handler when set
+#endif
+    };
+    
+    // Register a handler; an existing route for the same method and pattern
+    // is replaced
+    Route& add(std::string_view method, std::string_view pattern, RouteHandler handler,
+               BodySinkFactory sink = nullptr) {
+        Route route;
+        route.method = string(method);
+        route.pattern = string(pattern);
+        route.handler = std::move(handler);
+        route.sink = std::move(sink);
+        
+        Node* node = &root_;
+        bool wildcard = false;
+        size_t pos = 0;
+        while (pos < pattern.size()) {
+            if (pattern[pos] == '*') {
+                wildcard = true;
+                break;
+            }
+            if (pattern[pos] == ':' && pos > 0 && pattern[pos - 1] == '/') {
+                size_t end = pattern.find('/', pos);
+                if (end == std::string_view::npos) end = pattern.size();
+                route.param_names.emplace_back(pattern.substr(pos + 1, end - pos - 1));
+                if (!node->param) node->param = std::make_unique<Node>();
+                node = node->param.get();
+                pos = end;
+                continue;
+            }
+            size_t end = pattern.find_first_of(":*", pos + 1);
+            while (end != std::string_view::npos && pattern[end] == ':' && pattern[end - 1] != '/') {
+                end = pattern.find_first_of(":*", end + 1);
+            }
+            if (end == std::string_view::npos) end = pattern.size();
+            node = insert_static(node, pattern.substr(pos, end - pos));
+            pos = end;
+        }
+        
+        if (route.param_names.size() + (wildcard ? 1 : 0) > RouteParams::capacity) {
+            throw std::invalid_argument("Too many parameters in route: " + route.pattern);
+        }
+        
+        auto& routes = wildcard ? node->wildcard : node->exact;
+        for (auto& existing : routes) {
+            if (existing->method == route.method) {
+                *existing = std::move(route);
+                return *existing;
+            }
+        }
+        routes.push_back(std::make_unique<Route>(std::move(route)));
+        return *routes.back();
+    }
+    
+    // Route for method and path, filling params with views into path
+    const Route* find(std::string_view method, std::string_view path, RouteParams& params) const {
+        params.clear();
+        return match(&root_, method, path, params);
+    }
+    
+private:
+    struct Node {
+        string label;                           // Static text consumed by this node
+        string first_chars;                     // First byte of each child's label
+        vector<std::unique_ptr<Node>> children;
+        std::unique_ptr<Node> param;            // ":name" child
+        vector<std::unique_ptr<Route>> exact;   // Routes ending here
+        vector<std::unique_ptr<Route>> wildcard;    // Routes ending in "*" here
+    };
+    
+    Node root_;
+    
+    static Node* insert_static(Node* node, std::string_view text) {
+        while (!text.empty()) {
+            size_t index = node->first_chars.find(text[0]);
+            if (index == string::npos) {
+                auto child = std::make_unique<Node>();
+                child->label = string(text);
+                node->first_chars.push_back(text[0]);
+                node->children.push_back(std::move(child));
+                return node->children.back().get();
+            }
+            
+            Node* child = node->children[index].get();
+            size_t common = 0;
+            while (common < text.size() && common < child->label.size() &&
+                   text[common] == child->label[common]) {
+                ++common;
+            }
+            
+            // Split the child so its label ends where the texts diverge
+            if (common < child->label.size()) {
+                auto split = std::make_unique<Node>();
+                split->label = child->label.substr(0, common);
+                child->label.erase(0, common);
+                split->first_chars.push_back(child->label[0]);
+                split->children.push_back(std::move(node->children[index]));
+                node->children[index] = std::move(split);
+                child = node->children[index].get();
+            }
+            
+            node = child;
+            text.remove_prefix(common);
+        }
+        return node;
+    }
+    
+    static const Route* pick(const vector<std::unique_ptr<Route>>& routes, std::string_view method) {
+        const Route* any = nullptr;
+        for (const auto& route : routes) {
+            if (route->method == method) return route.get();
+            if (route->method.empty()) any = route.get();
+        }
+        return any;
+    }
+    
+    // Attach values captured along the way to the matched route's names
+    static const Route* bind(const Route* route, RouteParams& params) {
+        for (size_t i = 0; i < route->param_names.size() && i < params.count; ++i) {
+            params.items[i].name = route->param_names[i];
+        }
+        return route;
+    }
+    
+    static const Route* match(const Node* node, std::string_view method, std::string_view path,
+                              RouteParams& params) {
+        if (path.empty()) {
+            if (const Route* route = pick(node->exact, method)) return bind(route, params);
+        } else {
+            size_t index = node->first_chars.find(path[0]);
+            if (index != string::npos) {
+                const Node* child = node->children[index].get();
+                if (path.substr(0, child->label.size()) == child->label) {
+                    const Route* route = match(child, method, path.substr(child->label.size()), params);
+                    if (route) return route;
+                }
+            }
+            
+            if (node->param && path[0] != '/' && params.count < RouteParams::capacity) {
+                size_t end = std::min(path.find('/'), path.size());
+                size_t saved = params.count;
+                params.items[params.count++].value = path.substr(0, end);
+                const Route* route = match(node->param.get(), method, path.substr(end), params);
+                if (route) return route;
+                params.count = saved;
+            }
+        }
+        
+        if (const Route* route = pick(node->wildcard, method)) {
+            if (params.count < RouteParams::capacity) {
+                params.items[params.count++] = {"*", path};
+            }
+            return bind(route, params);
+        }
+        return nullptr;
+    }
+};
+
+// Host as written in a Host header: IPv6 literals go in brackets
+inline string host_header(const string& host) {
+    if (host.find(':') == string::npos || host.front() == '[') {
+        return host;
+    }
+    return "[" + host + "]";
+}
+
+// Host name lookups through getaddrinfo(), cached in process. An entry is
+// served for ttl after its lookup, then for up to another ttl while it is
+// refreshed in the background, so a busy host never waits on the
+// resolver. Failures are cached for negative_ttl. Lookups for callers that
+// must not block run on a background thread. Thread-safe.
+class Resolver {
+public:
+    struct Address {
+        sockaddr_storage storage{};
+        socklen_t length = 0;
+        
+        int family() const { return storage.ss_family; }
+        const sockaddr* get() const { return reinterpret_cast<const sockaddr*>(&storage); }
+        
+        string to_string() const {
+            char text[INET6_ADDRSTRLEN] = "";
+            if (family() == AF_INET6) {
+                inet_ntop(AF_INET6, &reinterpret_cast<const sockaddr_in6*>(&storage)->sin6_addr, text, sizeof(text));
+            } else {
+                inet_ntop(AF_INET, &reinterpret_cast<const sockaddr_in*>(&storage)->sin_addr, text, sizeof(text));
+            }
+            return text;
+        }
+    };
+    
+    // In the order to try them
+    using Addresses = vector<Address>;
+    
+    // Receives the addresses, or the std::runtime_error the lookup failed with
+    using Callback = std::function<void(std::exception_ptr error, const Addresses& addresses)>;
+    
+    struct Stats {
+        uint64_t hits = 0;              // Answered from the cache, stale entries included
+        uint64_t lookups = 0;           // getaddrinfo() calls, refreshes included
+        uint64_t failures = 0;
+    };
+    
+    explicit Resolver(int ttl_ms = 60000, int negative_ttl_ms = 1000)
+        : ttl_(std::chrono::milliseconds(ttl_ms)),
+          negative_ttl_(std::chrono::milliseconds(negative_ttl_ms)) {}
+    
+    // Lookups still waited for fail with an error instead of never answering
+    ~Resolver() {
+        vector<Waiter> waiters;
+        {
+            lock_guard<std::mutex> lock(mutex_);
+            stopping_ = true;
+            for (auto& [host, entry] : cache_) {
+                for (Waiter& waiter : entry.waiters) {
+                    waiters.push_back(std::move(waiter));
+                }
+                entry.waiters.clear();
+            }
+        }
+        queued_.notify_all();
+        Addresses none;
+        for (Waiter& waiter : waiters) {
+            waiter.done(std::make_exception_ptr(std::runtime_error("Resolver destroyed before the lookup finished")),
+                        none);
+        }
+        if (worker_.joinable()) {
+            worker_.join();
+        }
+    }
+    
+    Resolver(const Resolver&) = delete;
+    Resolver& operator=(const Resolver&) = delete;
+    
+    // Resolver used by the HTTP clients
+    static std::shared_ptr<Resolver> shared() {
+        static std::shared_ptr<Resolver> resolver = std::make_shared<Resolver>();
+        return resolver;
+    }
+    
+    void set_ttl(int ttl_ms, int negative_ttl_ms) {
+        lock_guard<std::mutex> lock(mutex_);
+        ttl_ = std::chrono::milliseconds(ttl_ms);
+        negative_ttl_ = std::chrono::milliseconds(negative_ttl_ms);
+    }
+    
+    // Addresses of host with port filled in. Blocks for the lookup on a
+    // cache miss; throws std::runtime_error if it fails.
+    Addresses resolve(const string& host, int port) {
+        Addresses addresses;
+        if (numeric(host, port, addresses)) {
+            return addresses;
+        }
+        {
+            std::unique_lock<std::mutex> lock(mutex_);
+            switch (find(lock, host, addresses)) {
+                case Cached::Usable:
+                    return with_port(std::move(addresses), port);
+                case Cached::Failed:
+                    throw std::runtime_error(cache_[host].error);
+                case Cached::Missing:
+                    break;
+            }
+        }
+        
+        string error;
+        Addresses found = lookup(host, error);
+        store(host, found, error);
+        if (found.empty()) {
+            throw std::runtime_error(error);
+        }
+        return with_port(std::move(found), port);
+    }
+    
+    // Cached addresses without blocking: false when a lookup is needed
+    bool cached(const string& host, int port, Addresses& addresses) {
+        if (numeric(host, port, addresses)) {
+            return true;
+        }
+        std::unique_lock<std::mutex> lock(mutex_);
+        if (find(lock, host, addresses) != Cached::Usable) {
+            return false;
+        }
+        addresses = with_port(std::move(addresses), port);
+        return true;
+    }
+    
+    // Resolve without blocking the caller. done runs at once when the answer
+    // is cached, otherwise on the thread that completes the lookup.
+    void resolve_async(const string& host, int port, Callback done) {
+        Addresses addresses;
+        if (numeric(host, port, addresses)) {
+            done(nullptr, addresses);
+            return;
+        }
+        std::unique_lock<std::mutex> lock(mutex_);
+        if (stopping_) {
+            lock.unlock();
+            done(std::make_exception_ptr(std::runtime_error("Resolver destroyed")), addresses);
+            return;
+        }
+        switch (find(lock, host, addresses)) {
+            case Cached::Usable:
+                lock.unlock();
+                done(nullptr, with_port(std::move(addresses), port));
+                return;
+            case Cached::Failed: {
+                string error = cache_[host].error;
+                lock.unlock();
+                done(std::make_exception_ptr(std::runtime_error(error)), addresses);
+                return;
+            }
+            case Cached::Missing:
+                break;
+        }
+        Entry& entry = cache_[host];
+        entry.waiters.push_back({port, std::move(done)});
+        schedule(entry, host);
+    }
+    
+    void clear() {
+        lock_guard<std::mutex> lock(mutex_);
+        for (auto it = cache_.begin(); it != cache_.end();) {
+            if (it->second.queued) {
+                ++it;
+            } else {
+                it = cache_.erase(it);
+            }
+        }
+    }
+    
+    Stats stats() const {
+        lock_guard<std::mutex> lock(mutex_);
+        return stats_;
+    }
+    
+private:
+    using Clock = std::chrono::steady_clock;
+    
+    struct Waiter {
+        int port;
+        Callback done;
+    };
+    
+    struct Entry {
+        Addresses addresses;            // Empty until a lookup succeeds
+        string error;                   // Why the last lookup failed, if it did
+        Clock::time_point resolved;
+        bool queued = false;            // Lookup pending on the worker
+        vector<Waiter> waiters;
+    };
+    
+    enum class Cached { Usable, Failed, Missing };
+    
+    // Look host up in the cache, queueing a refresh of a stale entry
+    Cached find(std::unique_lock<std::mutex>&, const string& host, Addresses& addresses) {
+        auto it = cache_.find(host);
+        if (it == cache_.end()) {
+            return Cached::Missing;
+        }
+        Entry& entry = it->second;
+        auto age = Clock::now() - entry.resolved;
+        if (!entry.error.empty()) {
+            if (age < negative_ttl_) {
+                ++stats_.hits;
+                return Cached::Failed;
+            }
+            return Cached::Missing;
+        }
+        if (entry.addresses.empty() || age >= ttl_ * 2) {
+            return Cached::Missing;
+        }
+        if (age >= ttl_) {
+            schedule(entry, host);
+        }
+        ++stats_.hits;
+        addresses = entry.addresses;
+        return Cached::Usable;
+    }
+    
+    void schedule(Entry& entry, const string& host) {
+        if (entry.queued) return;
+        entry.queued = true;
+        queue_.push_back(host);
+        if (!worker_.joinable()) {
+            worker_ = std::thread([this] { work(); });
+        }
+        queued_.notify_one();
+    }
+    
+    void work() {
+        std::unique_lock<std::mutex> lock(mutex_);
+        while (true) {
+            queued_.wait(lock, [this] { return stopping_ || !queue_.empty(); });
+            if (stopping_) return;
+            string host = std::move(queue_.front());
+            queue_.pop_front();
+            
+            lock.unlock();
+            string error;
+            Addresses found = lookup(host, error);
+            store(host, found, error);
+            lock.lock();
+        }
+    }
+    
+    // Record a lookup and answer those waiting for it. A failed refresh
+    // keeps the addresses found before until they expire.
+    void store(const string& host, const Addresses& found, const string& error) {
+        vector<Waiter> waiters;
+        {
+            lock_guard<std::mutex> lock(mutex_);
+            ++stats_.lookups;
+            Entry& entry = cache_[host];
+            entry.queued = false;
+            waiters.swap(entry.waiters);
+            if (!found.empty()) {
+                entry.addresses = found;
+                entry.error.clear();
+                entry.resolved = Clock::now();
+            } else {
+                ++stats_.failures;
+                if (entry.addresses.empty() || Clock::now() - entry.resolved >= ttl_ * 2) {
+                    entry.addresses.clear();
+                    entry.error = error;
+                    entry.resolved = Clock::now();
+                }
+            }
+        }
+        for (Waiter& waiter : waiters) {
+            if (found.empty()) {
+                waiter.done(std::make_exception_ptr(std::runtime_error(error)), found);
+            } else {
+                waiter.done(nullptr, with_port(found, waiter.port));
+            }
+        }
+    }
+    
+    static Addresses lookup(const string& host, string& error) {
+        addrinfo hints{};
+        hints.ai_family = AF_UNSPEC;
+        hints.ai_socktype = SOCK_STREAM;
+        addrinfo* results = nullptr;
+        int status = getaddrinfo(host.c_str(), nullptr, &hints, &results);
+        Addresses addresses;
+        if (status != 0) {
+            error = "Failed to resolve " + host + ": " + gai_strerror(status);
+            return addresses;
+        }
+        for (addrinfo* info = results; info; info = info->ai_next) {
+            if (info->ai_family != AF_INET && info->ai_family != AF_INET6) continue;
+            Address address;
+            std::memcpy(&address.storage, info->ai_addr, info->ai_addrlen);
+            address.length = static_cast<socklen_t>(info->ai_addrlen);
+            addresses.push_back(address);
+        }
+        freeaddrinfo(results);
+        if (addresses.empty()) {
+            error = "No address for " + host;
+        }
+        return addresses;
+    }
+    
+    // Literal IPv4 and IPv6 addresses need no lookup
+    static bool numeric(const string& host, int port, Addresses& addresses) {
+        string literal = host.size() > 2 && host.front() == '[' && host.back() == ']'
+            ? host.substr(1, host.size() - 2) : host;
+        Address address;
+        auto* v4 = reinterpret_cast<sockaddr_in*>(&address.storage);
+        auto* v6 = reinterpret_cast<sockaddr_in6*>(&address.storage);
+        if (inet_pton(AF_INET, literal.c_str(), &v4->sin_addr) > 0) {
+            v4->sin_family = AF_INET;
+            address.length = sizeof(sockaddr_in);
+        } else if (inet_pton(AF_INET6, literal.c_str(), &v6->sin6_addr) > 0) {
+            v6->sin6_family = AF_INET6;
+            address.length = sizeof(sockaddr_in6);
+        } else {
+            return false;
+        }
+        addresses.assign(1, address);
+        addresses = with_port(std::move(addresses), port);
+        return true;
+    }
+    
+    static Addresses with_port(Addresses addresses, int port) {
+        for (Address& address : addresses) {
+            if (address.family() == AF_INET6) {
+                reinterpret_cast<sockaddr_in6*>(&address.storage)->sin6_port = htons(port);
+            } else {
+                reinterpret_cast<sockaddr_in*>(&address.storage)->sin_port = htons(port);
+            }
+        }
+        return addresses;
+    }
+    
+    mutable std::mutex mutex_;
+    std::condition_variable queued_;
+    std::unordered_map<string, Entry> cache_;
+    std::deque<string> queue_;
+    std::thread worker_;
+    bool stopping_ = false;
+    Clock::duration ttl_;
+    Clock::duration negative_ttl_;
+    Stats stats_;
+};
+
+#ifdef __linux__
+// Edge-triggered epoll reactor driven by a single thread.
+// Callbacks are keyed by fd; the upper 32 bits of the epoll cookie carry a
+// generation so events queued for a closed fd never reach its successor.
+class EventLoop {
+public:
+    using Callback = std::function<void(uint32_t)>;
+    using Clock = std::chrono::steady_clock;
+    using TimerId = std::pair<Clock::time_point, uint64_t>;
+    
+    explicit EventLoop(int max_events = 256)
+        : events_(max_events > 0 ? max_events : 256) {
+        epoll_fd_ = epoll_create1(EPOLL_CLOEXEC);
+        wake_fd_ = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        if (epoll_fd_ < 0 || wake_fd_ < 0) {
+            if (epoll_fd_ >= 0) close(epoll_fd_);
+            if (wake_fd_ >= 0) close(wake_fd_);
+            throw std::runtime_error("Failed to create event loop");
+        }
+        
+        epoll_event ev{};
+        ev.events = EPOLLIN;
+        ev.data.u64 = static_cast<uint32_t>(wake_fd_);
+        epoll_ctl(epoll_fd_, EPOLL_CTL_ADD, wake_fd_, &ev);
+    }
+    
+    ~EventLoop() {
+        timers_.clear();
+        slots_.clear();
+        retired_.clear();
+        close(wake_fd_);
+        close(epoll_fd_);
+    }
+    
+    EventLoop(const EventLoop&) = delete;
+    EventLoop& operator=(const EventLoop&) = delete;
+    
+    // Register fd; the callback receives the epoll event mask
+    bool add(int fd, uint32_t events, Callback callback) {
+        if (fd < 0) return false;
+        if (static_cast<size_t>(fd) >= slots_.size()) {
+            slots_.resize(fd + 1);
+        }
+        Slot& slot = slots_[fd];
+        
+        epoll_event ev{};
+        ev.events = events;
+        ev.data.u64 = (static_cast<uint64_t>(slot.generation + 1) << 32) | static_cast<uint32_t>(fd);
+        if (epoll_ctl(epoll_fd_, EPOLL_CTL_ADD, fd, &ev) < 0) {
+            return false;
+        }
+        
+        ++slot.generation;
+        slot.callback = std::move(callback);
+        return true;
+    }
+    
+    bool modify(int fd, uint32_t events) {
+        if (fd < 0 || static_cast<size_t>(fd) >= slots_.size() || !slots_[fd].callback) {
+            return false;
+        }
+        epoll_event ev{};
+        ev.events = events;
+        ev.data.u64 = (static_cast<uint64_t>(slots_[fd].generation) << 32) | static_cast<uint32_t>(fd);
+        return epoll_ctl(epoll_fd_, EPOLL_CTL_MOD, fd, &ev) == 0;
+    }
+    
+    // Unregister fd. The callback is destroyed after the current batch, so it
+    // is safe to call this from inside the callback being removed.
+    void remove(int fd) {
+        if (fd < 0 || static_cast<size_t>(fd) >= slots_.size() || !slots_[fd].callback) {
+            return;
+        }
+        epoll_ctl(epoll_fd_, EPOLL_CTL_DEL, fd, nullptr);
+        retired_.push_back(std::move(slots_[fd].callback));
+        slots_[fd].callback = nullptr;
+    }
+    
+    // Queue a task to run on the loop thread (thread-safe)
+    void post(std::function<void()> task) {
+        {
+            lock_guard<std::mutex> lock(tasks_mutex_);
+            tasks_.push_back(std::move(task));
+        }
+        wake();
+    }
+    
+    // Run fn on the loop thread once delay has elapsed (loop thread only)
+    TimerId run_after(std::chrono::milliseconds delay, std::function<void()> fn) {
+        TimerId id{Clock::now() + delay, ++timer_seq_};
+        timers_.emplace(id, std::move(fn));
+        return id;
+    }
+    
+    void cancel(const TimerId& id) {
+        timers_.erase(id);
+    }
+    
+    // Ask run() to return (thread-safe)
+    void stop() {
+        stopping_ = true;
+        wake();
+    }
+    
+    bool stopping() const { return stopping_; }
+    
+    // Loop dispatching on this thread, if any; coroutines suspend onto it
+    static EventLoop* current() { return current_; }
+    
+    // Makes a loop current on this thread while another poller drives it:
+    // one that waits for fd() to be readable or next_timer() to pass, then
+    // calls run_once(0)
+    class Scope {
+    public:
+        explicit Scope(EventLoop& loop) : previous_(current_) { current_ = &loop; }
+        ~Scope() { current_ = previous_; }
+        Scope(const Scope&) = delete;
+        Scope& operator=(const Scope&) = delete;
+    private:
+        EventLoop* previous_;
+    };
+    
+    // Readable while events are waiting to be dispatched
+    int fd() const { return epoll_fd_; }
+    
+    // When the earliest timer is due; time_point::max() without timers
+    Clock::time_point next_timer() const {
+        return timers_.empty() ? Clock::time_point::max() : timers_.begin()->first.first;
+    }
+    
+    void run() {
+        while (!stopping_) {
+            run_once(-1);
+        }
+    }
+    
+    // Wait for and dispatch one batch of events and expired timers
+    void run_once(int timeout_ms) {
+        EventLoop* previous = current_;
+        current_ = this;
+        if (!timers_.empty()) {
+            auto until = std::chrono::duration_cast<std::chrono::milliseconds>(
+                timers_.begin()->first.first - Clock::now()).count() + 1;
+            if (until < 0) until = 0;
+            if (timeout_ms < 0 || until < timeout_ms) timeout_ms = static_cast<int>(until);
+        }
+        
+        int count = epoll_wait(epoll_fd_, events_.data(), static_cast<int>(events_.size()), timeout_ms);
+        
+        for (int i = 0; i < count; ++i) {
+            int fd = static_cast<int>(events_[i].data.u64 & 0xffffffffu);
+            uint32_t generation = static_cast<uint32_t>(events_[i].data.u64 >> 32);
+            
+            if (fd == wake_fd_) {
+                uint64_t value;
+                while (read(wake_fd_, &value, sizeof(value)) > 0) {}
+                run_posted();
+                continue;
+            }
+            
+            if (static_cast<size_t>(fd) < slots_.size()) {
+                Slot& slot = slots_[fd];
+                if (slot.callback && slot.generation == generation) {
+                    slot.callback(events_[i].events);
+                }
+            }
+        }
+        
+        run_timers();
+        retired_.clear();
+        current_ = previous;
+    }
+    
+private:
+    struct Slot {
+        uint32_t generation = 0;
+        Callback callback;
+    };
+    
+    void wake() {
+        uint64_t one = 1;
+        ssize_t written = write(wake_fd_, &one, sizeof(one));
+        (void)written;
+    }
+    
+    void run_timers() {
+        auto now = Clock::now();
+        while (!timers_.empty() && timers_.begin()->first.first <= now) {
+            auto fn = std::move(timers_.begin()->second);
+            timers_.erase(timers_.begin());
+            fn();
+        }
+    }
+    
+    void run_posted() {
+        vector<std::function<void()>> tasks;
+        {
+            lock_guard<std::mutex> lock(tasks_mutex_);
+            tasks.swap(tasks_);
+        }
+        for (auto& task : tasks) {
+            task();
+        }
+    }
+    
+    int epoll_fd_ = -1;
+    int wake_fd_ = -1;
+    std::atomic<bool> stopping_{false};
+    vector<epoll_event> events_;
+    vector<Slot> slots_;
+    vector<Callback> retired_;
+    std::mutex tasks_mutex_;
+    vector<std::function<void()>> tasks_;
+    map<TimerId, std::function<void()>> timers_;
+    uint64_t timer_seq_ = 0;
+    static inline thread_local EventLoop* current_ = nullptr;
+};
+
+#ifdef MNETWORK_HAS_COROUTINES
+inline EventLoop& current_loop() {
+    EventLoop* loop = EventLoop::current();
+    if (!loop) {
+        throw std::runtime_error("No event loop running on this thread");
+    }
+    return *loop;
+}
+
+// co_await sleep_for(delay) resumes the coroutine on the current EventLoop
+// once delay has elapsed, without holding up the thread
+inline auto sleep_for(std::chrono::milliseconds delay) {
+    struct Awaiter {
+        std::chrono::milliseconds delay;
+        
+        bool await_ready() const noexcept { return delay.count() <= 0; }
+        void await_suspend(std::coroutine_handle<> handle) {
+            current_loop().run_after(delay, [handle] { handle.resume(); });
+        }
+        void await_resume() noexcept {}
+    };
+    return Awaiter{delay};
+}
+
+// Non-blocking socket on the current EventLoop. Reads, writes and connects
+// suspend the calling coroutine until the socket is ready instead of
+// blocking the thread. One read and one write may be pending at a time.
+class AsyncSocket {
+public:
+    AsyncSocket() = default;
+    
+    // Take over a connected socket and register it with the current loop
+    explicit AsyncSocket(int fd) : state_(std::make_shared<State>()) {
+        state_->fd = fd;
+        state_->loop = &current_loop();
+        fcntl(fd, F_SETFL, fcntl(fd, F_GETFL, 0) | O_NONBLOCK);
+        bool added = state_->loop->add(fd, EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET,
+            [state = state_](uint32_t events) {
+                if ((events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR)) && state->reader) {
+                    std::exchange(state->reader, nullptr).resume();
+                }
+                if ((events & (EPOLLOUT | EPOLLHUP | EPOLLERR)) && state->writer) {
+                    std::exchange(state->writer, nullptr).resume();
+                }
+            });
+        if (!added) {
+            close();
+            throw std::runtime_error("Failed to register socket");
+        }
+    }
+    
+    AsyncSocket(AsyncSocket&&) noexcept = default;
+    AsyncSocket& operator=(AsyncSocket&& other) noexcept {
+        if (this != &other) {
+            close();
+            state_ = std::move(other.state_);
+        }
+        return *this;
+    }
+    
+    ~AsyncSocket() { close(); }
+    
+    // Connect to host, trying each of its addresses in turn. A name not in
+    // the resolver's cache is looked up off the loop thread.
+    static Task<AsyncSocket> connect(string host, int port) {
+        Resolver::Addresses addresses;
+        if (!Resolver::shared()->cached(host, port, addresses)) {
+            Resolved lookup{host, port, nullptr, {}};
+            addresses = co_await lookup;
+        }
+        
+        for (const Resolver::Address& address : addresses) {
+            int fd = socket(address.family(), SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+            if (fd < 0) {
+                continue;
+            }
+            AsyncSocket socket(fd);
+            
+            if (::connect(fd, address.get(), address.length) < 0) {
+                if (errno != EINPROGRESS) {
+                    continue;
+                }
+                co_await socket.writable();
+                int error = 0;
+                socklen_t length = sizeof(error);
+                if (getsockopt(fd, SOL_SOCKET, SO_ERROR, &error, &length) < 0 || error != 0) {
+                    continue;
+                }
+            }
+            co_return std::move(socket);
+        }
+        throw std::runtime_error("Connection failed");
+    }
+    
+    // Read up to size bytes; 0 at end of stream, -1 on error
+    Task<ssize_t> read(char* data, size_t size) {
+        while (true) {
+            ssize_t n = recv(state_->fd, data, size, 0);
+            if (n >= 0) co_return n;
+            if (errno == EINTR) continue;
+            if (errno != EAGAIN && errno != EWOULDBLOCK) co_return -1;
+            co_await readable();
+        }
+    }
+    
+    // Write all of data; false on error
+    Task<bool> write(std::string_view data) {
+        while (!data.empty()) {
+            ssize_t n = send(state_->fd, data.data(), data.size(), MSG_NOSIGNAL);
+            if (n > 0) {
+                data.remove_prefix(static_cast<size_t>(n));
+                continue;
+            }
+            if (n < 0 && errno == EINTR) continue;
+            if (n == 0 || (errno != EAGAIN && errno != EWOULDBLOCK)) co_return false;
+            co_await writable();
+        }
+        co_return true;
+    }
+    
+    void close() {
+        if (!state_) return;
+        state_->loop->remove(state_->fd);
+        ::close(state_->fd);
+        state_.reset();
+    }
+    
+    int fd() const { return state_ ? state_->fd : -1; }
+    
+private:
+    struct State {
+        int fd = -1;
+        EventLoop* loop = nullptr;
+        std::coroutine_handle<> reader;
+        std::coroutine_handle<> writer;
+    };
+    
+    struct ReadyAwaiter {
+        std::coroutine_handle<>& waiter;
+        
+        bool await_ready() const noexcept { return false; }
+        void await_suspend(std::coroutine_handle<> handle) noexcept { waiter = handle; }
+        void await_resume() noexcept {}
+    };
+    
+    ReadyAwaiter readable() { return ReadyAwaiter{state_->reader}; }
+    ReadyAwaiter writable() { return ReadyAwaiter{state_->writer}; }
+    
+    // Resolver::resolve_async() for a coroutine, which resumes on its loop
+    struct Resolved {
+        string host;
+        int port;
+        std::exception_ptr error;
+        Resolver::Addresses addresses;
+        
+        bool await_ready() const noexcept { return false; }
+        
+        void await_suspend(std::coroutine_handle<> handle) {
+            EventLoop* loop = &current_loop();
+            Resolver::shared()->resolve_async(host, port,
+                [this, handle, loop](std::exception_ptr failure, const Resolver::Addresses& found) {
+                    error = failure;
+                    addresses = found;
+                    loop->post([handle] { handle.resume(); });
+                });
+        }
+        
+        Resolver::Addresses await_resume() {
+            if (error) std::rethrow_exception(error);
+            return std::move(addresses);
+        }
+    };
+    
+    std::shared_ptr<State> state_;
+};
+#endif
+#endif
+
+#ifdef MNETWORK_HAS_IO_URING
+// Minimal io_uring wrapper over the raw syscalls, so no liburing dependency.
+// One instance per thread; nothing here is thread-safe except wake fds.
+class IoUring {
+public:
+    explicit IoUring(unsigned entries) {
+        io_uring_params params{};
+        params.flags = IORING_SETUP_CQSIZE;
+        params.cq_entries = entries * 4;
+        
+        ring_fd_ = static_cast<int>(syscall(__NR_io_uring_setup, entries, &params));
+        if (ring_fd_ < 0) {
+            throw std::runtime_error("io_uring_setup failed: " + string(std::strerror(errno)));
+        }
+        
+        sq_ring_size_ = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+        cq_ring_size_ = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+        bool single_mmap = params.features & IORING_FEAT_SINGLE_MMAP;
+        if (single_mmap) {
+            sq_ring_size_ = cq_ring_size_ = std::max(sq_ring_size_, cq_ring_size_);
+        }
+        
+        sq_ring_ = mmap(nullptr, sq_ring_size_, PROT_READ | PROT_WRITE,
+                        MAP_SHARED | MAP_POPULATE, ring_fd_, IORING_OFF_SQ_RING);
+        cq_ring_ = single_mmap ? sq_ring_ :
+            mmap(nullptr, cq_ring_size_, PROT_READ | PROT_WRITE,
+                 MAP_SHARED | MAP_POPULATE, ring_fd_, IORING_OFF_CQ_RING);
+        sqes_size_ = params.sq_entries * sizeof(io_uring_sqe);
+        void* sqes = mmap(nullptr, sqes_size_, PROT_READ | PROT_WRITE,
+                          MAP_SHARED | MAP_POPULATE, ring_fd_, IORING_OFF_SQES);
+        if (sq_ring_ == MAP_FAILED || cq_ring_ == MAP_FAILED || sqes == MAP_FAILED) {
+            if (sqes != MAP_FAILED) munmap(sqes, sqes_size_);
+            release();
+            throw std::runtime_error("io_uring mmap failed");
+        }
+        sqes_ = static_cast<io_uring_sqe*>(sqes);
+        
+        char* sq = static_cast<char*>(sq_ring_);
+        sq_head_ = reinterpret_cast<unsigned*>(sq + params.sq_off.head);
+        sq_tail_ = reinterpret_cast<unsigned*>(sq + params.sq_off.tail);
+        sq_mask_ = *reinterpret_cast<unsigned*>(sq + params.sq_off.ring_mask);
+        sq_array_ = reinterpret_cast<unsigned*>(sq + params.sq_off.array);
+        sq_entries_ = params.sq_entries;
+        sqe_tail_ = *sq_tail_;
+        
+        char* cq = static_cast<char*>(cq_ring_);
+        cq_head_ = reinterpret_cast<unsigned*>(cq + params.cq_off.head);
+        cq_tail_ = reinterpret_cast<unsigned*>(cq + params.cq_off.tail);
+        cq_mask_ = *reinterpret_cast<unsigned*>(cq + params.cq_off.ring_mask);
+        cqes_ = reinterpret_cast<io_uring_cqe*>(cq + params.cq_off.cqes);
+    }
+    
+    ~IoUring() {
+        if (buf_ring_) {
+            io_uring_buf_reg reg{};
+            reg.bgid = buf_group_;
+            syscall(__NR_io_uring_register, ring_fd_, IORING_UNREGISTER_PBUF_RING, &reg, 1);
+            munmap(buf_ring_, buf_ring_size_);
+        }
+        if (sqes_) munmap(sqes_, sqes_size_);
+        release();
+    }
+    
+    IoUring(const IoUring&) = delete;
+    IoUring& operator=(const IoUring&) = delete;
+    
+    // Next free submission entry, zeroed; flushes the queue when it is full
+    io_uring_sqe* get_sqe() {
+        unsigned head = __atomic_load_n(sq_head_, __ATOMIC_ACQUIRE);
+        if (sqe_tail_ - head >= sq_entries_) {
+            submit();
+            head = __atomic_load_n(sq_head_, __ATOMIC_ACQUIRE);
+            if (sqe_tail_ - head >= sq_entries_) return nullptr;
+        }
+        unsigned index = sqe_tail_ & sq_mask_;
+        io_uring_sqe* sqe = &sqes_[index];
+        std::memset(sqe, 0, sizeof(*sqe));
+        sq_array_[index] = index;
+        ++sqe_tail_;
+        return sqe;
+    }
+    
+    // Submit everything queued and optionally wait for completions
+    int submit(unsigned wait_nr = 0) {
+        unsigned to_submit = sqe_tail_ - __atomic_load_n(sq_tail_, __ATOMIC_RELAXED);
+        __atomic_store_n(sq_tail_, sqe_tail_, __ATOMIC_RELEASE);
+        while (true) {
+            int ret = static_cast<int>(syscall(__NR_io_uring_enter, ring_fd_, to_submit, wait_nr,
+                                               wait_nr ? IORING_ENTER_GETEVENTS : 0, nullptr, 0));
+            if (ret < 0 && errno == EINTR) {
+                to_submit = 0;
+                continue;
+            }
+            return ret;
+        }
+    }
+    
+    // Call fn for every available completion and retire them
+    template <typename Fn>
+    unsigned for_each_completion(Fn&& fn) {
+        unsigned head = *cq_head_;
+        unsigned tail = __atomic_load_n(cq_tail_, __ATOMIC_ACQUIRE);
+        unsigned count = 0;
+        while (head != tail) {
+            io_uring_cqe cqe = cqes_[head & cq_mask_];
+            ++head;
+            ++count;
+            __atomic_store_n(cq_head_, head, __ATOMIC_RELEASE);
+            fn(cqe);
+            tail = __atomic_load_n(cq_tail_, __ATOMIC_ACQUIRE);
+        }
+        return count;
+    }
+    
+    // Register a provided buffer ring of count buffers of size bytes each
+    void setup_buffer_ring(uint16_t group, unsigned count, unsigned size) {
+        if (count == 0 || (count & (count - 1)) != 0 || count > 32768) {
+            throw std::runtime_error("io_uring buffer count must be a power of two up to 32768");
+        }
+        
+        buf_ring_size_ = count * sizeof(io_uring_buf);
+        void* ring = mmap(nullptr, buf_ring_size_, PROT_READ | PROT_WRITE,
+                          MAP_ANONYMOUS | MAP_PRIVATE, -1, 0);
+        if (ring == MAP_FAILED) {
+            throw std::runtime_error("io_uring buffer ring allocation failed");
+        }
+        
+        io_uring_buf_reg reg{};
+        reg.ring_addr = reinterpret_cast<uint64_t>(ring);
+        reg.ring_entries = count;
+        reg.bgid = group;
+        if (syscall(__NR_io_uring_register, ring_fd_, IORING_REGISTER_PBUF_RING, &reg, 1) < 0) {
+            munmap(ring, buf_ring_size_);
+            throw std::runtime_error("io_uring buffer ring registration failed: " +
+                                     string(std::strerror(errno)));
+        }
+        
+        buf_ring_ = static_cast<io_uring_buf_ring*>(ring);
+        buf_group_ = group;
+        buf_count_ = count;
+        buf_size_ = size;
+        buffers_.resize(static_cast<size_t>(count) * size);
+        for (unsigned i = 0; i < count; ++i) {
+            add_buffer(static_cast<uint16_t>(i));
+        }
+        __atomic_store_n(&buf_ring_->tail, static_cast<uint16_t>(buf_tail_), __ATOMIC_RELEASE);
+    }
+    
+    const char* buffer(uint16_t id) const { return &buffers_[static_cast<size_t>(id) * buf_size_]; }
+    uint16_t buffer_group() const { return buf_group_; }
+    
+    // Hand a consumed buffer back to the kernel
+    void recycle_buffer(uint16_t id) {
+        add_buffer(id);
+        __atomic_store_n(&buf_ring_->tail, static_cast<uint16_t>(buf_tail_), __ATOMIC_RELEASE);
+    }
+    
+private:
+    // The ring tail aliases the first entry's resv field, so only addr/len/bid
+    // are written here. Entries are indexed from the ring base directly: in C++
+    // the header's flexible-array wrapper shifts io_uring_buf_ring::bufs by 8 bytes.
+    void add_buffer(uint16_t id) {
+        io_uring_buf& buf = reinterpret_cast<io_uring_buf*>(buf_ring_)[buf_tail_ & (buf_count_ - 1)];
+        buf.addr = reinterpret_cast<uint64_t>(&buffers_[static_cast<size_t>(id) * buf_size_]);
+        buf.len = buf_size_;
+        buf.bid = id;
+        ++buf_tail_;
+    }
+    
+    void release() {
+        if (cq_ring_ && cq_ring_ != MAP_FAILED && cq_ring_ != sq_ring_) munmap(cq_ring_, cq_ring_size_);
+        if (sq_ring_ && sq_ring_ != MAP_FAILED) munmap(sq_ring_, sq_ring_size_);
+        sq_ring_ = cq_ring_ = nullptr;
+        if (ring_fd_ >= 0) close(ring_fd_);
+        ring_fd_ = -1;
+    }
+    
+    int ring_fd_ = -1;
+    void* sq_ring_ = nullptr;
+    void* cq_ring_ = nullptr;
+    size_t sq_ring_size_ = 0;
+    size_t cq_ring_size_ = 0;
+    size_t sqes_size_ = 0;
+    io_uring_sqe* sqes_ = nullptr;
+    unsigned* sq_head_ = nullptr;
+    unsigned* sq_tail_ = nullptr;
+    unsigned* sq_array_ = nullptr;
+    unsigned sq_mask_ = 0;
+    unsigned sq_entries_ = 0;
+    unsigned sqe_tail_ = 0;
+    unsigned* cq_head_ = nullptr;
+    unsigned* cq_tail_ = nullptr;
+    unsigned cq_mask_ = 0;
+    io_uring_cqe* cqes_ = nullptr;
+    
+    io_uring_buf_ring* buf_ring_ = nullptr;
+    size_t buf_ring_size_ = 0;
+    uint16_t buf_group_ = 0;
+    unsigned buf_count_ = 0;
+    unsigned buf_size_ = 0;
+    unsigned buf_tail_ = 0;
+    vector<char> buffers_;
+};
+#endif
+
+// Modern HTTP Server Class
+class HttpServer {
+private:
+    ServerConfig config_;
+    vector<int> listen_fds_;    // One shared listener, or one per worker with reuse_port
+    std::atomic<bool> running_{false};
+    vector<std::thread> worker_threads_;
+    Router router_;
+    bool async_routes_ = false;     // Set by async_route()
+    vector<Middleware> middlewares_;
+    StaticCache static_cache_;
+    BufferPool buffer_pool_;
+    CountingResource arena_upstream_;
+    std::unique_ptr<HandlerPool> handler_pool_;     // Set when handlers run apart from I/O
+    std::unique_ptr<Metrics> metrics_;              // Set by metrics_route()
+    std::unique_ptr<CompressionConfig> compression_;  // Set by compress()
+    
+    // Thread-safe logging; buffered while the server runs
+    void log(const string& message) const {
+        if (config_.verbose) {
+            logger_.write(AsyncLogger::Stream::Console, message);
+        }
+    }
+    
+    // Access log line: "METHOD path version" status bytes seconds
+    void log_access(const HttpRequest& request, const HttpResponse& response,
+                    std::chrono::steady_clock::duration elapsed) const {
+        thread_local string line;
+        line.clear();
+        line.append("\"").append(request.method).append(" ").append(request.path);
+        line.append(" ").append(request.version).append("\" ");
+        line.append(std::to_string(response.status_code)).append(" ");
+        if (!response.producer) {
+            line.append(std::to_string(response.body_size()));
+        } else {
+            auto it = response.headers.find("Content-Length");
+            line.append(it != response.headers.end() ? it->second : "-");
+        }
+        double seconds = std::chrono::duration<double>(elapsed).count();
+        char duration[32];
+        std::snprintf(duration, sizeof(duration), " %.6f", seconds);
+        line.append(duration);
+        logger_.write(AsyncLogger::Stream::Access, line);
+    }
+    
+    mutable AsyncLogger logger_;
+    
+    void initialize_sockets() {
+#ifdef _WIN32
+        WSADATA wsa_data;
+        if (WSAStartup(MAKEWORD(2, 2), &wsa_data) != 0) {
+            throw std::runtime_error("WSAStartup failed");
+        }
+#endif
+    }
+    
+    void cleanup_sockets() {
+#ifdef _WIN32
+        WSACleanup();
+#endif
+    }
+    
+    // Copy the parsed views into the handler-facing request
+    static void build_request(const RequestParser& parser, RequestContext& context) {
+        HttpRequest& req = context.request;
+        req.method.assign(parser.method());
+        req.path.assign(parser.path());
+        req.version.assign(parser.version());
+        req.received = std::chrono::steady_clock::now();
+        
+        for (size_t i = 0; i < parser.header_count(); ++i) {
+            RequestParser::Header header = parser.header(i);
+            req.headers.set(header.name, header.value);
+        }
+        
+        // Parse query parameters
+        std::string_view query = parser.query();
+        while (!query.empty()) {
+            size_t amp = query.find('&');
+            std::string_view pair = query.substr(0, amp);
+            size_t equals = pair.find('=');
+            if (equals != std::string_view::npos) {
+                context.assign(req.query_params, pair.substr(0, equals), pair.substr(equals + 1));
+            }
+            query = amp == std::string_view::npos ? std::string_view() : query.substr(amp + 1);
+        }
+        
+        req.body.assign(parser.body());
+    }
+    
+    // Apply middlewares; false once one of them has answered the request
+    bool run_middlewares(const HttpRequest& request, HttpResponse& response) {
+        if (config_.verbose) {
+            log(request.method + " " + request.path);
+        }
+        for (const auto& middleware : middlewares_) {
+            if (!middleware(request, response)) {
+                return false;
+            }
+        }
+        return true;
+    }
+    
+    // An async route is left to the caller through deferred when it is given
+    void dispatch(HttpRequest& request, HttpResponse& response,
+                  const Router::Route** deferred = nullptr) {
+#ifndef MNETWORK_HAS_COROUTINES
+        (void)deferred;
+#endif
+        try {
+            if (run_middlewares(request, response)) {
+                // Find and execute route handler
+                const Router::Route* route =
+                    router_.find(request.method, request.path, request.params);
+                if (route && route->sink) {
+                    // A streaming route hit by a request without a body
+                    std::unique_ptr<BodySink> sink = route->sink(request);
+                    if (!sink || !sink->finish()) {
+                        response = error_response(500);
+                        return;
+                    }
+                    request.body_sink = sink.get();
+                    request.route_pattern = route->pattern;
+                    route->handler(request, response);
+                } else if (route) {
+                    request.route_pattern = route->pattern;
+#ifdef MNETWORK_HAS_COROUTINES
+                    if (route->async_handler) {
+                        // start() refuses async routes where no EventLoop could resume them
+                        if (!deferred) {
+                            throw std::runtime_error("Async route reached without an event loop");
+                        }
+                        *deferred = route;
+                        return;
+                    }
+#endif
+                    route->handler(request, response);
+                } else {
+                    response.status_code = 404;
+                    response.status_text = "Not Found";
+                    response.body = "<h1>404 Not Found</h1>";
+                }
+            }
+        } catch (const std::exception& e) {
+            log("Error processing request: " + string(e.what()));
+            
+            response = HttpResponse();
+            response.status_code = 500;
+            response.status_text = "Internal Server Error";
+            response.body = "<h1>500 Internal Server Error</h1>";
+        }
+    }
+    
+    // HTTP/1.1 defaults to persistent connections, HTTP/1.0 must opt in
+    static bool keep_alive_requested(const HttpRequest& request) {
+        auto it = request.headers.find("Connection");
+        if (it != request.headers.end()) {
+            if (header_has_token(it->second, "close")) return false;
+            if (header_has_token(it->second, "keep-alive")) return true;
+        }
+        return request.version == "HTTP/1.1";
+    }
+    
+    static HttpResponse error_response(int status_code) {
+        HttpResponse response;
+        response.status_code = status_code;
+        response.status_text = status_reason(status_code);
+        response.body = "<h1>" + std::to_string(status_code) + " " + response.status_text + "</h1>";
+        return response;
+    }
+    
+    // Dispatch one parsed request, deciding whether the connection stays open
+    // The response lives in context and is valid until the next reset().
+    // With deferred, an async route is returned there instead of being run.
+    HttpResponse& process_request(const RequestParser& parser, RequestContext& context,
+                                  int requests_served, const Router::Route** deferred = nullptr) {
+        context.reset();
+        HttpResponse& response = context.response;
+        bool keep_alive = false;
+        try {
+            build_request(parser, context);
+            keep_alive = keep_alive_requested(context.request);
+            dispatch(context.request, response, deferred);
+        } catch (const std::exception& e) {
+            log("Error processing request: " + string(e.what()));
+            response = error_response(500);
+        }
+        
+        if (deferred && *deferred) {
+            return response;
+        }
+        finish_response(response, context.request, keep_alive, requests_served);
+        return response;
+    }
+    
+    
+    // Decide whether the connection stays open after this response, and how
+    // a streamed body is framed
+    void finish_response(HttpResponse& response, const HttpRequest& request, bool keep_alive,
+                         int requests_served) {
+#ifdef MNETWORK_HAS_ZLIB
+        if (compression_) {
+            compress_response(response, request);
+        }
+#endif
+        
+        // A handler may force the connection closed
+        auto it = response.headers.find("Connection");
+        if (it != response.headers.end() && header_has_token(it->second, "close")) {
+            keep_alive = false;
+        }
+        
+        if (response.producer) {
+            if (response.status_code == 204 || response.status_code == 304) {
+                response.producer = nullptr;
+            } else if (response.headers.find("Content-Length") != response.headers.end()) {
+                response.chunked = false;
+            } else if (request.version == "HTTP/1.1") {
+                response.chunked = true;
+            } else {
+                // HTTP/1.0 has no chunked coding; closing the connection ends the body
+                response.chunked = false;
+                keep_alive = false;
+            }
+        }
+        
+        response.keep_alive = keep_alive && running_ &&
+            requests_served + 1 < config_.max_keep_alive_requests;
+        
+        if (metrics_ || !config_.access_log.empty()) {
+            auto elapsed = std::chrono::steady_clock::now() - request.received;
+            if (metrics_) {
+                metrics_->record(request.route_pattern, response.status_code, elapsed);
+            }
+            if (!config_.access_log.empty()) {
+                log_access(request, response, elapsed);
+            }
+        }
+    }
+    
+#ifdef MNETWORK_HAS_ZLIB
+    // Compress the body if a rule covers its type and the client accepts
+    // gzip or deflate. A body in memory is compressed here; files and
+    // streamed bodies as they are sent, a chunk at a time.
+    void compress_response(HttpResponse& response, const HttpRequest& request) {
+        if (!response.compressible) return;
+        int status = response.status_code;
+        if (status < 200 || status == 204 || status == 206 || status == 304) return;
+        if (response.headers.find("Content-Encoding") != response.headers.end()) return;
+        auto cache_control = response.headers.find("Cache-Control");
+        if (cache_control != response.headers.end() && header_has_token(cache_control->second, "no-transform")) {
+            return;
+        }
+        
+        auto content_type = response.headers.find("Content-Type");
+        const CompressionRule* rule = compression_->find(content_type != response.headers.end()
+            ? std::string_view(content_type->second) : std::string_view("text/html"));
+        if (!rule || rule->level <= 0) return;
+        
+        // A streamed body counts as large unless it declares its length
+        size_t size = std::numeric_limits<size_t>::max();
+        auto length = response.headers.find("Content-Length");
+        if (!response.producer) {
+            size = response.body_size();
+        } else if (length != response.headers.end()) {
+            size = std::strtoull(length->second.c_str(), nullptr, 10);
+        }
+        if (size < rule->min_size) return;
+        
+        // From here the representation depends on Accept-Encoding
+        response.add_vary("Accept-Encoding");
+        auto accept = request.headers.find("Accept-Encoding");
+        Deflater::Format format;
+        if (accept == request.headers.end() || !Deflater::negotiate(accept->second, format)) return;
+        
+        response.headers.set("Content-Encoding", format == Deflater::Format::Gzip ? "gzip" : "deflate");
+        response.headers.erase("Content-Length");
+        // A strong validator stands for exact bytes, which compression changes
+        auto etag = response.headers.find("ETag");
+        if (etag != response.headers.end() && etag->second.compare(0, 2, "W/") != 0) {
+            etag->second.insert(0, "W/");
+        }
+        
+        if (response.file) {
+            // Read the file through the writer instead of using sendfile()
+            std::shared_ptr<FileBody> file = std::move(response.file);
+            response.stream([file, remaining = file->length](ResponseWriter& writer) mutable {
+                if (remaining == 0) return false;
+                string chunk(std::min(remaining, ResponseWriter::chunk_size), '\0');
+#ifdef _WIN32
+                int n = _read(file->fd, &chunk[0], static_cast<unsigned>(chunk.size()));
+#else
+                ssize_t n;
+                do {
+                    n = ::read(file->fd, &chunk[0], chunk.size());
+                } while (n < 0 && errno == EINTR);
+#endif
+                if (n <= 0) throw std::runtime_error("Failed to read file");
+                chunk.resize(static_cast<size_t>(n));
+                remaining -= chunk.size();
+                writer.write(std::move(chunk));
+                return true;
+            });
+        }
+        if (response.producer) {
+            response.deflater = std::make_shared<Deflater>(format, rule->level);
+            return;
+        }
+        
+        response.body = Deflater::compress_all(format, rule->level,
+            response.shared_body ? *response.shared_body : response.body);
+        response.shared_body.reset();
+    }
+#endif
+    
+    // A streamed response whose head has been queued
+    struct ResponseStream {
+        BodyProducer producer;
+        ResponseWriter writer;
+        bool keep_alive;
+        bool done = false;
+        
+        ResponseStream(BodyProducer body_producer, OutputQueue& out, bool chunked, bool keep)
+            : producer(std::move(body_producer)), writer(out, chunked), keep_alive(keep) {}
+    };
+    
+    // After out.append(std::move(response)): the rest of a streamed response,
+    // or nullptr if the body was queued with the head
+    static std::unique_ptr<ResponseStream> take_stream(HttpResponse& response, OutputQueue& out) {
+        if (!response.producer) return nullptr;
+        auto stream = std::make_unique<ResponseStream>(std::move(response.producer), out,
+                                                       response.chunked, response.keep_alive);
+        stream->writer.deflater_ = std::move(response.deflater);
+        return stream;
+    }
+    
+    // Run the producer until stream_buffer_size bytes are queued or the body
+    // ends. The caller only asks for more once the output has drained, so a
+    // slow reader holds back the producer. False if the producer threw; the
+    // response cannot be completed and the connection must be closed.
+    bool produce(ResponseStream& stream) {
+        stream.writer.produced_ = 0;
+        try {
+            while (!stream.done && stream.writer.produced_ < config_.stream_buffer_size) {
+                stream.done = !stream.producer(stream.writer);
+            }
+        } catch (const std::exception& e) {
+            log("Error streaming response: " + string(e.what()));
+            stream.writer.flush();
+            return false;
+        }
+        if (stream.done) {
+            stream.writer.finish();
+        } else {
+            stream.writer.flush();
+        }
+        return true;
+    }
+    
+    // Select model: produce a streamed body, writing each part as it is made
+    bool write_stream(int client_fd, ResponseStream& stream, OutputQueue& output) {
+        while (!stream.done) {
+            bool produced = produce(stream);
+            if (output.write_to(client_fd) != OutputQueue::Status::Done || !produced) {
+                return false;
+            }
+        }
+        return stream.keep_alive;
+    }
+    
+    // A request on a stream_route() whose body is being fed to its sink
+    struct BodyStream {
+        HttpRequest request;
+        HttpResponse response;
+        const Router::Route* route = nullptr;
+        std::unique_ptr<BodySink> sink;
+        BodyDecoder decoder;
+        bool keep_alive = false;
+        bool rejected = false;          // Answered from the head; the body is not read
+        bool send_continue = false;     // Client sent Expect: 100-continue
+    };
+    
+    static constexpr std::string_view continue_response = "HTTP/1.1 100 Continue\r\n\r\n";
+    
+    // Route a request to its sink once its head is parsed. Middlewares run
+    // before any of the body is read, so they can refuse an upload early.
+    std::unique_ptr<BodyStream> begin_stream(const RequestParser& parser, RequestContext& context) {
+        auto stream = std::make_unique<BodyStream>();
+        context.reset();
+        build_request(parser, context);
+        stream->request = std::move(context.request);
+        stream->decoder = parser.body_decoder();
+        
+        HttpRequest& request = stream->request;
+        stream->keep_alive = keep_alive_requested(request);
+        try {
+            if (!run_middlewares(request, stream->response)) {
+                stream->rejected = true;
+            } else {
+                stream->route = router_.find(request.method, request.path, request.params);
+                if (stream->route && stream->route->sink) {
+                    request.route_pattern = stream->route->pattern;
+                    stream->sink = stream->route->sink(request);
+                }
+                if (!stream->sink) {
+                    stream->response = error_response(500);
+                    stream->rejected = true;
+                }
+                request.body_sink = stream->sink.get();
+            }
+        } catch (const std::exception& e) {
+            log("Error processing request: " + string(e.what()));
+            stream->response = error_response(500);
+            stream->rejected = true;
+        }
+        
+        if (stream->rejected) {
+            stream->keep_alive = false;
+        } else {
+            auto it = request.headers.find("Expect");
+            stream->send_continue = it != request.headers.end() && iequals(it->second, "100-continue");
+        }
+        return stream;
+    }
+    
+    // Feed buffered body bytes to the sink; consumed receives the bytes used
+    static BodyDecoder::Status feed_stream(BodyStream& stream, const char* data, size_t size,
+                                           size_t& consumed) {
+        return stream.decoder.feed(data, size, consumed, [&stream](std::string_view piece) {
+            try {
+                return stream.sink->write(piece);
+            } catch (const std::exception&) {
+                return false;
+            }
+        });
+    }
+    
+    // Run the handler once the body has been read, or answer the error
+    HttpResponse& end_stream(BodyStream& stream, BodyDecoder::Status status, int requests_served) {
+        if (stream.rejected) {
+            // Response already set from the head
+        } else if (status != BodyDecoder::Status::Complete) {
+            stream.response = error_response(stream.decoder.error_status());
+            stream.keep_alive = false;
+        } else {
+            try {
+                if (stream.sink->finish()) {
+                    stream.route->handler(stream.request, stream.response);
+                } else {
+                    stream.response = error_response(500);
+                }
+            } catch (const std::exception& e) {
+                log("Error processing request: " + string(e.what()));
+                stream.response = error_response(500);
+            }
+        }
+        finish_response(stream.response, stream.request, stream.keep_alive, requests_served);
+        return stream.response;
+    }
+    
+    // Parsers stop after the head for requests bound to a stream_route()
+    void configure_parser(RequestParser& parser) {
+        parser.set_limits(config_.max_header_size, config_.max_request_size, config_.max_body_size);
+        parser.set_stream_filter([this](const RequestParser& head) {
+            RouteParams params;
+            const Router::Route* route = router_.find(head.method(), head.path(), params);
+            return route && route->sink;
+        });
+    }
+    
+    // Receive up to chunk bytes straight onto the end of buffer
+    static ssize_t receive_into(int fd, string& buffer, size_t chunk) {
+        size_t old_size = buffer.size();
+        buffer.resize(old_size + chunk);
+        ssize_t n = recv(fd, &buffer[old_size], static_cast<int>(chunk), 0);
+        buffer.resize(old_size + (n > 0 ? n : 0));
+        return n;
+    }
+    
+    // Select model: feed a streamed body to its sink as it arrives, then
+    // answer. Returns whether the connection stays open.
+    bool serve_stream(int client_fd, RequestParser& parser, RequestContext& context,
+                      string& pending, OutputQueue& output, int requests_served) {
+        std::unique_ptr<BodyStream> stream = begin_stream(parser, context);
+        pending.erase(0, parser.head_length());
+        parser.reset();
+        
+        BodyDecoder::Status status = BodyDecoder::Status::Error;
+        if (!stream->rejected) {
+            if (stream->send_continue) {
+                output.append(continue_response);
+                if (output.write_to(client_fd) != OutputQueue::Status::Done) return false;
+            }
+            
+            size_t chunk = config_.buffer_size > 0 ? config_.buffer_size : 4096;
+            while (true) {
+                size_t used = 0;
+                status = feed_stream(*stream, pending.data(), pending.size(), used);
+                pending.erase(0, used);
+                if (status != BodyDecoder::Status::Incomplete) break;
+                if (receive_into(client_fd, pending, chunk) <= 0) return false;
+            }
+        }
+        
+        HttpResponse& response = end_stream(*stream, status, requests_served);
+        bool keep_alive = response.keep_alive;
+        output.append(std::move(response));
+        std::unique_ptr<ResponseStream> body = take_stream(response, output);
+        if (output.write_to(client_fd) != OutputQueue::Status::Done) {
+            return false;
+        }
+        return body ? write_stream(client_fd, *body, output) : keep_alive;
+    }
+    
+    void handle_connection(int client_fd, RequestContext& context) {
+        if (metrics_) {
+            metrics_->connection_opened();
+        }
+        
+        // Bound how long an idle persistent connection can hold this worker
+        if (config_.keep_alive_timeout_ms > 0) {
+#ifdef _WIN32
+            DWORD timeout = config_.keep_alive_timeout_ms;
+#else
+            timeval timeout{config_.keep_alive_timeout_ms / 1000,
+                            (config_.keep_alive_timeout_ms % 1000) * 1000};
+#endif
+            setsockopt(client_fd, SOL_SOCKET, SO_RCVTIMEO, (const char*)&timeout, sizeof(timeout));
+        }
+        
+        size_t chunk = config_.buffer_size > 0 ? config_.buffer_size : 4096;
+        string pending = buffer_pool_.acquire();
+        RequestParser parser;
+        configure_parser(parser);
+        int requests_served = 0;
+        OutputQueue output;
+        bool keep_alive = true;
+        
+        while (keep_alive && running_) {
+            RequestParser::Status status;
+            bool open = true;
+            while ((status = parser.parse(pending.data(), pending.size())) == RequestParser::Status::Incomplete) {
+                ssize_t bytes_received = receive_into(client_fd, pending, chunk);
+                if (bytes_received <= 0) {
+                    open = false;
+                    break;
+                }
+            }
+            if (!open) {
+                break;
+            }
+            
+            if (status == RequestParser::Status::Complete && parser.body_streamed()) {
+                keep_alive = serve_stream(client_fd, parser, context, pending, output, requests_served++);
+                continue;
+            }
+            
+            // Serve every complete request already buffered and answer them in
+            // one write. A streamed response ends the batch.
+            size_t consumed = 0;
+            int batched = 0;
+            std::unique_ptr<ResponseStream> body;
+            while (true) {
+                if (status == RequestParser::Status::Error) {
+                    output.append(error_response(parser.error_status()));
+                    keep_alive = false;
+                    break;
+                }
+                
+                HttpResponse& response = process_request(parser, context, requests_served++);
+                keep_alive = response.keep_alive;
+                output.append(std::move(response));
+                body = take_stream(response, output);
+                consumed += parser.message_length();
+                parser.reset();
+                
+                if (body || !keep_alive || ++batched >= config_.max_pipeline_depth) {
+                    break;
+                }
+                status = parser.parse(pending.data() + consumed, pending.size() - consumed);
+                if (status == RequestParser::Status::Incomplete) {
+                    break;
+                }
+            }
+            pending.erase(0, consumed);
+            
+            if (output.write_to(client_fd) != OutputQueue::Status::Done) {
+                break;
+            }
+            if (body) {
+                keep_alive = write_stream(client_fd, *body, output);
+            }
+        }
+        
+        buffer_pool_.release(std::move(pending));
+#ifdef _WIN32
+        closesocket(client_fd);
+#else
+        close(client_fd);
+#endif
+        if (metrics_) {
+            metrics_->connection_closed();
+        }
+    }
+    
+    void pin_current_thread(int index) {
+#ifdef __linux__
+        int cpu_count = static_cast<int>(std::thread::hardware_concurrency());
+        int cpu = config_.worker_cpus.empty()
+            ? index % (cpu_count > 0 ? cpu_count : 1)
+            : config_.worker_cpus[index % config_.worker_cpus.size()];
+        
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        CPU_SET(cpu, &set);
+        if (sched_setaffinity(0, sizeof(set), &set) != 0) {
+            log("Failed to pin worker " + std::to_string(index) + " to CPU " + std::to_string(cpu));
+        }
+#else
+        (void)index;
+#endif
+    }
+    
+    void worker_thread(int index) {
+        int listen_fd = listen_fds_[index % listen_fds_.size()];
+        if (config_.pin_workers) {
+            pin_current_thread(index);
+        }
+#ifndef _WIN32
+        // A peer that has gone away must fail a write with EPIPE rather than
+        // raise SIGPIPE: sendmsg() passes MSG_NOSIGNAL, sendfile() cannot
+        sigset_t pipe_signal;
+        sigemptyset(&pipe_signal);
+        sigaddset(&pipe_signal, SIGPIPE);
+        pthread_sigmask(SIG_BLOCK, &pipe_signal, nullptr);
+#endif
+        RequestContext context(config_.request_arena_size, &arena_upstream_);
+        
+#ifdef MNETWORK_HAS_IO_URING
+        if (config_.io_model == IoModel::IoUring) {
+            uring_worker(listen_fd, context);
+            return;
+        }
+#endif
+#ifdef __linux__
+        if (config_.io_model == IoModel::Epoll) {
+            epoll_worker(listen_fd, context);
+            return;
+        }
+#endif
+        while (running_) {
+#ifdef _WIN32
+            fd_set read_fds;
+            FD_ZERO(&read_fds);
+            FD_SET((SOCKET)listen_fd, &read_fds);
+            
+            timeval timeout{0, 100000}; // 100ms timeout
+            
+            int activity = select(0, &read_fds, nullptr, nullptr, &timeout);
+#else
+            fd_set read_fds;
+            FD_ZERO(&read_fds);
+            FD_SET(listen_fd, &read_fds);
+            
+            timeval timeout{0, 100000}; // 100ms timeout
+            
+            int activity = select(listen_fd + 1, &read_fds, nullptr, nullptr, &timeout);
+#endif
+            
+            if (activity > 0) {
+                struct sockaddr_in client_addr;
+                socklen_t client_len = sizeof(client_addr);
+                
+                int client_fd = accept(listen_fd, (struct sockaddr*)&client_addr, &client_len);
+                
+                if (client_fd >= 0) {
+                    handle_connection(client_fd, context);
+                }
+            }
+        }
+    }
+    
+#ifdef __linux__
+    // A request answered outside the I/O thread's normal flow: by a job on
+    // the handler pool or by a coroutine handler still running. It owns its
+    // request and response, as the worker's RequestContext moves on to other
+    // connections.
+    struct PendingCall {
+        HttpRequest request;
+        HttpResponse response;
+        std::pmr::monotonic_buffer_resource arena;
+        int requests_served = 0;
+        bool keep_alive = false;
+        std::atomic<bool> done{false};  // Set once request and response are left alone
+        std::exception_ptr error;
+    };
+    
+    // Lets other threads hand work to an I/O worker's thread. It outlives the
+    // worker; posts made after the worker has exited are dropped.
+    class Mailbox {
+    public:
+        using Post = std::function<void(std::function<void()>)>;
+        
+        explicit Mailbox(Post post) : post_(std::move(post)) {}
+        
+        void post(std::function<void()> task) {
+            lock_guard<std::mutex> lock(mutex_);
+            if (post_) post_(std::move(task));
+        }
+        
+        void close() {
+            lock_guard<std::mutex> lock(mutex_);
+            post_ = nullptr;
+        }
+        
+    private:
+        std::mutex mutex_;
+        Post post_;
+    };
+    
+    // Per-socket state owned by an epoll worker
+    struct Connection {
+        int fd = -1;
+        string in;
+        RequestParser parser;
+        OutputQueue out;
+        int requests_served = 0;
+        bool readable = false;
+        bool close_after_write = false;
+        bool peer_closed = false;
+        bool closed = false;
+        EventLoop::Clock::time_point deadline;
+        EventLoop::TimerId idle_timer;
+        int unsent = 0;                 // Send buffer bytes at the last idle check
+        bool recv_armed = false;        // io_uring: a recv is outstanding
+        int sends_inflight = 0;         // io_uring: the front of conn.out is owned by the kernel
+        int pipe_fds[2] = {-1, -1};     // io_uring: splice pipe for file bodies
+        size_t pipe_pending = 0;        // io_uring: file bytes in the pipe not yet sent
+        std::unique_ptr<BodyStream> stream;     // Request whose body is being streamed
+        std::unique_ptr<ResponseStream> producing;  // Streamed response still being generated
+        std::shared_ptr<PendingCall> calling;   // Handler running off this thread or suspended
+        std::function<void()> resume;   // Wakes the connection from any thread once calling is done
+        iovec send_iov[OutputQueue::max_iov];   // io_uring: gather list of the send in flight
+        msghdr send_msg{};
+        
+        RequestContext& context;        // Shared by all connections of the worker
+        BufferPool& buffers;
+        Metrics* metrics;               // Counts the connection while it exists, if set
+        
+        Connection(int socket_fd, RequestContext& worker_context, BufferPool& pool, Metrics* counters)
+            : fd(socket_fd), in(pool.acquire()), context(worker_context), buffers(pool), metrics(counters) {
+            if (metrics) metrics->connection_opened();
+        }
+        ~Connection() {
+            if (metrics) metrics->connection_closed();
+            buffers.release(std::move(in));
+            if (fd >= 0) close(fd);
+            if (pipe_fds[0] >= 0) close(pipe_fds[0]);
+            if (pipe_fds[1] >= 0) close(pipe_fds[1]);
+        }
+    };
+    
+    vector<EventLoop*> loops_;
+    std::mutex loops_mutex_;
+    
+    // A handler is still working on the connection's request; it is not idle
+    static bool handler_pending(const Connection& conn) {
+        return conn.calling != nullptr;
+    }
+    
+    void close_connection(EventLoop& loop, Connection& conn) {
+        if (conn.closed) return;
+        conn.closed = true;
+        loop.cancel(conn.idle_timer);
+        loop.remove(conn.fd);
+    }
+    
+    // The tail of a large body sits in the socket's send buffer after conn.out
+    // has drained, so a slow reader is still busy with it past the last write.
+    // Push the deadline forward while that buffer shrinks between checks, and
+    // once it is empty count from the peer's last acknowledgement instead.
+    bool send_draining(Connection& conn, EventLoop::Clock::time_point now) {
+        auto timeout = std::chrono::milliseconds(config_.keep_alive_timeout_ms);
+        int unsent = 0;
+        if (ioctl(conn.fd, SIOCOUTQ, &unsent) != 0) return false;
+        int previous = std::exchange(conn.unsent, unsent);
+        if (unsent > 0) {
+            if (unsent == previous) return false;
+            conn.deadline = now + timeout;
+            return true;
+        }
+        
+        tcp_info info{};
+        socklen_t length = sizeof(info);
+        if (getsockopt(conn.fd, IPPROTO_TCP, TCP_INFO, &info, &length) != 0) return false;
+        auto acked = now - std::chrono::milliseconds(info.tcpi_last_ack_recv);
+        if (acked + timeout <= now) return false;
+        conn.deadline = acked + timeout;
+        return true;
+    }
+    
+    // One timer per connection; activity only pushes the deadline forward and
+    // the timer re-arms itself instead of being rescheduled on every request
+    void arm_idle_timer(EventLoop& loop, const std::shared_ptr<Connection>& conn) {
+        auto delay = std::chrono::duration_cast<std::chrono::milliseconds>(
+            conn->deadline - EventLoop::Clock::now());
+        conn->idle_timer = loop.run_after(delay, [this, &loop, conn] {
+            if (conn->closed) return;
+            auto now = EventLoop::Clock::now();
+            if (now >= conn->deadline && handler_pending(*conn)) {
+                // Not idle while its handler is running
+                conn->deadline = now + std::chrono::milliseconds(config_.keep_alive_timeout_ms);
+            }
+            if (now >= conn->deadline && !send_draining(*conn, now)) {
+                log("Closing idle connection");
+                close_connection(loop, *conn);
+            } else {
+                arm_idle_timer(loop, conn);
+            }
+        });
+    }
+    
+    // Read until the socket would block or max_request_size bytes are buffered.
+    // In the latter case conn.readable stays set so reading resumes once the
+    // buffered requests have been consumed.
+    void read_available(Connection& conn) {
+        size_t chunk = config_.buffer_size > 0 ? config_.buffer_size : 4096;
+        while (conn.in.size() < config_.max_request_size) {
+            size_t old_size = conn.in.size();
+            conn.in.resize(old_size + chunk);
+            ssize_t n = recv(conn.fd, &conn.in[old_size], chunk, 0);
+            conn.in.resize(old_size + (n > 0 ? n : 0));
+            
+            if (n > 0) continue;
+            if (n < 0 && errno == EINTR) continue;
+            if (n == 0 || (errno != EAGAIN && errno != EWOULDBLOCK)) {
+                conn.peer_closed = true;
+            }
+            conn.readable = false;
+            return;
+        }
+    }
+    
+    // Write as much pending output as the socket accepts; false on error.
+    // Progress counts as activity, so a large body going out to a slow
+    // reader is not cut off by the idle timeout.
+    bool flush_output(Connection& conn) {
+        size_t written = conn.out.written();
+        if (conn.out.write_to(conn.fd) == OutputQueue::Status::Failed) return false;
+        if (conn.out.written() != written) {
+            conn.deadline = EventLoop::Clock::now() +
+                std::chrono::milliseconds(config_.keep_alive_timeout_ms);
+        }
+        return true;
+    }
+    
+    // Queue a response on conn.out. A streamed body is produced later, as
+    // conn.out drains, and holds back the requests behind it until it ends.
+    void queue_response(Connection& conn, HttpResponse& response) {
+        conn.out.append(std::move(response));
+        conn.producing = take_stream(response, conn.out);
+        conn.close_after_write = !conn.producing && !response.keep_alive;
+    }
+    
+    // Generate the next part of conn.producing into the drained conn.out
+    void produce_next(Connection& conn) {
+        ResponseStream& stream = *conn.producing;
+        if (!produce(stream)) {
+            conn.close_after_write = true;
+        } else if (stream.done) {
+            conn.close_after_write = !stream.keep_alive;
+        } else {
+            conn.deadline = EventLoop::Clock::now() +
+                std::chrono::milliseconds(config_.keep_alive_timeout_ms);
+            return;
+        }
+        conn.producing.reset();
+    }
+    
+    // Move the request built in conn.context into a call of its own. The
+    // connection serves nothing else until the call is done, while the
+    // worker goes on with other connections.
+    std::shared_ptr<PendingCall> defer_request(Connection& conn, int requests_served) {
+        auto call = std::make_shared<PendingCall>();
+        call->request = std::move(conn.context.request);
+        call->response = std::move(conn.context.response);
+        call->request.arena = &call->arena;
+        call->keep_alive = keep_alive_requested(call->request);
+        call->requests_served = requests_served;
+        conn.calling = call;
+        return call;
+    }
+    
+    static void complete_call(PendingCall& call, std::exception_ptr error,
+                              const std::function<void()>& resume) {
+        call.error = error;
+        call.done.store(true, std::memory_order_release);
+        resume();
+    }
+    
+    // Run middlewares and the handler of the request in conn.context on the
+    // handler pool
+    void submit_request(Connection& conn, int requests_served) {
+        auto call = defer_request(conn, requests_served);
+        handler_pool_->submit([this, call, resume = conn.resume] {
+            std::exception_ptr error;
+            try {
+                dispatch(call->request, call->response);
+            } catch (...) {
+                error = std::current_exception();
+            }
+            complete_call(*call, error, resume);
+        });
+    }
+    
+#ifdef MNETWORK_HAS_COROUTINES
+    // Start an async handler on the worker's loop
+    void begin_call(Connection& conn, const Router::Route& route, int requests_served) {
+        auto call = defer_request(conn, requests_served);
+        // The params pointed into the path before it moved
+        router_.find(call->request.method, call->request.path, call->request.params);
+        auto done = [call, resume = conn.resume](std::exception_ptr error) {
+            complete_call(*call, error, resume);
+        };
+        try {
+            spawn(route.async_handler(call->request, call->response), done);
+        } catch (...) {
+            done(std::current_exception());
+        }
+    }
+#endif
+    
+    // Response of a finished call
+    HttpResponse& end_call(PendingCall& call) {
+        if (call.error) {
+            try {
+                std::rethrow_exception(call.error);
+            } catch (const std::exception& e) {
+                log("Error processing request: " + string(e.what()));
+            } catch (...) {
+            }
+            call.response = error_response(500);
+        }
+        finish_response(call.response, call.request, call.keep_alive, call.requests_served);
+        return call.response;
+    }
+    
+    // Whether the request parsed by parser goes to a coroutine route, which
+    // runs on the I/O thread even with a handler pool
+    bool routes_to_coroutine(const RequestParser& parser) const {
+#ifdef MNETWORK_HAS_COROUTINES
+        RouteParams params;
+        const Router::Route* route = router_.find(parser.method(), parser.path(), params);
+        return route && route->async_handler;
+#else
+        (void)parser;
+        return false;
+#endif
+    }
+    
+    // Parse and run every complete buffered request, appending the responses
+    // in order to conn.out; returns the number of responses queued
+    int serve_buffered(Connection& conn) {
+        size_t consumed = 0;
+        int batched = 0;
+        while (!conn.close_after_write && !conn.producing && batched < config_.max_pipeline_depth) {
+            if (conn.calling) {
+                if (!conn.calling->done.load(std::memory_order_acquire)) {
+                    break;
+                }
+                queue_response(conn, end_call(*conn.calling));
+                conn.calling.reset();
+                ++batched;
+                continue;
+            }
+            if (conn.stream) {
+                // Body bytes go to the sink and are dropped from the buffer
+                size_t used = 0;
+                BodyDecoder::Status status = feed_stream(*conn.stream, conn.in.data() + consumed,
+                                                         conn.in.size() - consumed, used);
+                consumed += used;
+                if (status == BodyDecoder::Status::Incomplete) {
+                    break;
+                }
+                HttpResponse& response = end_stream(*conn.stream, status, conn.requests_served++);
+                queue_response(conn, response);
+                conn.stream.reset();
+                ++batched;
+                continue;
+            }
+            
+            RequestParser::Status status = conn.parser.parse(conn.in.data() + consumed,
+                                                             conn.in.size() - consumed);
+            if (status == RequestParser::Status::Incomplete) {
+                break;
+            }
+            
+            if (status == RequestParser::Status::Error) {
+                conn.out.append(error_response(conn.parser.error_status()));
+                conn.close_after_write = true;
+                ++batched;
+                break;
+            }
+            
+            if (conn.parser.body_streamed()) {
+                conn.stream = begin_stream(conn.parser, conn.context);
+                consumed += conn.parser.head_length();
+                conn.parser.reset();
+                if (conn.stream->rejected) {
+                    HttpResponse& response = end_stream(*conn.stream, BodyDecoder::Status::Error,
+                                                        conn.requests_served++);
+                    queue_response(conn, response);
+                    conn.stream.reset();
+                    ++batched;
+                    break;
+                }
+                if (conn.stream->send_continue) {
+                    conn.out.append(continue_response);
+                    ++batched;
+                }
+                continue;
+            }
+            
+            int served = conn.requests_served++;
+            if (handler_pool_ && !routes_to_coroutine(conn.parser)) {
+                conn.context.reset();
+                build_request(conn.parser, conn.context);
+                consumed += conn.parser.message_length();
+                conn.parser.reset();
+                submit_request(conn, served);
+                continue;
+            }
+            
+            // Async handlers are left running on the worker's EventLoop: its
+            // epoll loop, or the loop an io_uring worker polls through the ring
+            const Router::Route* deferred = nullptr;
+            HttpResponse& response = process_request(conn.parser, conn.context, served,
+                                                      EventLoop::current() ? &deferred : nullptr);
+            consumed += conn.parser.message_length();
+            conn.parser.reset();
+#ifdef MNETWORK_HAS_COROUTINES
+            if (deferred) {
+                begin_call(conn, *deferred, served);
+                continue;
+            }
+#endif
+            queue_response(conn, response);
+            ++batched;
+        }
+        
+        if (consumed > 0) {
+            conn.in.erase(0, consumed);
+        }
+        return batched;
+    }
     
-    string get_header(const string& key, const string& default_val = "") const {
-        auto it = headers.find(key);
-        return it != headers.end() ? it->second : default_val;
+    void on_connection_event(EventLoop& loop, Connection& conn, uint32_t events) {
+        if (events & EPOLLERR) {
+            close_connection(loop, conn);
+            return;
+        }
+        if (events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP)) {
+            conn.readable = true;
+        }
+        
+        // A new batch is only parsed once the previous one has been written,
+        // so responses stay in request order and a slow reader gets backpressure
+        while (true) {
+            if (!flush_output(conn)) {
+                close_connection(loop, conn);
+                return;
+            }
+            if (!conn.out.empty()) {
+                return;
+            }
+            if (conn.producing) {
+                produce_next(conn);
+                continue;
+            }
+            if (conn.close_after_write) {
+                close_connection(loop, conn);
+                return;
+            }
+            
+            if (conn.readable && !conn.peer_closed) {
+                read_available(conn);
+                conn.deadline = EventLoop::Clock::now() +
+                    std::chrono::milliseconds(config_.keep_alive_timeout_ms);
+            }
+            
+            if (serve_buffered(conn) == 0 &&
+                (!conn.readable || conn.in.size() >= config_.max_request_size)) {
+                break;
+            }
+        }
+        
+        // A half-closed client still gets the answer to its last request
+        if (conn.peer_closed && !handler_pending(conn)) {
+            close_connection(loop, conn);
+        }
     }
-};
-
-// HTTP Response structure
-struct HttpResponse {
-    int status_code = 200;
-    string status_text = "OK";
-    map<string, string> headers;
-    string body;
     
-    void set_header(const string& key, const string& value) {
-        headers[key] = value;
+    void accept_connections(EventLoop& loop, int listen_fd, RequestContext& context,
+                            const std::shared_ptr<Mailbox>& mailbox) {
+        while (running_) {
+            int client_fd = accept4(listen_fd, nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC);
+            if (client_fd < 0) {
+                if (errno == EINTR || errno == ECONNABORTED) continue;
+                if (errno == EMFILE || errno == ENFILE) {
+                    log("Accept failed: out of file descriptors");
+                }
+                return;
+            }
+            
+            auto conn = std::make_shared<Connection>(client_fd, context, buffer_pool_, metrics_.get());
+            configure_parser(conn->parser);
+            conn->resume = [this, &loop, mailbox, weak = std::weak_ptr<Connection>(conn)] {
+                mailbox->post([this, &loop, weak] {
+                    auto live = weak.lock();
+                    if (live && !live->closed) on_connection_event(loop, *live, 0);
+                });
+            };
+            bool added = loop.add(client_fd, EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET,
+                [this, &loop, conn](uint32_t events) {
+                    on_connection_event(loop, *conn, events);
+                });
+            if (!added) {
+                log("Failed to register connection");
+                continue;
+            }
+            if (config_.keep_alive_timeout_ms > 0) {
+                conn->deadline = EventLoop::Clock::now() +
+                    std::chrono::milliseconds(config_.keep_alive_timeout_ms);
+                arm_idle_timer(loop, conn);
+            }
+        }
     }
     
-    string to_string() const {
-        ostringstream oss;
-        oss << "HTTP/1.1 " << status_code << " " << status_text << "\r\n";
+    void epoll_worker(int listen_fd, RequestContext& context) {
+        try {
+            EventLoop loop(config_.max_events);
+            auto mailbox = std::make_shared<Mailbox>([&loop](std::function<void()> task) {
+                loop.post(std::move(task));
+            });
+            struct CloseMailbox {
+                Mailbox& mailbox;
+                ~CloseMailbox() { mailbox.close(); }
+            } close_mailbox{*mailbox};
+            
+            // EPOLLEXCLUSIVE wakes a single worker per incoming connection
+            // when the listener is shared
+            if (!loop.add(listen_fd, EPOLLIN | EPOLLEXCLUSIVE,
+                          [this, &loop, &context, listen_fd, mailbox](uint32_t) {
+                              accept_connections(loop, listen_fd, context, mailbox);
+                          })) {
+                log("Failed to register listener with epoll");
+                return;
+            }
+            
+            {
+                lock_guard<std::mutex> lock(loops_mutex_);
+                loops_.push_back(&loop);
+            }
+            if (running_) {
+                loop.run();
+            }
+            {
+                lock_guard<std::mutex> lock(loops_mutex_);
+                loops_.erase(std::find(loops_.begin(), loops_.end(), &loop));
+            }
+        } catch (const std::exception& e) {
+            log("Epoll worker failed: " + string(e.what()));
+        }
+    }
+    
+#ifdef MNETWORK_HAS_IO_URING
+    enum UringOp : uint32_t {
+        UringAccept = 1, UringRecv, UringSend, UringFileIn, UringFileOut, UringWake, UringTick,
+        UringLoop, UringLoopTimer
+    };
+    
+    static uint64_t uring_tag(UringOp op, uint32_t id = 0) {
+        return (static_cast<uint64_t>(op) << 32) | id;
+    }
+    
+    // Everything one io_uring worker owns
+    struct UringWorker {
+        IoUring ring;
+        int listen_fd;
+        int wake_fd = -1;
+        uint64_t wake_value = 0;
+        __kernel_timespec tick{1, 0};
+        bool multishot_recv = true;
+        uint32_t next_id = 0;
+        std::unordered_map<uint32_t, std::unique_ptr<Connection>> connections;
+        RequestContext& context;
+        std::shared_ptr<Mailbox> mailbox;
+        std::mutex posted_mutex;
+        vector<std::function<void()>> posted;   // Run on the next wake
+#ifdef MNETWORK_HAS_COROUTINES
+        std::unique_ptr<EventLoop> loop;        // Async handlers suspend onto it; polled through the ring
+        __kernel_timespec loop_wait{};
+        EventLoop::Clock::time_point loop_timer = EventLoop::Clock::time_point::max();  // Earliest wake armed
+#endif
         
-        // Set default headers if not present
-        auto temp_headers = headers;
-        if (temp_headers.find("Content-Type") == temp_headers.end()) {
-            temp_headers["Content-Type"] = "text/html";
+        UringWorker(unsigned entries, int fd, RequestContext& worker_context)
+            : ring(entries), listen_fd(fd), context(worker_context) {}
+    };
+    
+    vector<int> uring_wake_fds_;
+    
+    static io_uring_sqe* uring_sqe(UringWorker& w) {
+        io_uring_sqe* sqe = w.ring.get_sqe();
+        if (!sqe) {
+            throw std::runtime_error("io_uring submission queue full");
         }
-        if (temp_headers.find("Content-Length") == temp_headers.end()) {
-            temp_headers["Content-Length"] = std::to_string(body.size());
+        return sqe;
+    }
+    
+    // A single multishot accept keeps producing connections until it is cancelled
+    void uring_arm_accept(UringWorker& w) {
+        io_uring_sqe* sqe = uring_sqe(w);
+        sqe->opcode = IORING_OP_ACCEPT;
+        sqe->fd = w.listen_fd;
+        sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+        sqe->accept_flags = SOCK_CLOEXEC;
+        sqe->user_data = uring_tag(UringAccept);
+    }
+    
+    // Receives pick a buffer from the provided ring, so idle connections pin no memory
+    void uring_arm_recv(UringWorker& w, uint32_t id, Connection& conn) {
+        io_uring_sqe* sqe = uring_sqe(w);
+        sqe->opcode = IORING_OP_RECV;
+        sqe->fd = conn.fd;
+        sqe->flags = IOSQE_BUFFER_SELECT;
+        sqe->buf_group = w.ring.buffer_group();
+        sqe->ioprio = w.multishot_recv ? IORING_RECV_MULTISHOT : 0;
+        sqe->user_data = uring_tag(UringRecv, id);
+        conn.recv_armed = true;
+    }
+    
+    // Send the leading in-memory segments of conn.out with one sendmsg
+    void uring_send(UringWorker& w, uint32_t id, Connection& conn) {
+        conn.send_msg = msghdr{};
+        conn.send_msg.msg_iov = conn.send_iov;
+        conn.send_msg.msg_iovlen = conn.out.gather(conn.send_iov, OutputQueue::max_iov);
+        
+        io_uring_sqe* sqe = uring_sqe(w);
+        sqe->opcode = IORING_OP_SENDMSG;
+        sqe->fd = conn.fd;
+        sqe->addr = reinterpret_cast<uint64_t>(&conn.send_msg);
+        sqe->len = 1;
+        sqe->msg_flags = MSG_NOSIGNAL;
+        sqe->user_data = uring_tag(UringSend, id);
+        ++conn.sends_inflight;
+    }
+    
+    static void uring_prep_splice(io_uring_sqe* sqe, int fd_in, int64_t off_in, int fd_out, size_t len) {
+        sqe->opcode = IORING_OP_SPLICE;
+        sqe->fd = fd_out;
+        sqe->off = static_cast<uint64_t>(-1);
+        sqe->splice_fd_in = fd_in;
+        sqe->splice_off_in = static_cast<uint64_t>(off_in);
+        sqe->len = static_cast<uint32_t>(len);
+        sqe->splice_flags = SPLICE_F_MOVE;
+    }
+    
+    // io_uring has no sendfile; file ranges are spliced file -> pipe -> socket
+    // as a linked pair, which keeps the contents out of user space
+    bool uring_send_file(UringWorker& w, uint32_t id, Connection& conn) {
+        if (conn.pipe_fds[0] < 0 && pipe2(conn.pipe_fds, O_CLOEXEC) != 0) {
+            log("Failed to create splice pipe");
+            return false;
         }
         
-        for (const auto& [key, value] : temp_headers) {
-            oss << key << ": " << value << "\r\n";
+        if (conn.pipe_pending == 0) {
+            size_t offset = 0;
+            size_t remaining = 0;
+            const FileBody* file = conn.out.front_file(offset, remaining);
+            size_t chunk = std::min<size_t>(remaining, 65536);
+            
+            io_uring_sqe* sqe = uring_sqe(w);
+            uring_prep_splice(sqe, file->fd, static_cast<int64_t>(offset), conn.pipe_fds[1], chunk);
+            sqe->flags = IOSQE_IO_LINK;
+            sqe->user_data = uring_tag(UringFileIn, id);
+            ++conn.sends_inflight;
+            
+            sqe = uring_sqe(w);
+            uring_prep_splice(sqe, conn.pipe_fds[0], -1, conn.fd, chunk);
+            sqe->user_data = uring_tag(UringFileOut, id);
+            ++conn.sends_inflight;
+        } else {
+            // Drain what a short socket write left behind first
+            io_uring_sqe* sqe = uring_sqe(w);
+            uring_prep_splice(sqe, conn.pipe_fds[0], -1, conn.fd, conn.pipe_pending);
+            sqe->user_data = uring_tag(UringFileOut, id);
+            ++conn.sends_inflight;
         }
-        oss << "\r\n" << body;
-        return oss.str();
+        return true;
     }
-};
-
-// Middleware type
-using Middleware = std::function<bool(const HttpRequest&, HttpResponse&)>;
-using RouteHandler = std::function<void(const HttpRequest&, HttpResponse&)>;
-
-// Modern HTTP Server Class
-class HttpServer {
-private:
-    ServerConfig config_;
-    int server_fd_;
-    std::atomic<bool> running_{false};
-    vector<std::thread> worker_threads_;
-    map<string, RouteHandler> routes_;
-    vector<Middleware> middlewares_;
     
-    // Thread-safe logging
-    void log(const string& message) const {
-        if (config_.verbose) {
-            lock_guard<std::mutex> lock(log_mutex_);
-            auto now = std::chrono::system_clock::now();
-            auto time = std::chrono::system_clock::to_time_t(now);
-            char time_str[9];
-            std::strftime(time_str, sizeof(time_str), "%H:%M:%S", std::localtime(&time));
-            cout << "[" << time_str << "] " << message << endl;
-        }
+    void uring_arm_wake(UringWorker& w) {
+        io_uring_sqe* sqe = uring_sqe(w);
+        sqe->opcode = IORING_OP_READ;
+        sqe->fd = w.wake_fd;
+        sqe->addr = reinterpret_cast<uint64_t>(&w.wake_value);
+        sqe->len = sizeof(w.wake_value);
+        sqe->user_data = uring_tag(UringWake);
     }
     
-    mutable std::mutex log_mutex_;
+    void uring_arm_tick(UringWorker& w) {
+        io_uring_sqe* sqe = uring_sqe(w);
+        sqe->opcode = IORING_OP_TIMEOUT;
+        sqe->addr = reinterpret_cast<uint64_t>(&w.tick);
+        sqe->len = 1;
+        sqe->user_data = uring_tag(UringTick);
+    }
     
-    void initialize_sockets() {
-#ifdef _WIN32
-        WSADATA wsa_data;
-        if (WSAStartup(MAKEWORD(2, 2), &wsa_data) != 0) {
-            throw std::runtime_error("WSAStartup failed");
+#ifdef MNETWORK_HAS_COROUTINES
+    // The coroutine loop's epoll descriptor turns readable when a socket or
+    // posted task it watches is ready
+    void uring_arm_loop(UringWorker& w) {
+        io_uring_sqe* sqe = uring_sqe(w);
+        sqe->opcode = IORING_OP_POLL_ADD;
+        sqe->fd = w.loop->fd();
+        sqe->poll32_events = POLLIN;
+        sqe->user_data = uring_tag(UringLoop);
+    }
+    
+    // Wake for the coroutine loop's earliest timer unless an earlier wake is armed
+    void uring_arm_loop_timer(UringWorker& w) {
+        auto due = w.loop->next_timer();
+        if (due >= w.loop_timer) {
+            return;
         }
+        auto wait = std::chrono::duration_cast<std::chrono::nanoseconds>(due - EventLoop::Clock::now()).count();
+        if (wait < 0) wait = 0;
+        w.loop_wait.tv_sec = wait / 1000000000;
+        w.loop_wait.tv_nsec = wait % 1000000000;
+        
+        io_uring_sqe* sqe = uring_sqe(w);
+        sqe->opcode = IORING_OP_TIMEOUT;
+        sqe->addr = reinterpret_cast<uint64_t>(&w.loop_wait);
+        sqe->len = 1;
+        sqe->user_data = uring_tag(UringLoopTimer);
+        w.loop_timer = due;
+    }
 #endif
+    
+    // Shut the socket down so outstanding operations complete, and free the
+    // connection once the kernel no longer references it
+    void uring_close(UringWorker& w, uint32_t id, Connection& conn) {
+        if (!conn.closed) {
+            conn.closed = true;
+            shutdown(conn.fd, SHUT_RDWR);
+        }
+        if (!conn.recv_armed && conn.sends_inflight == 0) {
+            w.connections.erase(id);
+        }
     }
     
-    void cleanup_sockets() {
-#ifdef _WIN32
-        WSACleanup();
-#endif
+    // Queue the next send, serving buffered requests first when idle
+    void uring_drive(UringWorker& w, uint32_t id, Connection& conn) {
+        if (conn.sends_inflight > 0 || conn.closed) {
+            return;
+        }
+        if (conn.out.empty() && conn.pipe_pending == 0) {
+            if (conn.producing) {
+                produce_next(conn);
+            } else if (!conn.close_after_write && serve_buffered(conn) > 0) {
+                // Time spent in handlers does not count as idle
+                conn.deadline = EventLoop::Clock::now() +
+                    std::chrono::milliseconds(config_.keep_alive_timeout_ms);
+            }
+        }
+        
+        size_t offset = 0;
+        size_t remaining = 0;
+        if (conn.pipe_pending > 0 || conn.out.front_file(offset, remaining)) {
+            if (!uring_send_file(w, id, conn)) {
+                uring_close(w, id, conn);
+            }
+        } else if (!conn.out.empty()) {
+            uring_send(w, id, conn);
+        } else if (conn.close_after_write || (conn.peer_closed && !handler_pending(conn))) {
+            // A half-closed client still gets the answer to its last request
+            uring_close(w, id, conn);
+        }
     }
     
-    HttpRequest parse_request(const string& request_str) {
-        HttpRequest req;
-        istringstream stream(request_str);
-        string line;
+    void uring_complete(UringWorker& w, const io_uring_cqe& cqe) {
+        UringOp op = static_cast<UringOp>(cqe.user_data >> 32);
+        uint32_t id = static_cast<uint32_t>(cqe.user_data);
+        bool more = cqe.flags & IORING_CQE_F_MORE;
         
-        // Parse request line
-        if (std::getline(stream, line)) {
-            istringstream line_stream(line);
-            line_stream >> req.method >> req.path >> req.version;
-            
-            // Parse query parameters
-            size_t qmark = req.path.find('?');
-            if (qmark != string::npos) {
-                string query = req.path.substr(qmark + 1);
-                req.path = req.path.substr(0, qmark);
+        if (op == UringAccept) {
+            if (cqe.res >= 0) {
+                do {
+                    id = ++w.next_id;
+                } while (id == 0 || w.connections.count(id));
                 
-                istringstream query_stream(query);
-                string pair;
-                while (std::getline(query_stream, pair, '&')) {
-                    size_t equals = pair.find('=');
-                    if (equals != string::npos) {
-                        string key = pair.substr(0, equals);
-                        string value = pair.substr(equals + 1);
-                        req.query_params[key] = value;
-                    }
-                }
+                auto conn = std::make_unique<Connection>(cqe.res, w.context, buffer_pool_, metrics_.get());
+                configure_parser(conn->parser);
+                conn->resume = [this, &w, id, mailbox = w.mailbox] {
+                    mailbox->post([this, &w, id] {
+                        auto it = w.connections.find(id);
+                        if (it != w.connections.end() && !it->second->closed) {
+                            uring_drive(w, id, *it->second);
+                        }
+                    });
+                };
+                conn->deadline = EventLoop::Clock::now() +
+                    std::chrono::milliseconds(config_.keep_alive_timeout_ms);
+                uring_arm_recv(w, id, *conn);
+                w.connections.emplace(id, std::move(conn));
+            } else if (cqe.res == -EMFILE || cqe.res == -ENFILE) {
+                log("Accept failed: out of file descriptors");
+            }
+            if (!more && running_) {
+                uring_arm_accept(w);
             }
+            return;
         }
         
-        // Parse headers
-        while (std::getline(stream, line) && line != "\r") {
-            size_t colon = line.find(':');
-            if (colon != string::npos) {
-                string key = line.substr(0, colon);
-                string value = line.substr(colon + 2); // Skip ": "
-                // Remove trailing \r if present
-                if (!value.empty() && value.back() == '\r') {
-                    value.pop_back();
+        if (op == UringWake) {
+            vector<std::function<void()>> tasks;
+            {
+                lock_guard<std::mutex> lock(w.posted_mutex);
+                tasks.swap(w.posted);
+            }
+            for (auto& task : tasks) {
+                task();
+            }
+            if (running_) uring_arm_wake(w);
+            return;
+        }
+        
+#ifdef MNETWORK_HAS_COROUTINES
+        if (op == UringLoop || op == UringLoopTimer) {
+            if (op == UringLoopTimer) {
+                w.loop_timer = EventLoop::Clock::time_point::max();
+            }
+            w.loop->run_once(0);
+            if (op == UringLoop && running_) uring_arm_loop(w);
+            return;
+        }
+#endif
+        
+        if (op == UringTick) {
+            auto now = EventLoop::Clock::now();
+            vector<uint32_t> idle;
+            for (const auto& [conn_id, conn] : w.connections) {
+                if (conn->closed || now < conn->deadline) continue;
+                if (handler_pending(*conn)) {
+                    // Not idle while its handler is running
+                    conn->deadline = now + std::chrono::milliseconds(config_.keep_alive_timeout_ms);
+                } else if (!send_draining(*conn, now)) {
+                    idle.push_back(conn_id);
                 }
-                req.headers[key] = value;
             }
+            for (uint32_t conn_id : idle) {
+                log("Closing idle connection");
+                uring_close(w, conn_id, *w.connections[conn_id]);
+            }
+            if (running_) uring_arm_tick(w);
+            return;
+        }
+        
+        auto it = w.connections.find(id);
+        if (it == w.connections.end()) {
+            if (op == UringRecv && cqe.res > 0 && (cqe.flags & IORING_CQE_F_BUFFER)) {
+                w.ring.recycle_buffer(static_cast<uint16_t>(cqe.flags >> IORING_CQE_BUFFER_SHIFT));
+            }
+            return;
         }
+        Connection& conn = *it->second;
         
-        // Parse body
-        ostringstream body_stream;
-        body_stream << stream.rdbuf();
-        req.body = body_stream.str();
+        if (op == UringRecv) {
+            if (!more) conn.recv_armed = false;
+            
+            if (cqe.res > 0) {
+                uint16_t buffer_id = static_cast<uint16_t>(cqe.flags >> IORING_CQE_BUFFER_SHIFT);
+                conn.in.append(w.ring.buffer(buffer_id), cqe.res);
+                w.ring.recycle_buffer(buffer_id);
+                conn.deadline = EventLoop::Clock::now() +
+                    std::chrono::milliseconds(config_.keep_alive_timeout_ms);
+                
+                // A multishot recv cannot be paused, so a peer that keeps
+                // sending without reading its responses is dropped instead
+                if (conn.in.size() > 2 * config_.max_request_size) {
+                    uring_close(w, id, conn);
+                    return;
+                }
+            } else if (cqe.res == -EINVAL && w.multishot_recv) {
+                log("Multishot recv unsupported, using single-shot receives");
+                w.multishot_recv = false;
+            } else if (cqe.res != -ENOBUFS) {
+                conn.peer_closed = true;
+            }
+            
+            if (conn.closed) {
+                uring_close(w, id, conn);
+                return;
+            }
+            if (!conn.recv_armed && !conn.peer_closed) {
+                uring_arm_recv(w, id, conn);
+            }
+            uring_drive(w, id, conn);
+            return;
+        }
         
-        return req;
+        --conn.sends_inflight;
+        if (op == UringSend) {
+            if (cqe.res < 0) {
+                conn.close_after_write = conn.peer_closed = true;
+                conn.out.clear();
+                conn.pipe_pending = 0;
+            } else {
+                conn.out.consume(static_cast<size_t>(cqe.res));
+            }
+        } else if (op == UringFileIn) {
+            if (cqe.res > 0) {
+                conn.pipe_pending += cqe.res;
+                conn.out.consume(static_cast<size_t>(cqe.res));
+            } else {
+                // Read error, or the file shrank underneath us
+                conn.close_after_write = conn.peer_closed = true;
+                conn.out.clear();
+                conn.pipe_pending = 0;
+            }
+        } else if (op == UringFileOut) {
+            // A short read into the pipe cancels the linked write (-ECANCELED)
+            if (cqe.res > 0) {
+                conn.pipe_pending -= std::min<size_t>(cqe.res, conn.pipe_pending);
+            } else if (cqe.res != -ECANCELED) {
+                conn.close_after_write = conn.peer_closed = true;
+                conn.out.clear();
+                conn.pipe_pending = 0;
+            }
+        }
+
+        // Bytes reaching the socket count as activity, so a slow reader
+        // still draining a large body is not closed as idle
+        if ((op == UringSend || op == UringFileOut) && cqe.res > 0) {
+            conn.deadline = EventLoop::Clock::now() +
+                std::chrono::milliseconds(config_.keep_alive_timeout_ms);
+        }
+
+        if (conn.closed) {
+            uring_close(w, id, conn);
+        } else if (conn.sends_inflight == 0) {
+            uring_drive(w, id, conn);
+        }
     }
     
-    void handle_connection(int client_fd) {
-        vector<char> buffer(config_.buffer_size);
-        ssize_t bytes_received = recv(client_fd, buffer.data(), buffer.size() - 1, 0);
+    void uring_worker(int listen_fd, RequestContext& context) {
+        std::unique_ptr<UringWorker> w;
+        try {
+            w = std::make_unique<UringWorker>(config_.io_uring_entries, listen_fd, context);
+            w->ring.setup_buffer_ring(0, config_.io_uring_buffers, config_.buffer_size);
+            w->wake_fd = eventfd(0, EFD_CLOEXEC);
+            if (w->wake_fd < 0) {
+                throw std::runtime_error("eventfd failed");
+            }
+            w->mailbox = std::make_shared<Mailbox>([worker = w.get()](std::function<void()> task) {
+                {
+                    lock_guard<std::mutex> lock(worker->posted_mutex);
+                    worker->posted.push_back(std::move(task));
+                }
+                uint64_t one = 1;
+                ssize_t written = write(worker->wake_fd, &one, sizeof(one));
+                (void)written;
+            });
+#ifdef MNETWORK_HAS_COROUTINES
+            if (async_routes_) {
+                w->loop = std::make_unique<EventLoop>(config_.max_events);
+            }
+#endif
+        } catch (const std::exception& e) {
+            log("io_uring unavailable (" + string(e.what()) + "), falling back to epoll");
+            if (w && w->wake_fd >= 0) close(w->wake_fd);
+            epoll_worker(listen_fd, context);
+            return;
+        }
         
-        if (bytes_received > 0) {
-            buffer[bytes_received] = '\0';
+        {
+            lock_guard<std::mutex> lock(loops_mutex_);
+            uring_wake_fds_.push_back(w->wake_fd);
+        }
+        
+        try {
+            uring_arm_accept(*w);
+            uring_arm_wake(*w);
+            if (config_.keep_alive_timeout_ms > 0) {
+                uring_arm_tick(*w);
+            }
+#ifdef MNETWORK_HAS_COROUTINES
+            // Async handlers started on this thread suspend onto w->loop
+            std::optional<EventLoop::Scope> scope;
+            if (w->loop) {
+                scope.emplace(*w->loop);
+                uring_arm_loop(*w);
+            }
+#endif
             
-            try {
-                HttpRequest request = parse_request(string(buffer.data()));
-                HttpResponse response;
-                
-                log(request.method + " " + request.path);
-                
-                // Apply middlewares
-                bool continue_processing = true;
-                for (const auto& middleware : middlewares_) {
-                    if (!middleware(request, response)) {
-                        continue_processing = false;
-                        break;
-                    }
-                }
-                
-                if (continue_processing) {
-                    // Find and execute route handler
-                    auto it = routes_.find(request.path);
-                    if (it != routes_.end()) {
-                        it->second(request, response);
-                    } else {
-                        // Try simple pattern matching for dynamic routes
-                        bool found = false;
-                        for (const auto& [pattern, handler] : routes_) {
-                            size_t star_pos = pattern.find('*');
-                            if (star_pos != string::npos) {
-                                // Simple pattern matching
-                                if (request.path.find(pattern.substr(0, star_pos)) == 0) {
-                                    handler(request, response);
-                                    found = true;
-                                    break;
-                                }
-                            }
-                        }
-                        
-                        if (!found) {
-                            response.status_code = 404;
-                            response.status_text = "Not Found";
-                            response.body = "<h1>404 Not Found</h1>";
-                        }
-                    }
+            // Each pass submits every SQE queued while handling the previous
+            // batch of completions in a single io_uring_enter
+            while (running_) {
+                if (w->ring.submit(1) < 0 && errno != EBUSY && errno != EAGAIN) {
+                    log("io_uring_enter failed: " + string(std::strerror(errno)));
+                    break;
                 }
-                
-                string response_str = response.to_string();
-                send(client_fd, response_str.c_str(), response_str.size(), 0);
-                
-            } catch (const std::exception& e) {
-                log("Error processing request: " + string(e.what()));
-                
-                HttpResponse error_response;
-                error_response.status_code = 500;
-                error_response.status_text = "Internal Server Error";
-                error_response.body = "<h1>500 Internal Server Error</h1>";
-                string error_str = error_response.to_string();
-                send(client_fd, error_str.c_str(), error_str.size(), 0);
+                w->ring.for_each_completion([this, &w](const io_uring_cqe& cqe) {
+                    uring_complete(*w, cqe);
+                });
+#ifdef MNETWORK_HAS_COROUTINES
+                if (w->loop) uring_arm_loop_timer(*w);
+#endif
             }
+        } catch (const std::exception& e) {
+            log("io_uring worker failed: " + string(e.what()));
+        }
+        
+        {
+            lock_guard<std::mutex> lock(loops_mutex_);
+            uring_wake_fds_.erase(std::find(uring_wake_fds_.begin(), uring_wake_fds_.end(), w->wake_fd));
+        }
+        w->mailbox->close();
+        close(w->wake_fd);
+        w->connections.clear();
+    }
+#endif
+#endif
+    
+    // Create, bind and listen on one socket for config_.port; -1 on failure
+    int open_listener() {
+        int fd = socket(AF_INET, SOCK_STREAM, 0);
+        if (fd < 0) {
+            log("Failed to create socket");
+            return -1;
+        }
+        
+        // Enable port reuse
+        int opt = 1;
+#ifdef SO_REUSEADDR
+        setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, (const char*)&opt, sizeof(opt));
+#endif
+#ifdef SO_REUSEPORT
+        if (config_.reuse_port) {
+            setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, (const char*)&opt, sizeof(opt));
+        }
+#endif
+        
+        struct sockaddr_in address{};
+        address.sin_family = AF_INET;
+        if (config_.host == "0.0.0.0") {
+            address.sin_addr.s_addr = INADDR_ANY;
+        } else {
+            inet_pton(AF_INET, config_.host.c_str(), &address.sin_addr);
         }
+        address.sin_port = htons(config_.port);
         
+        if (bind(fd, (struct sockaddr*)&address, sizeof(address)) < 0) {
+            log("Bind failed");
 #ifdef _WIN32
-        closesocket(client_fd);
+            closesocket(fd);
 #else
-        close(client_fd);
+            close(fd);
+#endif
+            return -1;
+        }
+        
+        if (listen(fd, config_.max_connections) < 0) {
+            log("Listen failed");
+#ifdef _WIN32
+            closesocket(fd);
+#else
+            close(fd);
+#endif
+            return -1;
+        }
+        
+#ifdef __linux__
+        if (config_.io_model != IoModel::Select) {
+            fcntl(fd, F_SETFL, fcntl(fd, F_GETFL, 0) | O_NONBLOCK);
+        }
 #endif
+        return fd;
     }
     
-    void worker_thread() {
-        while (running_) {
+    void close_listeners() {
+        for (int fd : listen_fds_) {
 #ifdef _WIN32
-            fd_set read_fds;
-            FD_ZERO(&read_fds);
-            FD_SET((SOCKET)server_fd_, &read_fds);
-            
-            timeval timeout{0, 100000}; // 100ms timeout
-            
-            int activity = select(0, &read_fds, nullptr, nullptr, &timeout);
+            closesocket(fd);
 #else
-            fd_set read_fds;
-            FD_ZERO(&read_fds);
-            FD_SET(server_fd_, &read_fds);
-            
-            timeval timeout{0, 100000}; // 100ms timeout
-            
-            int activity = select(server_fd_ + 1, &read_fds, nullptr, nullptr, &timeout);
+            close(fd);
 #endif
-            
-            if (activity > 0) {
-                struct sockaddr_in client_addr;
-                socklen_t client_len = sizeof(client_addr);
-                
-                int client_fd = accept(server_fd_, (struct sockaddr*)&client_addr, &client_len);
-                
-                if (client_fd >= 0) {
-                    handle_connection(client_fd);
-                }
-            }
         }
+        listen_fds_.clear();
     }
     
 public:
-    HttpServer(const ServerConfig& config = ServerConfig()) : config_(config), server_fd_(-1) {
+    HttpServer(const ServerConfig& config = ServerConfig())
+        : config_(config),
+          static_cache_(config.static_cache_size, config.static_cache_max_file_size,
+                        std::chrono::milliseconds(config.static_cache_revalidate_ms)),
+          buffer_pool_(config.buffer_size > 0 ? config.buffer_size : 4096, config.buffer_pool_size) {
         initialize_sockets();
     }
     
@@ -327,9 +6090,41 @@ public:
     
     // Add a route
     HttpServer& route(const string& path, RouteHandler handler) {
-        routes_[path] = handler;
+        router_.add("", path, std::move(handler));
+        return *this;
+    }
+    
+    // Add a route whose request body is not buffered: each piece goes to a
+    // sink made by make_sink as it arrives, and handler runs once the whole
+    // body has been received (req.body_sink points at the sink)
+    HttpServer& stream_route(const string& method, const string& path, BodySinkFactory make_sink,
+                             RouteHandler handler) {
+        router_.add(method, path, std::move(handler), std::move(make_sink));
+        return *this;
+    }
+    
+    // Add a route for one method, e.g. route("GET", "/users/:id", handler)
+    HttpServer& route(const string& method, const string& path, RouteHandler handler) {
+        router_.add(method, path, std::move(handler));
+        return *this;
+    }
+    
+#ifdef MNETWORK_HAS_COROUTINES
+    // Add a coroutine route. The worker serves other connections while the
+    // handler is suspended in co_await. Needs IoModel::Epoll or IoModel::IoUring;
+    // start() fails under IoModel::Select.
+    HttpServer& async_route(const string& path, AsyncHandler handler) {
+        router_.add("", path, nullptr).async_handler = std::move(handler);
+        async_routes_ = true;
+        return *this;
+    }
+    
+    HttpServer& async_route(const string& method, const string& path, AsyncHandler handler) {
+        router_.add(method, path, nullptr).async_handler = std::move(handler);
+        async_routes_ = true;
         return *this;
     }
+#endif
     
     // Add middleware
     HttpServer& use(Middleware middleware) {
@@ -337,11 +6132,25 @@ public:
         return *this;
     }
     
+    // Receive buffer and request arena counters
+    AllocationStats allocation_stats() const {
+        AllocationStats stats;
+        buffer_pool_.stats(stats);
+        stats.arena_blocks = arena_upstream_.blocks();
+        stats.arena_bytes = arena_upstream_.bytes();
+        return stats;
+    }
+    
+    // Static file cache counters
+    StaticCache::Stats static_cache_stats() const {
+        return static_cache_.stats();
+    }
+    
     // Static file serving
     void static_files(const string& route_prefix, const string& directory) {
         string route_pattern = route_prefix + (route_prefix.back() == '/' ? "*" : "/*");
         
-        routes_[route_pattern] = [directory, route_prefix](const HttpRequest& req, HttpResponse& res) {
+        router_.add("", route_pattern, [this, directory, route_prefix](const HttpRequest& req, HttpResponse& res) {
             // Remove the route prefix from the path
             string relative_path = req.path;
             if (req.path.find(route_prefix) == 0) {
@@ -353,83 +6162,112 @@ public:
             
             string filepath = directory + relative_path;
             
-            ifstream file(filepath, ios::binary);
-            if (file) {
-                ostringstream content;
-                content << file.rdbuf();
-                
-                res.body = content.str();
-                
-                // Set appropriate content type based on file extension
-                size_t dot = filepath.find_last_of('.');
-                if (dot != string::npos) {
-                    string ext = filepath.substr(dot);
-                    static const map<string, string> mime_types = {
-                        {".html", "text/html"},
-                        {".htm", "text/html"},
-                        {".css", "text/css"},
-                        {".js", "application/javascript"},
-                        {".json", "application/json"},
-                        {".png", "image/png"},
-                        {".jpg", "image/jpeg"},
-                        {".jpeg", "image/jpeg"},
-                        {".gif", "image/gif"},
-                        {".txt", "text/plain"}
-                    };
-                    
-                    auto it = mime_types.find(ext);
-                    if (it != mime_types.end()) {
-                        res.set_header("Content-Type", it->second);
-                    }
-                }
-            } else {
+            // Small files come from memory, large ones are streamed with sendfile()
+            if (relative_path.find("..") != string::npos ||
+                !static_cache_.serve(filepath, req, res, compression_.get())) {
                 res.status_code = 404;
+                res.status_text = "Not Found";
                 res.body = "<h1>404 File Not Found</h1>";
             }
-        };
+        });
+    }
+    
+    // Compress responses for clients that accept gzip or deflate, following
+    // config's per-type rules. Needs zlib (MNETWORK_USE_ZLIB); without it
+    // responses go out as they are. Call before start().
+    HttpServer& compress(const CompressionConfig& config = CompressionConfig()) {
+#ifdef MNETWORK_HAS_ZLIB
+        compression_ = std::make_unique<CompressionConfig>(config);
+#else
+        (void)config;
+        log("zlib support is not compiled in, responses are not compressed");
+#endif
+        return *this;
+    }
+    
+    // Count requests and latencies per route and serve them at path in the
+    // Prometheus text format. Call before start(); without it nothing is
+    // recorded.
+    HttpServer& metrics_route(const string& path = "/metrics") {
+        if (!metrics_) {
+            metrics_ = std::make_unique<Metrics>();
+        }
+        router_.add("GET", path, [this](const HttpRequest&, HttpResponse& res) {
+            res.headers["Content-Type"] = "text/plain; version=0.0.4";
+            res.body = metrics_->prometheus();
+        });
+        return *this;
+    }
+    
+    // Recorded metrics, or nullptr without metrics_route()
+    const Metrics* metrics() const {
+        return metrics_.get();
     }
     
     // Start the server
     bool start() {
-        server_fd_ = socket(AF_INET, SOCK_STREAM, 0);
-        if (server_fd_ < 0) {
-            log("Failed to create socket");
+#if defined(__linux__) && !defined(MNETWORK_HAS_IO_URING)
+        if (config_.io_model == IoModel::IoUring) {
+            log("io_uring support is not compiled in, using epoll");
+            config_.io_model = IoModel::Epoll;
+        }
+#endif
+#ifndef __linux__
+        if (config_.io_model != IoModel::Select) {
+            log("Epoll and io_uring are not available on this platform, using select");
+            config_.io_model = IoModel::Select;
+        }
+#endif
+#ifndef SO_REUSEPORT
+        if (config_.reuse_port) {
+            log("SO_REUSEPORT is not available on this platform, using a shared listener");
+            config_.reuse_port = false;
+        }
+#endif
+        // A select worker has no event loop to resume a coroutine on
+        if (config_.io_model == IoModel::Select && async_routes_) {
+            log("Async routes need IoModel::Epoll or IoModel::IoUring");
             return false;
         }
         
-        // Enable port reuse
-        int opt = 1;
-#ifdef SO_REUSEADDR
-        setsockopt(server_fd_, SOL_SOCKET, SO_REUSEADDR, (const char*)&opt, sizeof(opt));
-#endif
+        // A select worker blocks on the one connection it holds, so a few idle
+        // keep-alive clients would leave none for new connections. Keep-alive
+        // is opt-in there, and never without an idle timeout, which would let
+        // a silent client hold its worker, and stop(), forever.
+        if (config_.io_model == IoModel::Select && config_.max_keep_alive_requests > 0) {
+            if (!config_.select_keep_alive) {
+                config_.max_keep_alive_requests = 0;
+            } else if (config_.keep_alive_timeout_ms <= 0) {
+                log("keep_alive_timeout_ms must be positive with IoModel::Select, disabling keep-alive");
+                config_.max_keep_alive_requests = 0;
+            }
+        }
         
-        struct sockaddr_in address{};
-        address.sin_family = AF_INET;
-        if (config_.host == "0.0.0.0") {
-            address.sin_addr.s_addr = INADDR_ANY;
-        } else {
-            inet_pton(AF_INET, config_.host.c_str(), &address.sin_addr);
+        if (config_.verbose || !config_.access_log.empty()) {
+            if (!logger_.start(config_.access_log, config_.log_buffer_size, config_.log_flush_interval_ms)) {
+                log("Failed to open access log " + config_.access_log);
+                return false;
+            }
         }
-        address.sin_port = htons(config_.port);
         
-        if (bind(server_fd_, (struct sockaddr*)&address, sizeof(address)) < 0) {
-            log("Bind failed");
-#ifdef _WIN32
-            closesocket(server_fd_);
-#else
-            close(server_fd_);
-#endif
-            return false;
+        // With reuse_port the kernel spreads incoming connections across one
+        // listener per worker instead of every worker contending on one queue
+        int listeners = config_.reuse_port ? std::max(config_.thread_pool_size, 1) : 1;
+        for (int i = 0; i < listeners; ++i) {
+            int fd = open_listener();
+            if (fd < 0) {
+                close_listeners();
+                return false;
+            }
+            listen_fds_.push_back(fd);
         }
         
-        if (listen(server_fd_, config_.max_connections) < 0) {
-            log("Listen failed");
-#ifdef _WIN32
-            closesocket(server_fd_);
-#else
-            close(server_fd_);
-#endif
-            return false;
+        if (config_.handler_threads > 0) {
+            if (config_.io_model == IoModel::Select) {
+                log("handler_threads needs IoModel::Epoll or IoModel::IoUring, running handlers on the workers");
+            } else {
+                handler_pool_ = std::make_unique<HandlerPool>(config_.handler_threads);
+            }
         }
         
         running_ = true;
@@ -437,7 +6275,7 @@ public:
         
         // Start worker threads
         for (int i = 0; i < config_.thread_pool_size; ++i) {
-            worker_threads_.emplace_back(&HttpServer::worker_thread, this);
+            worker_threads_.emplace_back(&HttpServer::worker_thread, this, i);
         }
         
         return true;
@@ -447,6 +6285,22 @@ public:
     void stop() {
         running_ = false;
         
+#ifdef __linux__
+        {
+            lock_guard<std::mutex> lock(loops_mutex_);
+            for (EventLoop* loop : loops_) {
+                loop->stop();
+            }
+#ifdef MNETWORK_HAS_IO_URING
+            for (int fd : uring_wake_fds_) {
+                uint64_t one = 1;
+                ssize_t written = write(fd, &one, sizeof(one));
+                (void)written;
+            }
+#endif
+        }
+#endif
+        
         for (auto& thread : worker_threads_) {
             if (thread.joinable()) {
                 thread.join();
@@ -454,16 +6308,22 @@ public:
         }
         worker_threads_.clear();
         
-        if (server_fd_ >= 0) {
-#ifdef _WIN32
-            closesocket(server_fd_);
-#else
-            close(server_fd_);
-#endif
-            server_fd_ = -1;
+        // The workers submit requests until they exit; results that arrive
+        // after that are dropped by their mailboxes
+        if (handler_pool_) {
+            handler_pool_->stop();
+            handler_pool_.reset();
         }
         
+        close_listeners();
+        
         log("Server stopped");
+        logger_.stop();
+    }
+    
+    // Log records dropped because a thread's buffer was full
+    uint64_t log_drops() const {
+        return logger_.drops();
     }
     
     // Run server in blocking mode
@@ -506,112 +6366,840 @@ void host_file(const string& filename, int port = 8080) {
     host(content.str(), port);
 }
 
+// Limits for the keep-alive connections HttpClient reuses
+struct PoolConfig {
+    size_t max_idle_per_host = 8;       // Idle connections kept open per host
+    size_t max_per_host = 64;           // Open connections per host, idle or in use
+    int idle_timeout_ms = 30000;        // Idle connections older than this are closed instead of reused
+    int acquire_timeout_ms = 10000;     // Wait for a free slot when max_per_host are in use
+};
+
+// Keep-alive connections shared by HttpClients, keyed by host and port.
+// Thread-safe. An idle connection is checked before it is handed out again,
+// and one the server has closed or written to in the meantime is discarded.
+class ConnectionPool {
+public:
+    // A checked-out connection; fd is -1 when the caller must open one
+    struct Lease {
+        int fd = -1;
+        bool reused = false;
+    };
+    
+    struct Stats {
+        uint64_t opened = 0;            // Slots handed out for new connections
+        uint64_t reused = 0;
+        uint64_t discarded = 0;         // Idle connections found closed or expired
+    };
+    
+    explicit ConnectionPool(const PoolConfig& config = PoolConfig()) : config_(config) {}
+    
+    ~ConnectionPool() { clear(); }
+    
+    ConnectionPool(const ConnectionPool&) = delete;
+    ConnectionPool& operator=(const ConnectionPool&) = delete;
+    
+    // Pool used by HttpClients that are not given one
+    static std::shared_ptr<ConnectionPool> shared() {
+        static std::shared_ptr<ConnectionPool> pool = std::make_shared<ConnectionPool>();
+        return pool;
+    }
+    
+    // Take the most recently used live connection to host:port, or a slot
+    // for a new one. Throws if max_per_host stay in use for acquire_timeout_ms.
+    Lease acquire(const string& host, int port) {
+        string key = host + ":" + std::to_string(port);
+        auto deadline = std::chrono::steady_clock::now() +
+            std::chrono::milliseconds(config_.acquire_timeout_ms);
+        std::unique_lock<std::mutex> lock(mutex_);
+        while (true) {
+            Host& entry = hosts_[key];
+            if (!entry.idle.empty()) {
+                Idle idle = entry.idle.back();
+                entry.idle.pop_back();
+                bool expired = std::chrono::steady_clock::now() - idle.since >
+                    std::chrono::milliseconds(config_.idle_timeout_ms);
+                lock.unlock();
+                bool usable = !expired && alive(idle.fd);
+                if (!usable) close(idle.fd);
+                lock.lock();
+                if (usable) {
+                    ++stats_.reused;
+                    return {idle.fd, true};
+                }
+                ++stats_.discarded;
+                --hosts_[key].open;
+                continue;
+            }
+            if (entry.open < config_.max_per_host) {
+                ++entry.open;
+                ++stats_.opened;
+                return {-1, false};
+            }
+            if (available_.wait_until(lock, deadline) == std::cv_status::timeout) {
+                throw std::runtime_error("No connection to " + key + " became free");
+            }
+        }
+    }
+    
+    // Hand a leased connection back; one that is not reusable is closed.
+    // fd -1 gives back a slot whose connection could not be opened.
+    void release(const string& host, int port, int fd, bool reusable) {
+        string key = host + ":" + std::to_string(port);
+        {
+            lock_guard<std::mutex> lock(mutex_);
+            Host& entry = hosts_[key];
+            if (fd >= 0 && reusable && entry.idle.size() < config_.max_idle_per_host) {
+                entry.idle.push_back({fd, std::chrono::steady_clock::now()});
+                fd = -1;
+            } else {
+                --entry.open;
+            }
+        }
+        if (fd >= 0) close(fd);
+        available_.notify_one();
+    }
+    
+    // Close every idle connection
+    void clear() {
+        vector<int> fds;
+        {
+            lock_guard<std::mutex> lock(mutex_);
+            for (auto& [key, entry] : hosts_) {
+                for (const Idle& idle : entry.idle) {
+                    fds.push_back(idle.fd);
+                }
+                entry.open -= entry.idle.size();
+                entry.idle.clear();
+            }
+        }
+        for (int fd : fds) {
+            close(fd);
+        }
+        available_.notify_all();
+    }
+    
+    Stats stats() const {
+        lock_guard<std::mutex> lock(mutex_);
+        return stats_;
+    }
+    
+    // An idle connection must have nothing to read: readable means the
+    // server closed it or sent bytes no request asked for
+    static bool alive(int fd) {
+#ifdef _WIN32
+        fd_set read_fds;
+        FD_ZERO(&read_fds);
+        FD_SET(fd, &read_fds);
+        timeval zero{0, 0};
+        return select(0, &read_fds, nullptr, nullptr, &zero) == 0;
+#else
+        pollfd entry{fd, POLLIN, 0};
+        return poll(&entry, 1, 0) == 0;
+#endif
+    }
+    
+private:
+    struct Idle {
+        int fd;
+        std::chrono::steady_clock::time_point since;
+    };
+    
+    struct Host {
+        vector<Idle> idle;              // Most recently used last
+        size_t open = 0;                // Idle and leased
+    };
+    
+    PoolConfig config_;
+    mutable std::mutex mutex_;
+    std::condition_variable available_;
+    std::unordered_map<string, Host> hosts_;
+    Stats stats_;
+};
+
 // Simple HTTP Client
 class HttpClient {
 private:
     string host_;
     int port_;
+    std::shared_ptr<ConnectionPool> pool_;
     
 public:
-    HttpClient(const string& host = "localhost", int port = 80) 
-        : host_(host), port_(port) {}
+    // Requests reuse keep-alive connections from pool; without one, each
+    // request opens its own connection and closes it afterwards
+    HttpClient(const string& host = "localhost", int port = 80,
+               std::shared_ptr<ConnectionPool> pool = ConnectionPool::shared())
+        : host_(host), port_(port), pool_(std::move(pool)) {}
     
     HttpResponse get(const string& path, 
                     const map<string, string>& headers = {}) {
-        int sock = socket(AF_INET, SOCK_STREAM, 0);
-        if (sock < 0) {
-            throw std::runtime_error("Failed to create socket");
+        string body;
+        CallbackBodySink sink([&body](std::string_view piece) {
+            body.append(piece);
+            return true;
+        });
+        HttpResponse response = get(path, sink, headers);
+        response.body = std::move(body);
+        return response;
+    }
+    
+    // get() that passes the body to sink as it arrives instead of keeping
+    // it in the response, so large bodies need no more memory than a buffer
+    HttpResponse get(const string& path, BodySink& sink,
+                    const map<string, string>& headers = {}) {
+        string request_str = build_request(path, headers, pool_ != nullptr);
+        ResponseParser parser;
+        while (true) {
+            ConnectionPool::Lease lease;
+            if (pool_) {
+                lease = pool_->acquire(host_, port_);
+            }
+            int sock = lease.fd;
+            if (sock < 0) {
+                try {
+                    sock = open_connection();
+                } catch (...) {
+                    if (pool_) pool_->release(host_, port_, -1, false);
+                    throw;
+                }
+            }
+            
+            parser.reset();
+            bool reusable = false;
+            bool received = false;
+            bool ok = send_all(sock, request_str) && read_response(sock, parser, sink, reusable, received);
+            if (pool_) {
+                pool_->release(host_, port_, sock, ok && reusable);
+            } else {
+                close(sock);
+            }
+            if (ok) {
+                if (!sink.finish()) {
+                    throw std::runtime_error("Failed to store response body");
+                }
+                return std::move(parser.response());
+            }
+            // The server may close an idle connection just as it is reused;
+            // nothing was answered, so the request is sent again on another
+            if (!lease.reused || received) {
+                throw std::runtime_error(received ? "Invalid response" : "Connection lost");
+            }
+        }
+    }
+    
+    // Store the body of path in file. A body that does not arrive
+    // completely leaves no file behind.
+    HttpResponse download(const string& path, const string& file,
+                          const map<string, string>& headers = {}) {
+        std::unique_ptr<FileBodySink> sink = FileBodySink::create(file);
+        if (!sink) {
+            throw std::runtime_error("Failed to create " + file);
+        }
+        return get(path, *sink, headers);
+    }
+    
+#ifdef MNETWORK_HAS_COROUTINES
+    // get() for coroutines: the request runs on the current EventLoop, which
+    // keeps serving other work while the response is outstanding
+    Task<HttpResponse> async_get(string path, map<string, string> headers = {}) {
+        AsyncSocket socket = co_await AsyncSocket::connect(host_, port_);
+        if (!co_await socket.write(build_request(path, headers))) {
+            throw std::runtime_error("Send failed");
         }
         
-        struct sockaddr_in server_addr{};
-        server_addr.sin_family = AF_INET;
-        server_addr.sin_port = htons(port_);
-        
-        if (inet_pton(AF_INET, host_.c_str(), &server_addr.sin_addr) <= 0) {
+        ResponseParser parser;
+        string body;
+        auto on_data = [&body](std::string_view piece) {
+            body.append(piece);
+            return true;
+        };
+        char buffer[4096];
+        ResponseParser::Status status = ResponseParser::Status::Incomplete;
+        while (status == ResponseParser::Status::Incomplete) {
+            ssize_t bytes_received = co_await socket.read(buffer, sizeof(buffer));
+            size_t consumed = 0;
+            status = bytes_received > 0
+                ? parser.feed(buffer, static_cast<size_t>(bytes_received), consumed, on_data)
+                : parser.finish();
+        }
+        if (status == ResponseParser::Status::Error) {
+            throw std::runtime_error("Invalid response");
+        }
+        HttpResponse response = std::move(parser.response());
+        response.body = std::move(body);
+        co_return response;
+    }
+#endif
+    
+private:
+    // Connect to the first of host's addresses that accepts
+    int open_connection() const {
+        for (const Resolver::Address& address : Resolver::shared()->resolve(host_, port_)) {
+            int sock = socket(address.family(), SOCK_STREAM, 0);
+            if (sock < 0) {
+                continue;
+            }
+            if (connect(sock, address.get(), address.length) == 0) {
+                return sock;
+            }
 #ifdef _WIN32
             closesocket(sock);
 #else
             close(sock);
 #endif
-            throw std::runtime_error("Invalid address");
         }
-        
-        if (connect(sock, (struct sockaddr*)&server_addr, sizeof(server_addr)) < 0) {
-#ifdef _WIN32
-            closesocket(sock);
+        throw std::runtime_error("Connection failed");
+    }
+    
+    static bool send_all(int sock, const string& data) {
+#ifdef MSG_NOSIGNAL
+        const int flags = MSG_NOSIGNAL;     // A closed pooled connection must not raise SIGPIPE
 #else
-            close(sock);
+        const int flags = 0;
 #endif
-            throw std::runtime_error("Connection failed");
+        size_t sent = 0;
+        while (sent < data.size()) {
+            ssize_t n = send(sock, data.data() + sent, static_cast<int>(data.size() - sent), flags);
+            if (n < 0 && errno == EINTR) continue;
+            if (n <= 0) return false;
+            sent += static_cast<size_t>(n);
         }
-        
-        // Build request
+        return true;
+    }
+    
+    // Read one response into parser, passing its body to sink. reusable
+    // tells whether the connection can carry another request; received
+    // whether any byte of a response arrived.
+    static bool read_response(int sock, ResponseParser& parser, BodySink& sink,
+                              bool& reusable, bool& received) {
+        char buffer[16384];
+        auto on_data = [&sink](std::string_view piece) { return sink.write(piece); };
+        while (true) {
+            ssize_t n;
+            do {
+                n = recv(sock, buffer, sizeof(buffer), 0);
+            } while (n < 0 && errno == EINTR);
+            if (n < 0) return false;
+            
+            size_t consumed = 0;
+            ResponseParser::Status status;
+            if (n > 0) {
+                received = true;
+                status = parser.feed(buffer, static_cast<size_t>(n), consumed, on_data);
+            } else {
+                status = parser.finish();
+            }
+            if (status == ResponseParser::Status::Error) return false;
+            if (status == ResponseParser::Status::Complete) {
+                // Bytes past the response were never asked for
+                reusable = parser.keep_alive() && consumed == static_cast<size_t>(n);
+                return true;
+            }
+        }
+    }
+    
+    string build_request(const string& path, const map<string, string>& headers,
+                         bool keep_alive = false) const {
         ostringstream request;
         request << "GET " << path << " HTTP/1.1\r\n";
-        request << "Host: " << host_ << "\r\n";
+        request << "Host: " << host_header(host_) << "\r\n";
         for (const auto& [key, value] : headers) {
             request << key << ": " << value << "\r\n";
         }
-        request << "Connection: close\r\n\r\n";
-        
-        // Send request
-        string request_str = request.str();
-        send(sock, request_str.c_str(), request_str.size(), 0);
+        request << (keep_alive ? "\r\n" : "Connection: close\r\n\r\n");
+        return request.str();
+    }
+};
+
+#ifdef __linux__
+// Limits for AsyncHttpClient
+struct AsyncClientConfig {
+    size_t max_connections = 256;       // Open connections; further requests wait for one
+    size_t max_idle = 32;               // Idle keep-alive connections kept open
+    int idle_timeout_ms = 30000;        // Idle connections older than this are closed instead of reused
+    int timeout_ms = 10000;             // Default limit for a request, from start to complete response
+};
+
+// Client for many concurrent requests to one host, multiplexed over
+// non-blocking keep-alive connections by an EventLoop: either one the
+// client runs on a thread of its own, or one the caller runs, such as an
+// HttpServer worker's. Requests can be started from any thread; their
+// callbacks run on the loop's thread.
+class AsyncHttpClient {
+public:
+    // Receives the response, or the std::runtime_error that ended the request
+    using Callback = std::function<void(std::exception_ptr error, HttpResponse& response)>;
+    
+    AsyncHttpClient(const string& host, int port, const AsyncClientConfig& config = AsyncClientConfig())
+        : own_loop_(std::make_unique<EventLoop>()), loop_(own_loop_.get()),
+          core_(std::make_shared<Core>(*loop_, host, port, config)) {
+        thread_ = std::thread([loop = loop_] { loop->run(); });
+    }
+    
+    // Run on loop, which must keep running while requests are in flight and outlive the client
+    AsyncHttpClient(EventLoop& loop, const string& host, int port,
+                    const AsyncClientConfig& config = AsyncClientConfig())
+        : loop_(&loop), core_(std::make_shared<Core>(loop, host, port, config)) {}
+    
+    AsyncHttpClient(const AsyncHttpClient&) = delete;
+    AsyncHttpClient& operator=(const AsyncHttpClient&) = delete;
+    
+    // Requests still in flight fail with "Client closed"
+    ~AsyncHttpClient() {
+        if (own_loop_) {
+            loop_->stop();
+            thread_.join();
+            core_->shutdown();
+        } else if (EventLoop::current() == loop_) {
+            core_->shutdown();
+        } else {
+            loop_->post([core = core_] { core->shutdown(); });
+        }
+    }
+    
+    // Start a GET; done runs on the loop thread when it completes, fails or
+    // times out. timeout_ms 0 uses the configured default.
+    void get(const string& path, Callback done, const map<string, string>& headers = {},
+             int timeout_ms = 0) {
+        auto exchange = std::make_shared<Exchange>();
+        exchange->request = core_->build_request(path, headers);
+        exchange->done = std::move(done);
+        exchange->timeout_ms = timeout_ms;
+        if (EventLoop::current() == loop_) {
+            core_->start(exchange);
+        } else {
+            loop_->post([core = core_, exchange] { core->start(exchange); });
+        }
+    }
+    
+    // get() with the outcome delivered through a future. Do not wait on it
+    // from the loop thread, which has to run for it to complete.
+    std::future<HttpResponse> get_future(const string& path, const map<string, string>& headers = {},
+                                         int timeout_ms = 0) {
+        auto promise = std::make_shared<std::promise<HttpResponse>>();
+        std::future<HttpResponse> future = promise->get_future();
+        get(path, [promise](std::exception_ptr error, HttpResponse& response) {
+            if (error) {
+                promise->set_exception(error);
+            } else {
+                promise->set_value(std::move(response));
+            }
+        }, headers, timeout_ms);
+        return future;
+    }
+    
+#ifdef MNETWORK_HAS_COROUTINES
+    // Response of a request started by async_get(); co_await it for the
+    // response, which rethrows the request's error
+    class Pending {
+    public:
+        bool await_ready() const {
+            lock_guard<std::mutex> lock(state_->mutex);
+            return state_->done;
+        }
         
-        // Receive response
-        string response_str;
-        char buffer[4096];
-        ssize_t bytes_received;
+        bool await_suspend(std::coroutine_handle<> handle) {
+            lock_guard<std::mutex> lock(state_->mutex);
+            if (state_->done) return false;
+            state_->waiter = handle;
+            state_->home = EventLoop::current();
+            return true;
+        }
         
-        while ((bytes_received = recv(sock, buffer, sizeof(buffer) - 1, 0)) > 0) {
-            buffer[bytes_received] = '\0';
-            response_str.append(buffer, bytes_received);
+        HttpResponse await_resume() {
+            if (state_->error) std::rethrow_exception(state_->error);
+            return std::move(state_->response);
         }
         
-#ifdef _WIN32
-        closesocket(sock);
-#else
-        close(sock);
+    private:
+        friend class AsyncHttpClient;
+        
+        struct State {
+            std::mutex mutex;
+            bool done = false;
+            std::exception_ptr error;
+            HttpResponse response;
+            std::coroutine_handle<> waiter;
+            EventLoop* home = nullptr;      // Loop the awaiting coroutine resumes on
+        };
+        
+        explicit Pending(std::shared_ptr<State> state) : state_(std::move(state)) {}
+        
+        std::shared_ptr<State> state_;
+    };
+    
+    // Start a GET now and await it later, so a coroutine can have several in
+    // flight at once. The coroutine resumes on the loop it awaited from.
+    Pending async_get(const string& path, const map<string, string>& headers = {}, int timeout_ms = 0) {
+        auto state = std::make_shared<Pending::State>();
+        get(path, [state](std::exception_ptr error, HttpResponse& response) {
+            std::coroutine_handle<> waiter;
+            EventLoop* home;
+            {
+                lock_guard<std::mutex> lock(state->mutex);
+                state->error = error;
+                state->response = std::move(response);
+                state->done = true;
+                waiter = state->waiter;
+                home = state->home;
+            }
+            if (!waiter) return;
+            if (home && home != EventLoop::current()) {
+                home->post([waiter] { waiter.resume(); });
+            } else {
+                waiter.resume();
+            }
+        }, headers, timeout_ms);
+        return Pending(std::move(state));
+    }
 #endif
+    
+private:
+    // One request, from start until its callback has run
+    struct Exchange {
+        string request;
+        size_t sent = 0;
+        int fd = -1;
+        bool connecting = false;
+        bool reused = false;
+        bool received = false;
+        int timeout_ms = 0;
+        bool has_timer = false;
+        EventLoop::TimerId timer;
+        Resolver::Addresses addresses;  // Left to try for a new connection
+        size_t next_address = 0;
+        ResponseParser parser;
+        string body;
+        Callback done;
+    };
+    
+    // Connections and requests; used on the loop thread only
+    class Core : public std::enable_shared_from_this<Core> {
+    public:
+        Core(EventLoop& loop, const string& host, int port, const AsyncClientConfig& config)
+            : loop_(loop), host_(host), port_(port), config_(config) {}
         
-        // Parse response
-        HttpResponse response;
-        istringstream response_stream(response_str);
-        string line;
+        string build_request(const string& path, const map<string, string>& headers) const {
+            string request = "GET " + path + " HTTP/1.1\r\nHost: " + host_header(host_) + "\r\n";
+            for (const auto& [key, value] : headers) {
+                request += key + ": " + value + "\r\n";
+            }
+            request += "\r\n";
+            return request;
+        }
+        
+        void start(const std::shared_ptr<Exchange>& exchange) {
+            if (closed_) {
+                complete(exchange, std::make_exception_ptr(std::runtime_error("Client closed")));
+                return;
+            }
+            int timeout_ms = exchange->timeout_ms > 0 ? exchange->timeout_ms : config_.timeout_ms;
+            exchange->timer = loop_.run_after(std::chrono::milliseconds(timeout_ms), [this, exchange] {
+                exchange->has_timer = false;
+                fail(exchange, "Request timed out");
+            });
+            exchange->has_timer = true;
+            pending_.emplace(exchange.get(), exchange);
+            if (!acquire(exchange)) {
+                waiting_.push_back(exchange);
+            }
+        }
+        
+        // Fail everything in flight and close idle connections
+        void shutdown() {
+            {
+                lock_guard<std::mutex> lock(post_mutex_);
+                accepting_ = false;
+            }
+            closed_ = true;
+            vector<std::shared_ptr<Exchange>> pending;
+            for (auto& [key, exchange] : pending_) {
+                pending.push_back(exchange);
+            }
+            for (auto& exchange : pending) {
+                fail(exchange, "Client closed");
+            }
+            for (const Idle& idle : idle_) {
+                ::close(idle.fd);
+            }
+            open_ -= idle_.size();
+            idle_.clear();
+        }
+        
+    private:
+        struct Idle {
+            int fd;
+            std::chrono::steady_clock::time_point since;
+        };
         
-        // Parse status line
-        if (std::getline(response_stream, line)) {
-            istringstream status_stream(line);
-            string http_version;
-            status_stream >> http_version >> response.status_code;
-            std::getline(status_stream, response.status_text);
+        // Give exchange a connection: an idle one that is still usable, or a
+        // new one. False when max_connections are busy.
+        bool acquire(const std::shared_ptr<Exchange>& exchange) {
+            while (!idle_.empty()) {
+                Idle idle = idle_.back();
+                idle_.pop_back();
+                bool expired = std::chrono::steady_clock::now() - idle.since >
+                    std::chrono::milliseconds(config_.idle_timeout_ms);
+                if (!expired && ConnectionPool::alive(idle.fd)) {
+                    exchange->fd = idle.fd;
+                    exchange->reused = true;
+                    attach(exchange);
+                    return true;
+                }
+                ::close(idle.fd);
+                --open_;
+            }
+            if (open_ >= config_.max_connections) {
+                return false;
+            }
             
-            // Remove leading space from status text
-            if (!response.status_text.empty() && response.status_text[0] == ' ') {
-                response.status_text = response.status_text.substr(1);
+            Resolver::Addresses addresses;
+            if (!Resolver::shared()->cached(host_, port_, addresses)) {
+                resolve();
+                return false;
             }
+            ++open_;
+            exchange->reused = false;
+            exchange->addresses = std::move(addresses);
+            exchange->next_address = 0;
+            connect_next(exchange);
+            return true;
         }
         
-        // Parse headers
-        while (std::getline(response_stream, line) && line != "\r") {
-            size_t colon = line.find(':');
-            if (colon != string::npos) {
-                string key = line.substr(0, colon);
-                string value = line.substr(colon + 2);
-                if (!value.empty() && value.back() == '\r') {
-                    value.pop_back();
+        // Connect to the next of the host's addresses. The exchange holds its
+        // slot in open_ until none is left.
+        void connect_next(const std::shared_ptr<Exchange>& exchange) {
+            while (exchange->next_address < exchange->addresses.size()) {
+                const Resolver::Address& address = exchange->addresses[exchange->next_address++];
+                int fd = socket(address.family(), SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+                if (fd < 0) {
+                    continue;
                 }
-                response.headers[key] = value;
+                if (::connect(fd, address.get(), address.length) < 0 && errno != EINPROGRESS) {
+                    ::close(fd);
+                    continue;
+                }
+                exchange->fd = fd;
+                exchange->connecting = true;
+                attach(exchange);
+                return;
             }
+            --open_;
+            fail(exchange, "Connection failed");
         }
         
-        // Get body
-        ostringstream body_stream;
-        body_stream << response_stream.rdbuf();
-        response.body = body_stream.str();
+        // Look the host up off the loop thread; waiting requests go on once
+        // its addresses are cached
+        void resolve() {
+            if (resolving_) return;
+            resolving_ = true;
+            std::weak_ptr<Core> weak = weak_from_this();
+            Resolver::shared()->resolve_async(host_, port_,
+                [weak](std::exception_ptr error, const Resolver::Addresses&) {
+                    if (std::shared_ptr<Core> core = weak.lock()) {
+                        core->post([core, error] { core->resolved(error); });
+                    }
+                });
+        }
         
-        return response;
-    }
+        void resolved(std::exception_ptr error) {
+            resolving_ = false;
+            if (error) {
+                std::deque<std::shared_ptr<Exchange>> waiting;
+                waiting.swap(waiting_);
+                for (auto& exchange : waiting) {
+                    fail(exchange, error);
+                }
+                return;
+            }
+            pump();
+        }
+        
+        // Queue a task on the loop from another thread, unless shut down
+        void post(std::function<void()> task) {
+            lock_guard<std::mutex> lock(post_mutex_);
+            if (accepting_) {
+                loop_.post(std::move(task));
+            }
+        }
+        
+        void attach(const std::shared_ptr<Exchange>& exchange) {
+            bool added = loop_.add(exchange->fd, EPOLLOUT,
+                [this, exchange](uint32_t events) { on_event(exchange, events); });
+            if (!added) {
+                fail(exchange, "Failed to register socket");
+            }
+        }
+        
+        void on_event(const std::shared_ptr<Exchange>& exchange, uint32_t) {
+            if (exchange->connecting) {
+                int error = 0;
+                socklen_t length = sizeof(error);
+                if (getsockopt(exchange->fd, SOL_SOCKET, SO_ERROR, &error, &length) < 0 || error != 0) {
+                    loop_.remove(exchange->fd);
+                    ::close(std::exchange(exchange->fd, -1));
+                    connect_next(exchange);
+                    return;
+                }
+                exchange->connecting = false;
+            }
+            
+            if (exchange->sent < exchange->request.size()) {
+                while (exchange->sent < exchange->request.size()) {
+                    ssize_t n = send(exchange->fd, exchange->request.data() + exchange->sent,
+                                     exchange->request.size() - exchange->sent, MSG_NOSIGNAL);
+                    if (n > 0) {
+                        exchange->sent += static_cast<size_t>(n);
+                    } else if (n < 0 && errno == EINTR) {
+                        continue;
+                    } else if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+                        return;
+                    } else {
+                        lost(exchange);
+                        return;
+                    }
+                }
+                loop_.modify(exchange->fd, EPOLLIN | EPOLLRDHUP);
+                return;
+            }
+            
+            char buffer[16384];
+            auto on_data = [&exchange](std::string_view piece) {
+                exchange->body.append(piece);
+                return true;
+            };
+            while (true) {
+                ssize_t n = recv(exchange->fd, buffer, sizeof(buffer), 0);
+                if (n < 0) {
+                    if (errno == EINTR) continue;
+                    if (errno == EAGAIN || errno == EWOULDBLOCK) return;
+                    lost(exchange);
+                    return;
+                }
+                if (n == 0 && !exchange->received) {
+                    lost(exchange);
+                    return;
+                }
+                
+                size_t consumed = 0;
+                ResponseParser::Status status;
+                if (n > 0) {
+                    exchange->received = true;
+                    status = exchange->parser.feed(buffer, static_cast<size_t>(n), consumed, on_data);
+                } else {
+                    status = exchange->parser.finish();
+                }
+                if (status == ResponseParser::Status::Error) {
+                    fail(exchange, "Invalid response");
+                    return;
+                }
+                if (status == ResponseParser::Status::Complete) {
+                    // Bytes past the response were never asked for
+                    bool reusable = exchange->parser.keep_alive() && consumed == static_cast<size_t>(n);
+                    std::shared_ptr<Core> self = shared_from_this();
+                    release(exchange, reusable);
+                    complete(exchange, nullptr);
+                    pump();
+                    return;
+                }
+            }
+        }
+        
+        // The connection closed before any of the response arrived. On a
+        // reused connection the server may have closed it as it went idle,
+        // so the request is sent again on another.
+        void lost(const std::shared_ptr<Exchange>& exchange) {
+            if (!exchange->reused || exchange->received) {
+                fail(exchange, "Connection lost");
+                return;
+            }
+            release(exchange, false);
+            exchange->sent = 0;
+            exchange->parser.reset();
+            exchange->body.clear();
+            if (!acquire(exchange)) {
+                waiting_.push_front(exchange);
+            }
+        }
+        
+        void fail(const std::shared_ptr<Exchange>& exchange, const char* error) {
+            fail(exchange, std::make_exception_ptr(std::runtime_error(error)));
+        }
+        
+        void fail(const std::shared_ptr<Exchange>& exchange, std::exception_ptr error) {
+            std::shared_ptr<Core> self = shared_from_this();
+            release(exchange, false);
+            auto queued = std::find(waiting_.begin(), waiting_.end(), exchange);
+            if (queued != waiting_.end()) {
+                waiting_.erase(queued);
+            }
+            complete(exchange, error);
+            pump();
+        }
+        
+        // Detach exchange from its connection, keeping the connection for
+        // another request if reusable
+        void release(const std::shared_ptr<Exchange>& exchange, bool reusable) {
+            int fd = std::exchange(exchange->fd, -1);
+            exchange->connecting = false;
+            if (fd < 0) return;
+            loop_.remove(fd);
+            if (reusable && !closed_ && idle_.size() < config_.max_idle) {
+                idle_.push_back({fd, std::chrono::steady_clock::now()});
+            } else {
+                ::close(fd);
+                --open_;
+            }
+        }
+        
+        void complete(const std::shared_ptr<Exchange>& exchange, std::exception_ptr error) {
+            if (exchange->has_timer) {
+                loop_.cancel(exchange->timer);
+                exchange->has_timer = false;
+            }
+            pending_.erase(exchange.get());
+            Callback done = std::move(exchange->done);
+            exchange->done = nullptr;
+            if (!done) return;
+            
+            HttpResponse response;
+            if (!error) {
+                response = std::move(exchange->parser.response());
+                response.body = std::move(exchange->body);
+            }
+            done(error, response);
+        }
+        
+        // Start waiting requests while connections are available
+        void pump() {
+            while (!waiting_.empty() && !closed_ && (!idle_.empty() || open_ < config_.max_connections)) {
+                std::shared_ptr<Exchange> exchange = waiting_.front();
+                waiting_.pop_front();
+                if (!acquire(exchange)) {
+                    waiting_.push_front(exchange);
+                    break;
+                }
+            }
+        }
+        
+        EventLoop& loop_;
+        string host_;
+        int port_;
+        AsyncClientConfig config_;
+        bool resolving_ = false;
+        bool closed_ = false;
+        size_t open_ = 0;               // Idle and in use
+        vector<Idle> idle_;             // Most recently used last
+        std::deque<std::shared_ptr<Exchange>> waiting_;
+        std::unordered_map<Exchange*, std::shared_ptr<Exchange>> pending_;
+        std::mutex post_mutex_;
+        bool accepting_ = true;         // Cleared by shutdown(); guarded by post_mutex_
+    };
+    
+    std::unique_ptr<EventLoop> own_loop_;
+    EventLoop* loop_;
+    std::shared_ptr<Core> core_;
+    std::thread thread_;
 };
+#endif
 
 } 
\ No newline at end of file